@@ -1,10 +1,81 @@
 /* 
-    Program uses the Input Side Algorithm to do time-domain convolution to apply a convolution reverb to an audio file. It is very, very slow as a result. You'd probably rather use an FFT implementation of this program if you're actually intersted in doing this type of convolution, since it is much faster.
-
-    This program takes an input .wav file (mono) and an inpulse response .wav file (mono) and produces a convolution reverb output .wav file (mono).
-
-    Assumptions:    - The inputs are 16-bit sample, 44.1 KHz, mono audio files.
-                    Audio files of other bit-precisions and sample rates will not work with this code as it is due to hard-coded values and the type-conversion method used.
+    Program applies a convolution reverb to an audio file. It has several convolution engines, and by default
+    a planner picks whichever it estimates will be fastest for the files' lengths (see planConvolution()).
+    --engine=direct uses the original Input Side Algorithm time-domain convolution, which is very, very slow.
+    --engine=fft uses the FFT overlap-add engine instead, which is much faster and produces the same output
+    (see convolveFFT() for the measured accuracy).
+    For very long impulse responses, --engine=upols splits the impulse response into equal partitions so that
+    the FFTs stay small (see convolveUniformPartitioned()), and --engine=nonuniform uses small partitions at the
+    head of the impulse response and bigger ones towards the tail, for low latency (see createNonUniformConvolver()).
+    --engine=hybrid adds a direct-form head in front of that, for zero latency (see createHybridConvolver()).
+    For short impulse responses (e.g. cabinet sims), --engine=simd does direct-form convolution with SSE,
+    AVX2 or AVX-512 kernels picked to suit the CPU at runtime (see convolveDirectSIMD()); --engine=blocked does
+    the same with cache blocking, for longer impulse responses (see convolveOutputSideBlocked()).
+
+    This program takes an input .wav file and an inpulse response .wav file and produces a convolution reverb output .wav file.
+    Both can have several channels (see planChannelRouting()): a mono impulse response is applied to every
+    channel of the input, a multichannel one channel by channel, and a 4-channel one to a stereo input is
+    true stereo (L->L, L->R, R->L, R->R).
+
+    The engines themselves are in libconvolve.c, which other programs can also link against and use
+    in-process, as a library (see libconvolve.h); this file is the command line program around them.
+
+    Usage:          convolve [options] inputFile impulseResponseFile outputFile
+                    convolve --make-irspec [--block-size=N] impulseResponseFile spectrumFile
+                    convolve --batch=LIST [options] impulseResponseFile outputDirectory
+                    convolve --sweep=LIST [options] inputFile outputDirectory
+                    convolve --daemon=SOCKET [options]
+                    convolve --submit=SOCKET [options] inputFile impulseResponseFile outputFile
+
+                    impulseResponseFile can be a .wav file or a spectrum file made with --make-irspec, which holds
+                    the impulse response's partition spectra ready for the upols engine (see loadIrSpectrum()).
+
+                    --engine=auto|direct|simd|blocked|fft|upols|nonuniform|hybrid   convolution engine to use
+                                          (default: auto, i.e. let the planner choose)
+                    --max-latency=N       for the planner: only consider engines with at most N samples of latency
+                    --calibrate           measure this machine's speed for the planner and save it to the wisdom file
+                    --wisdom=FILE         where the planner's measurements are kept (default: ~/.convolve_wisdom)
+                    --plan-cache=FILE     on-disk cache of FFT tables shared between runs, or "none" (default:
+                                          ~/.convolve_fftplans)
+                    --fft-size=N          FFT size for the fft engine, a power of 2 (default: chosen from the IR length)
+                    --block-size=N        (first) partition size for the upols and nonuniform engines, a power
+                                          of 2 (default: 2048). For nonuniform, this is also the latency.
+                    --crossover=K         number of taps the hybrid engine does in direct form, a power of 2
+                                          (default: picked by a quick benchmark at startup)
+                    --isa=auto|scalar|sse|avx2|avx512   instruction set for the simd/blocked engines' kernels (default: auto,
+                                          the best one the CPU supports)
+                    --precision=float|float-double|double|int16   sample and accumulator types for the direct
+                                          engine (default: float; see convolveDirectTyped())
+                    --threads=N           number of threads to split the convolution across, 0 for one per CPU
+                                          (default: 1)
+                    --verify              also run the direct engine and report the SNR of the chosen engine against it
+                    --stream              read, convolve and write the audio a block at a time, so memory use stays
+                                          the same however long the input is (upols, nonuniform or hybrid engines only)
+                    --normalize=peak|bound|none   how the output is brought into range: scaled by its peak (default;
+                                          with --stream, via a temporary file), by an upper bound of its peak
+                                          worked out beforehand, or not at all, with a limiter catching overs
+                    --make-irspec         precompute impulseResponseFile's partition spectra (for partitions of
+                                          --block-size samples) and save them to spectrumFile, instead of convolving
+                    --batch=LIST          convolve every input file in LIST with the impulse response, which is only
+                                          loaded and transformed once, --threads files at a time (see runBatch()).
+                                          LIST is a manifest file, a directory, or a quoted pattern such as '*.wav'
+                    --sweep=LIST          convolve inputFile with every impulse response in LIST, transforming the
+                                          input only once (see runSweep()). LIST is as for --batch
+                    --daemon=SOCKET       keep running, taking convolution jobs on the Unix socket SOCKET and doing
+                                          them --threads at a time, with the impulse responses and FFT tables
+                                          kept in memory from one job to the next (see runDaemon())
+                    --submit=SOCKET       have the daemon listening on SOCKET do this convolution, and wait for it
+                    --realtime=FRAMES     convolve as an audio callback would, FRAMES at a time, paced in real time,
+                                          with the real-time convolver (see createRealtimeConvolver()), and report
+                                          the worst-case time a callback took. --block-size sets its tail's
+                                          partition size
+                    --swap-ir=FILE        with --realtime: halfway through the input, switch to the impulse
+                                          response in FILE, loaded in the background (see createHotSwapConvolver())
+                    --crossfade=N         samples over which to crossfade from one impulse response to the next
+                                          (default: 4096)
+
+    Assumptions:    - The inputs are audio files of up to 8 channels, with 16, 24 or 32-bit integer or 32-bit float
+                    samples, at any sample rate. The output has the same sample format and rate as the input file.
 
                     - user enters filenames correctly (no error checking present)
 
@@ -17,10 +88,38 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
-
-
-const int SHOW_DEBUG_OUTPUT = 1;  // show debug/regression test data?  1 for yes, 0 for no
-const int SHOW_PROGRESS     = 1;  //  show progress while convolving?  1 for yes, 0 for no
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <glob.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "engine.h"
+
+
+#define IR_SPECTRUM_VERSION            1
+#define IR_SPECTRUM_ALIGNMENT          64     // bytes; enough for the widest vector loads (AVX-512)
+#define FINALIZE_CHUNK_SIZE            4096   // samples scaled at a time while finalizing the output (see finalizeSamples())
+#define OUTPUT_BUFFER_SIZE             65536  // samples converted before each write to the output file
+#define WAV_HEADER_BUFFER_SIZE         65536  // bytes of a .wav file read in one go while looking for its data chunk
+#define ERROR_MESSAGE_SIZE             512    // bytes: longest error message the try...() readers give back
+#define DAEMON_QUEUE_SIZE              64     // jobs the daemon holds waiting for a worker (see runDaemon())
+#define DAEMON_MAX_IMPULSES            256    // impulse responses it keeps loaded (the least recently used goes to make room)
+#define DAEMON_REQUEST_SIZE            8192   // bytes: longest job request it accepts
+#define LIMITER_CEILING                0.99   // --normalize=none: the limiter keeps samples within +- this
+#define LIMITER_RELEASE_SECONDS        0.05   //                   time for its gain to recover after a peak
 
 
 // struct to hold all .wav file header data
@@ -36,7 +135,7 @@ typedef struct {
     int   sample_rate;
     int   byte_rate;
     short block_align;
-    short bits_per_sample;  // <-- can assume is 16 for this assignment
+    short bits_per_sample;  // <-- 16, 24 or 32 (see sampleFormatOf())
 
     // Be careful: sometimes additional data exists between subchunks 1 and 2.
     // (some audio programs insert metadata into this part of the file)
@@ -47,6 +146,15 @@ typedef struct {
 } WavHeader;
 
 
+// the sample formats .wav files can be read and written in (see convertSamplesToFloat())
+typedef enum {
+    SAMPLE_INT16,
+    SAMPLE_INT24,    // packed: 3 bytes per sample
+    SAMPLE_INT32,
+    SAMPLE_FLOAT32
+} SampleFormat;
+
+
 // struct to keep file data organized.
 typedef struct {
     char* sample_name;
@@ -58,27 +166,264 @@ typedef struct {
     WavHeader header_sample;
     WavHeader header_impulse;
     WavHeader header_output;
+    Options options;
 } FileData;
 
 
+/*
+    The samples of a .wav file's data chunk, used in place: the file is memory-mapped, so nothing is read or
+    copied up front, and each block of samples is converted to float straight from the mapping when it's
+    needed (see mapWavData()).
+*/
+typedef struct {
+    char*  samples;             // the data chunk's samples (in the mapping, or a copy if the file couldn't be mapped)
+    int    num_samples;         // per channel
+    int    num_channels;        // interleaved: a frame of one sample per channel after another
+    SampleFormat format;
+    int    bytes_per_sample;
+    int    frame_size;          // bytes_per_sample * num_channels
+    void*  map;                 // the whole file, or NULL if it couldn't be mapped
+    size_t map_length;
+    size_t released;            // bytes of the mapping already handed back (see releaseWavSamplesBefore())
+} WavData;
+
+
+// running statistics of a set of float samples (see scanSamples())
+typedef struct {
+    float  highest;             // largest sample so far
+    float  lowest;              // smallest (most negative) sample so far
+    double sum;                 // for the mean
+    long   count;
+    long   outside;             // number of samples beyond +- 1.0
+} SampleStats;
+
+
+// state of the peak limiter used with --normalize=none (see limitSamples())
+typedef struct {
+    float gain;                 // gain currently applied
+    float release;              // per-sample factor by which the gain's distance below 1 shrinks
+} Limiter;
+
+
+/*
+    Start of an impulse response spectrum file (.irspec, see createIrSpectrumFile()). The impulse response's
+    samples (float) are stored at samples_offset, and the spectra of its num_partitions partitions (each
+    num_bins Complex values, in the same layout as UniformConvolver.partitions) at spectra_offset. Both
+    offsets are multiples of alignment.
+*/
+typedef struct {
+    char     magic[8];         // "CNVIRSPC"
+    uint32_t version;          // IR_SPECTRUM_VERSION
+    uint32_t isa;              // IsaLevel of the machine that made it (for information)
+    uint32_t alignment;        // IR_SPECTRUM_ALIGNMENT
+    uint32_t block_size;       // partition size B (FFT size is 2B)
+    uint32_t num_partitions;
+    uint32_t num_bins;         // B + 1
+    uint32_t ir_length;        // M
+    uint32_t sample_rate;
+    uint64_t samples_offset;
+    uint64_t spectra_offset;
+} IrSpectrumHeader;
+
+
+// a loaded (memory-mapped) impulse response spectrum file
+typedef struct {
+    IrSpectrumHeader* header;  // start of the mapping
+    size_t   length;           // of the mapping
+    float*   samples;          // h[], M samples
+    Complex* partitions;       // partition spectra, for createUniformConvolverFromSpectra()
+} IrSpectrum;
+
+
+/*
+    What all the workers of a batch run share (see runBatch()), or of a sweep (see runSweep()), where it's
+    the other way round: the input is fixed, and the files in the list are impulse responses. Only the
+    counters change once the workers have started.
+*/
+typedef struct {
+    Options    plan;               // the same for every file, with h[]'s spectra worked out in advance if upols
+    float*     h[MAX_CHANNELS];    // batch: the impulse response, one array per channel
+    int        M;
+    int        num_impulses;       // its number of channels
+    bool       sweep;
+    float*     x[MAX_CHANNELS];    // sweep: the input, one array per channel
+    int        N;
+    int        num_inputs;         // its number of channels
+    WavHeader  header;             // its header (the outputs are written in its format)
+    FftPlan*   fft_plan;           // size 2 * plan.block_size
+    Complex*   x_spectra[MAX_CHANNELS];  // spectra of each channel's overlap-save windows, num_bins apiece
+    int        num_x_blocks;       // number of those, after which they're all zero
+    char**     inputs;             // the files to convolve (or impulse responses to convolve with), and the
+    char**     outputs;            // output file for each
+    int        num_files;
+    atomic_int next;               // the next file to be picked up by a worker
+    atomic_int failed;
+    double     audio_seconds;      // total length of the inputs done so far
+    pthread_mutex_t lock;          // held while adding to audio_seconds and printing
+} BatchRun;
+
+
+// a worker thread of a batch run, and the buffers it keeps from one file to the next (grown as needed)
+typedef struct {
+    BatchRun*  run;
+    pthread_t  thread;
+    float*     x[MAX_CHANNELS];    // input channels (impulse response channels, for a sweep)
+    size_t     x_capacity[MAX_CHANNELS];
+    float*     y[MAX_CHANNELS];    // output channels
+    size_t     y_capacity[MAX_CHANNELS];
+    float*     frames;             // output channels interleaved
+    size_t     frames_capacity;
+} BatchWorker;
+
+
+/*
+    An impulse response the daemon has loaded, kept for every later job that uses the same file (see
+    findDaemonImpulse()). Its upols partition spectra are worked out the first time a job needs them at a
+    given block size, and the hybrid engine's crossover the first time it's used; after that, nothing
+    changes, so jobs can use it without holding a lock. It stays loaded while any job is using it; once
+    none is, it can be dropped to make room for another.
+
+    It's loaded by the first job's worker without the daemon's impulses_lock held, so other workers aren't
+    held up meanwhile (unless they want the same one, in which case they wait for it to finish loading).
+*/
+typedef struct {
+    char*        name;             // the file, as given in the jobs (NULL if this slot is empty)
+    IrSpectrum*  spectrum;         // if it's a spectrum file (then h[0] is its samples), else NULL
+    float*       h[MAX_CHANNELS];  // one array per channel
+    int          M;
+    int          num_impulses;     // number of channels
+    Complex*     partitions[32];   // the partition spectra of all its channels, one after another, for a
+                                   // block size of 1 << i (NULL until needed)
+    int          crossover;        // for the hybrid engine, 0 until benchmarked
+    int          users;            // jobs using it right now (see releaseDaemonImpulse())
+    double       last_used;        // secondsNow() when a job last started using it
+    bool         loading;          // being loaded by the first job to use it (see findDaemonImpulse())
+    pthread_mutex_t lock;          // held while working out its partition spectra or crossover
+} DaemonImpulse;
+
+
+// a convolution job: its submitter's connection waits in the daemon's queue, and the rest is filled in from
+// its request by the worker that takes it
+typedef struct {
+    int        client;             // the submitter's connection, which the request is read from and the result sent back on
+    Options    options;            // engine settings asked for (the rest are the daemon's)
+    char*      input;              // the files (absolute paths, as the daemon's directory may differ)
+    char*      impulse;
+    char*      output;
+    double     queued_at;          // secondsNow() when it was accepted
+} DaemonJob;
+
+
+// the state of a daemon run (see runDaemon()), shared by its threads
+typedef struct {
+    Options    options;            // its own command line options, the defaults for each job
+    DaemonJob  queue[DAEMON_QUEUE_SIZE];  // circular
+    int        queue_start;        // where the oldest job is
+    int        queue_length;
+    pthread_mutex_t lock;          // held while using the queue and the totals
+    pthread_cond_t  queue_changed; // signalled when a job is added to or taken from the queue
+    DaemonImpulse impulses[DAEMON_MAX_IMPULSES];
+    int        num_impulses;       // slots of impulses[] used so far (some may be empty again)
+    pthread_mutex_t impulses_lock; // held while looking up, adding or dropping an impulse response (not while loading one)
+    pthread_cond_t  impulse_loaded;  // broadcast when one has finished loading (or failed to)
+    long       jobs_done;          // totals since the daemon started
+    long       jobs_failed;
+    double     audio_seconds;
+    double     latency_seconds;    // summed over the jobs done: time from being accepted to being answered
+} Daemon;
+
+
 // ----- FUNCTION PROTOTYPES --------------------------------------------------
  void processCommandLineArgs(int, char*[], FileData*);
+ void printUsageAndExit(char*);
+EngineType engineTypeFromName(char*, char*);
  void openFileStreams(FileData*);
  void closeFileStreams(FileData*);
  void createOutputFile(FileData*);
- void readInputFileHeaders(FileData*);
- void getDataSamplesFromInputFiles(short[], int, short[], int, FileData*);
- void skipPastNullBytesInInputFileHeadersIfPresent(FileData*);
- void ensureSubchunk2_idIsSetProperly(FileData*);
- void createFloatSamplesFromIntegerSamples(short*, int, float*);
- void createShortIntegerSamplesFromFloatSamples(float*, int, short*);
- void writeOutputFile(FileData*, short[], int);
+ void streamOutputFile(FileData*);
+Options planConvolutionWithSpectrum(Options*, IrSpectrum*, int, int);
+ void writeOutputFileHeader(FileData*, int, int);
+ void writeScaledBlock(FileData*, float[], int, float, void*);
+float normalizeOutput(Options*, float*[], int, float*[], int, ChannelRouting*, float[], int, int);
+ void finalizeOutputFile(FileData*, float[], int, int, float);
+ void finalizeSamples(SampleFormat, const float[], int, float, void*, SampleStats*);
+ void startSampleStats(SampleStats*);
+ void scanSamples(const float[], int, SampleStats*);
+ void scanSamplesScalar(const float[], int, SampleStats*);
+ void scanSamplesAVX2(const float[], int, SampleStats*);
+ void scaleSamplesScalar(const float[], int, float, float[], SampleStats*);
+ void scaleSamplesAVX2(const float[], int, float, float[], SampleStats*);
+ void reportSampleStats(SampleStats*);
+double peakBound(float[], int, float);
+double channelPeakBound(float*[], int, ChannelRouting*, float[]);
+ void startLimiter(Limiter*, int);
+ void limitSamples(Limiter*, float[], int, int);
+double peakMemoryUseMB(void);
+NormalizeMode normalizeModeFromName(char*, char*);
+Precision precisionFromName(char*, char*);
+ void readInputFileHeaders(FileData*, bool);
+ void readWavHeader(FILE*, WavHeader*, char*);
+ bool tryReadWavHeader(FILE*, WavHeader*, char*, char*, size_t);
+ bool readWavLength(char*, int*, char*, size_t);
+ void skipBytes(FILE*, long);
+WavData* mapWavData(FILE*, WavHeader*, char*);
+WavData* tryMapWavData(FILE*, WavHeader*, char*, char*, size_t);
+ void unmapWavData(WavData*);
+ void releaseWavSamplesBefore(WavData*, int);
+ void readChannels(WavData*, int, int, float*[]);
+ void createIrSpectrumFile(FileData*);
+ void runBatch(FileData*);
+ void listBatchFiles(char*, char*, BatchRun*);
+ void addBatchFile(BatchRun*, char*, char*, char*);
+void* batchWorkerThread(void*);
+ bool convolveBatchFile(BatchWorker*, char*, char*, double*, char*, size_t);
+ void runBatchWorkers(BatchRun*, int);
+ void runSweep(FileData*);
+ bool convolveSweepFile(BatchWorker*, char*, char*, double*, char*, size_t);
+ void runDaemon(FileData*);
+  int listenOnSocket(char*);
+ void runRealtimeHarness(FileData*);
+ bool readDaemonRequest(int, DaemonJob*);
+void* daemonWorkerThread(void*);
+ bool runDaemonJob(Daemon*, BatchWorker*, DaemonJob*, char*, size_t);
+DaemonImpulse* findDaemonImpulse(Daemon*, char*, char*, size_t);
+ void releaseDaemonImpulse(Daemon*, DaemonImpulse*);
+ bool loadDaemonImpulse(DaemonImpulse*, char*, char*, size_t);
+ void unloadDaemonImpulse(DaemonImpulse*);
+Complex* daemonPartitions(Daemon*, DaemonImpulse*, int);
+ void submitJob(FileData*);
+char* absolutePath(char*);
+float* growBuffer(float*, size_t*, size_t);
+IrSpectrum* loadIrSpectrum(char*);
+IrSpectrum* tryLoadIrSpectrum(char*, char*, size_t);
+ void unloadIrSpectrum(IrSpectrum*);
+SampleFormat sampleFormatOf(WavHeader*, char*);
+ bool trySampleFormatOf(WavHeader*, char*, SampleFormat*, char*, size_t);
+  int bytesPerSample(SampleFormat);
+ void convertSamplesToFloat(SampleFormat, const void*, int, float*);
+ void convertFloatToSamples(SampleFormat, const float*, int, void*);
+ void int16ToFloatScalar(const void*, int, float*);
+ void int24ToFloatScalar(const void*, int, float*);
+ void int32ToFloatScalar(const void*, int, float*);
+ void floatToInt16Scalar(const float*, int, void*);
+ void floatToInt24Scalar(const float*, int, void*);
+ void floatToInt32Scalar(const float*, int, void*);
+ void int16ToFloatSSE2(const void*, int, float*);
+ void int32ToFloatSSE2(const void*, int, float*);
+ void floatToInt16SSE2(const float*, int, void*);
+ void floatToInt32SSE2(const float*, int, void*);
+ void int16ToFloatAVX2(const void*, int, float*);
+ void int24ToFloatAVX2(const void*, int, float*);
+ void int32ToFloatAVX2(const void*, int, float*);
+ void floatToInt16AVX2(const float*, int, void*);
+ void floatToInt24AVX2(const float*, int, void*);
+ void floatToInt32AVX2(const float*, int, void*);
  void reportMaxMinIntegerSamples(short*, int, char*);
- void convolve(float[], int, float[], int, float[], int);
- void scaleValuesToRangeOfPlusMinus1(float[], int);
+ void reportSignalToNoiseRatio(float[], float[], int);
+IsaLevel isaLevelFromName(char*, char*);
 float largestSampleIn(float[], int);
- void printMeanSampleInFloatArray(float[], int);
- void printMeanSampleInShortArray(short[], int);
+float peakOf(SampleStats*);
+ChannelRouting routeChannels(int, int);
 // ----------------------------------------------------------------------------
 
 
@@ -86,9 +431,37 @@ int main (int argc, char *argv[]) {
 
     FileData files;
 
+    SHOW_DEBUG_OUTPUT = 1;  // show debug/regression test data, and progress while convolving (both off in the
+    SHOW_PROGRESS = 1;      // library; --batch and --daemon turn them back off, as they convolve many files at once)
+    messageOutput = stdout; // (and the library's messages go with the program's)
     processCommandLineArgs(argc, argv, &files);
+    if (files.options.make_irspec) {
+        createIrSpectrumFile(&files);
+        return  0;
+    }
+    if (files.options.batch) {
+        runBatch(&files);
+        return  0;
+    }
+    if (files.options.sweep) {
+        runSweep(&files);
+        return  0;
+    }
+    if (files.options.daemon) {
+        runDaemon(&files);
+        return  0;
+    }
+    if (files.options.submit) {
+        submitJob(&files);
+        return  0;
+    }
     openFileStreams(&files);
-    createOutputFile(&files);
+    if (files.options.realtime)
+        runRealtimeHarness(&files);
+    else if (files.options.stream)
+        streamOutputFile(&files);
+    else
+        createOutputFile(&files);
     closeFileStreams(&files);
 
     return  0;
@@ -98,12 +471,225 @@ int main (int argc, char *argv[]) {
 // ----- FUNCTION DEFINITIONS -------------------------------------------------
 void processCommandLineArgs(int numArgs, char* args[], FileData* f) 
 {
-    if (numArgs != 4) { // wrong nbr of command line args provided
-        fprintf(stderr, "Usage:  %s sample_name impulse_name output_name\n", args[0]); 
+    f->options.engine   = ENGINE_AUTO;
+    f->options.fft_size = 0;
+    f->options.block_size = 2048;
+    f->options.crossover = 0;
+    f->options.isa = ISA_AUTO;
+    f->options.threads = 1;
+    f->options.max_latency = -1;
+    f->options.calibrate = false;
+    f->options.wisdom_file = homeDirectoryFile(".convolve_wisdom");
+    fftPlanCacheFile = homeDirectoryFile(".convolve_fftplans");
+    f->options.verify   = false;
+    f->options.make_irspec = false;
+    f->options.stream = false;
+    f->options.normalize = NORMALIZE_PEAK;
+    f->options.precision = PRECISION_FLOAT;
+    f->options.partitions = NULL;
+    f->options.batch = NULL;
+    f->options.sweep = NULL;
+    f->options.daemon = NULL;
+    f->options.submit = NULL;
+    f->options.realtime = 0;
+    f->options.swap_ir = NULL;
+    f->options.crossfade = 4096;
+
+    char* fileNames[3];
+    int numFileNames = 0;
+
+    for (int i = 1; i < numArgs; i++) {
+        char* arg = args[i];
+        if (strncmp(arg, "--engine=", 9) == 0)
+            f->options.engine = engineTypeFromName(arg + 9, args[0]);
+        else if (strncmp(arg, "--fft-size=", 11) == 0)
+            f->options.fft_size = atoi(arg + 11);
+        else if (strncmp(arg, "--block-size=", 13) == 0)
+            f->options.block_size = atoi(arg + 13);
+        else if (strncmp(arg, "--crossover=", 12) == 0)
+            f->options.crossover = atoi(arg + 12);
+        else if (strncmp(arg, "--threads=", 10) == 0)
+            f->options.threads = atoi(arg + 10);
+        else if (strncmp(arg, "--isa=", 6) == 0)
+            f->options.isa = isaLevelFromName(arg + 6, args[0]);
+        else if (strncmp(arg, "--max-latency=", 14) == 0)
+            f->options.max_latency = atoi(arg + 14);
+        else if (strcmp(arg, "--calibrate") == 0)
+            f->options.calibrate = true;
+        else if (strncmp(arg, "--wisdom=", 9) == 0)
+            f->options.wisdom_file = arg + 9;
+        else if (strncmp(arg, "--plan-cache=", 13) == 0)
+            fftPlanCacheFile = (strcmp(arg + 13, "none") == 0) ? NULL : arg + 13;
+        else if (strcmp(arg, "--verify") == 0)
+            f->options.verify = true;
+        else if (strcmp(arg, "--make-irspec") == 0)
+            f->options.make_irspec = true;
+        else if (strcmp(arg, "--stream") == 0)
+            f->options.stream = true;
+        else if (strncmp(arg, "--normalize=", 12) == 0)
+            f->options.normalize = normalizeModeFromName(arg + 12, args[0]);
+        else if (strncmp(arg, "--precision=", 12) == 0)
+            f->options.precision = precisionFromName(arg + 12, args[0]);
+        else if (strncmp(arg, "--batch=", 8) == 0)
+            f->options.batch = arg + 8;
+        else if (strncmp(arg, "--sweep=", 8) == 0)
+            f->options.sweep = arg + 8;
+        else if (strncmp(arg, "--daemon=", 9) == 0)
+            f->options.daemon = arg + 9;
+        else if (strncmp(arg, "--submit=", 9) == 0)
+            f->options.submit = arg + 9;
+        else if (strncmp(arg, "--realtime=", 11) == 0)
+            f->options.realtime = atoi(arg + 11);
+        else if (strncmp(arg, "--swap-ir=", 10) == 0)
+            f->options.swap_ir = arg + 10;
+        else if (strncmp(arg, "--crossfade=", 12) == 0)
+            f->options.crossfade = atoi(arg + 12);
+        else if (strncmp(arg, "--", 2) == 0 || numFileNames == 3)
+            printUsageAndExit(args[0]);
+        else
+            fileNames[numFileNames++] = arg;
+    }
+    int numFileNamesNeeded = f->options.daemon ? 0 : (f->options.make_irspec || f->options.batch || f->options.sweep) ? 2 : 3;
+    if (numFileNames != numFileNamesNeeded) // wrong nbr of command line args provided
+        printUsageAndExit(args[0]);
+
+    if (f->options.fft_size != 0 && (f->options.fft_size < 16 || f->options.fft_size > MAX_BLOCK_SIZE ||
+                                     nextPowerOf2(f->options.fft_size) != f->options.fft_size)) {
+        fprintf(stderr, "--fft-size must be a power of 2 from 16 to %d\n", MAX_BLOCK_SIZE);
+        exit(-1);
+    }
+    if (f->options.block_size < 8 || f->options.block_size > MAX_BLOCK_SIZE || nextPowerOf2(f->options.block_size) != f->options.block_size) {
+        fprintf(stderr, "--block-size must be a power of 2 from 8 to %d\n", MAX_BLOCK_SIZE);
+        exit(-1);
+    }
+    if (f->options.threads == 0)
+        f->options.threads = numberOfCPUs();
+    if (f->options.threads < 1) {
+        fprintf(stderr, "--threads must be at least 1 (or 0 for one per CPU)\n");
+        exit(-1);
+    }
+    if (f->options.precision != PRECISION_FLOAT && (f->options.engine != ENGINE_DIRECT || f->options.daemon || f->options.submit)) {
+        fprintf(stderr, "--precision only works with --engine=direct (and not with --daemon or --submit)\n");
+        exit(-1);
+    }
+    if (f->options.stream && f->options.engine != ENGINE_AUTO && !isStreamingEngine(f->options.engine)) {
+        fprintf(stderr, "--stream only works with the upols, nonuniform and hybrid engines\n");
+        exit(-1);
+    }
+    if (f->options.crossover != 0 && (f->options.crossover < 8 || f->options.crossover > MAX_BLOCK_SIZE ||
+                                      nextPowerOf2(f->options.crossover) != f->options.crossover)) {
+        fprintf(stderr, "--crossover must be a power of 2 from 8 to %d\n", MAX_BLOCK_SIZE);
+        exit(-1);
+    }
+    if ((f->options.batch || f->options.sweep) && (f->options.stream || f->options.verify)) {
+        fprintf(stderr, "--stream and --verify can't be used with --batch or --sweep\n");
+        exit(-1);
+    }
+    if (f->options.batch && f->options.sweep) {
+        fprintf(stderr, "--batch and --sweep can't be used together\n");
+        exit(-1);
+    }
+    if ((f->options.daemon || f->options.submit) &&
+        (f->options.stream || f->options.verify || f->options.batch || f->options.sweep || f->options.make_irspec)) {
+        fprintf(stderr, "--stream, --verify, --batch, --sweep and --make-irspec can't be used with --daemon or --submit\n");
+        exit(-1);
+    }
+    if (f->options.realtime < 0 || (f->options.realtime && (f->options.stream || f->options.verify || f->options.batch ||
+        f->options.sweep || f->options.daemon || f->options.submit || f->options.make_irspec))) {
+        fprintf(stderr, "--realtime needs a number of frames, and is a mode of its own\n");
+        exit(-1);
+    }
+    if ((f->options.swap_ir && !f->options.realtime) || f->options.crossfade < 0) {
+        fprintf(stderr, "--swap-ir only works with --realtime, and --crossfade can't be negative\n");
+        exit(-1);
+    }
+    if (f->options.sweep && f->options.engine != ENGINE_AUTO && f->options.engine != ENGINE_UPOLS) {
+        fprintf(stderr, "--sweep only works with the upols engine\n");
         exit(-1);
     }
     // get the file names
-    f->sample_name = args[1];  f->impulse_name = args[2];  f->output_name = args[3];
+    if (f->options.batch) {
+        f->sample_name = NULL;  f->impulse_name = fileNames[0];  f->output_name = fileNames[1];  // (a directory)
+    }
+    else if (f->options.sweep) {
+        f->sample_name = fileNames[0];  f->impulse_name = NULL;  f->output_name = fileNames[1];  // (a directory)
+    }
+    else if (f->options.daemon) {
+        f->sample_name = NULL;  f->impulse_name = NULL;  f->output_name = NULL;
+    }
+    else if (f->options.make_irspec) {
+        f->sample_name = NULL;  f->impulse_name = fileNames[0];  f->output_name = fileNames[1];
+    }
+    else {
+        f->sample_name = fileNames[0];  f->impulse_name = fileNames[1];  f->output_name = fileNames[2];
+    }
+}
+
+
+void printUsageAndExit(char* programName)
+{
+    fprintf(stderr, "Usage:  %s [--engine=NAME] [--max-latency=N] [--calibrate] [--wisdom=FILE] [--plan-cache=FILE] [--fft-size=N] [--block-size=N] [--crossover=K] [--isa=NAME] [--precision=TYPES] [--threads=N] [--verify] [--stream] [--normalize=MODE] [--realtime=FRAMES [--swap-ir=FILE] [--crossfade=N]] sample_name impulse_name output_name\n"
+                    "        %s --make-irspec [--block-size=N] impulse_name spectrum_name\n"
+                    "        %s --batch=LIST [options] impulse_name output_directory\n"
+                    "        %s --sweep=LIST [options] sample_name output_directory\n"
+                    "        %s --daemon=SOCKET [options]\n"
+                    "        %s --submit=SOCKET [options] sample_name impulse_name output_name\n",
+                    programName, programName, programName, programName, programName, programName);
+    exit(-1);
+}
+
+
+EngineType engineTypeFromName(char* name, char* programName)
+{
+    if (strcmp(name, "auto") == 0)    return ENGINE_AUTO;
+    if (strcmp(name, "direct") == 0)  return ENGINE_DIRECT;
+    if (strcmp(name, "simd") == 0)    return ENGINE_SIMD;
+    if (strcmp(name, "blocked") == 0) return ENGINE_BLOCKED;
+    if (strcmp(name, "fft") == 0)     return ENGINE_FFT;
+    if (strcmp(name, "upols") == 0)   return ENGINE_UPOLS;
+    if (strcmp(name, "nonuniform") == 0)  return ENGINE_NONUNIFORM;
+    if (strcmp(name, "hybrid") == 0)  return ENGINE_HYBRID;
+
+    fprintf(stderr, "Unknown engine '%s'\n", name);
+    printUsageAndExit(programName);
+    return ENGINE_DIRECT;
+}
+
+
+NormalizeMode normalizeModeFromName(char* name, char* programName)
+{
+    if (strcmp(name, "peak") == 0)   return NORMALIZE_PEAK;
+    if (strcmp(name, "bound") == 0)  return NORMALIZE_BOUND;
+    if (strcmp(name, "none") == 0)   return NORMALIZE_NONE;
+
+    fprintf(stderr, "Unknown normalization '%s'\n", name);
+    printUsageAndExit(programName);
+    return NORMALIZE_PEAK;
+}
+
+
+Precision precisionFromName(char* name, char* programName)
+{
+    if (strcmp(name, "float") == 0)         return PRECISION_FLOAT;
+    if (strcmp(name, "float-double") == 0)  return PRECISION_FLOAT_DOUBLE;
+    if (strcmp(name, "double") == 0)        return PRECISION_DOUBLE;
+    if (strcmp(name, "int16") == 0)         return PRECISION_INT16;
+
+    fprintf(stderr, "Unknown precision '%s'\n", name);
+    printUsageAndExit(programName);
+    return PRECISION_FLOAT;
+}
+
+
+IsaLevel isaLevelFromName(char* name, char* programName)
+{
+    for (IsaLevel isa = ISA_SCALAR; isa <= ISA_AUTO; isa++)
+        if (strcmp(name, isaName(isa)) == 0)
+            return isa;
+
+    fprintf(stderr, "Unknown instruction set '%s'\n", name);
+    printUsageAndExit(programName);
+    return ISA_AUTO;
 }
 
 
@@ -124,245 +710,825 @@ void closeFileStreams(FileData* f)
 // Reads the input files, performs the convolution, then writes the output file
 void createOutputFile(FileData* f)
 {
-    readInputFileHeaders(f);
+    // the impulse response can be a spectrum file (see createIrSpectrumFile()), which needs no parsing or FFTs
+    IrSpectrum* spectrum = loadIrSpectrum(f->impulse_name);
+    readInputFileHeaders(f, spectrum == NULL);
 
-    int N = f->header_sample.subchunk2_size / (f->header_sample.bits_per_sample / 8); // num data points in sample
-    int M = f->header_impulse.subchunk2_size / (f->header_impulse.bits_per_sample / 8); // num data points in impulse
-    short* x = (short*)malloc(f->header_sample.subchunk2_size); // audio file's data samples
-    short* h = (short*)malloc(f->header_impulse.subchunk2_size); // impulse response file's data samples
-
-    getDataSamplesFromInputFiles(x, N, h, M, f);
+    WavData* x = mapWavData(f->sample_file, &f->header_sample, f->sample_name); // audio file's data samples
+    WavData* h = spectrum ? NULL : mapWavData(f->impulse_file, &f->header_impulse, f->impulse_name); // impulse response file's data samples
+    int N = x->num_samples; // num data points in sample (per channel)
+    int M = spectrum ? (int)spectrum->header->ir_length : h->num_samples; // num data points in impulse
+    ChannelRouting routing = routeChannels(x->num_channels, h ? h->num_channels : 1);
 
     if (SHOW_DEBUG_OUTPUT){
-        reportMaxMinIntegerSamples(x, N, "audio file");
-        reportMaxMinIntegerSamples(h, M, "impulse response");
+        if (x->format == SAMPLE_INT16)  reportMaxMinIntegerSamples((short*)x->samples, N * x->num_channels, "audio file");
+        if (h && h->format == SAMPLE_INT16)  reportMaxMinIntegerSamples((short*)h->samples, M * h->num_channels, "impulse response");
+    }
+    // convert the samples to float form in the range of -1.0 to 1.0, one array per channel, straight from the files' mappings
+    float* x_float_form[MAX_CHANNELS];
+    float* h_float_form[MAX_CHANNELS];
+    for (int c = 0; c < routing.num_inputs; c++)
+        x_float_form[c] = (float*)malloc(N * sizeof(float));
+    readChannels(x, 0, N, x_float_form);
+    if (spectrum)
+        h_float_form[0] = spectrum->samples;
+    else {
+        for (int c = 0; c < routing.num_impulses; c++)
+            h_float_form[c] = (float*)malloc(M * sizeof(float));
+        readChannels(h, 0, M, h_float_form);
     }
-    // convert the samples to float form in the range of -1.0 to 1.0
-    float* x_float_form = (float*)malloc(2 * f->header_sample.subchunk2_size); // floats are 2x size of shorts
-    float* h_float_form = (float*)malloc(2 * f->header_impulse.subchunk2_size);
-    createFloatSamplesFromIntegerSamples(x, N, x_float_form);
-    createFloatSamplesFromIntegerSamples(h, M, h_float_form);
-    free(x); free(h);
+    unmapWavData(x);
+    if (h)  unmapWavData(h);
 
     // convolve the two samples
     int P = N + M - 1;
-    float* y_float_form = (float*)malloc(P * sizeof(float));  // holds the covolved samples (float form)
-    convolve(x_float_form, N,  h_float_form, M,  y_float_form, P);
-    free(x_float_form); free(h_float_form);
+    float* y_float_form[MAX_CHANNELS];  // holds the covolved samples (float form), one array per output channel
+    for (int c = 0; c < routing.num_outputs; c++)
+        y_float_form[c] = (float*)malloc(P * sizeof(float));
+    Options plan = planConvolutionWithSpectrum(&f->options, spectrum, N, M);
+    double startTime = secondsNow();
+    convolveChannels(&plan, x_float_form, N,  h_float_form, M,  &routing,  y_float_form, P);
+    if (SHOW_DEBUG_OUTPUT)  printf("\nConvolution took %.3lf seconds\n", secondsNow() - startTime);
+
+    // put the output channels together, the way they're stored in the output file
+    int C = routing.num_outputs;
+    float* y = y_float_form[0];
+    if (C > 1) {
+        y = (float*)malloc((size_t)P * C * sizeof(float));
+        interleaveChannels(y_float_form, C, P, y);
+        for (int c = 0; c < C; c++)  free(y_float_form[c]);
+    }
+    if (f->options.verify && (plan.engine != ENGINE_DIRECT || plan.precision != PRECISION_FLOAT)) {
+        Options direct = plan;
+        direct.engine = ENGINE_DIRECT;
+        direct.precision = PRECISION_FLOAT;
+        float* y_reference[MAX_CHANNELS];
+        for (int c = 0; c < C; c++)
+            y_reference[c] = (float*)malloc(P * sizeof(float));
+        convolveChannels(&direct, x_float_form, N,  h_float_form, M,  &routing,  y_reference, P);
+        float* reference = y_reference[0];
+        if (C > 1) {
+            reference = (float*)malloc((size_t)P * C * sizeof(float));
+            interleaveChannels(y_reference, C, P, reference);
+            for (int c = 0; c < C; c++)  free(y_reference[c]);
+        }
+        reportSignalToNoiseRatio(reference, y, P * C);
+        free(reference);
+    }
+    float largest = normalizeOutput(&f->options, x_float_form, N,  h_float_form, M,  &routing,  y, P, f->header_sample.sample_rate);
+    for (int c = 0; c < routing.num_inputs; c++)
+        free(x_float_form[c]);
+    if (spectrum)  unloadIrSpectrum(spectrum);
+    else           for (int c = 0; c < routing.num_impulses; c++)  free(h_float_form[c]);
+
+    // scale the convolved samples, convert them to the input file's sample format and write them out
+    finalizeOutputFile(f, y, P, C, largest);
+    if (SHOW_DEBUG_OUTPUT)  printf("\nPeak memory use:  %.1lf MB\n", peakMemoryUseMB());
+    printf("\n\nConvolution complete. Output file created  :)\n\n");
+    free(y);
+}
 
-    // convert convolved samples to integer (short) form
-    short* y = (short*)malloc(P * sizeof(short));  // holds the convolved samples
-    createShortIntegerSamplesFromFloatSamples(y_float_form, P, y);
 
-    if (SHOW_DEBUG_OUTPUT){
-        reportMaxMinIntegerSamples(y, P, "convolved output");
-        printMeanSampleInShortArray(y, P);
+/*
+    Like createOutputFile(), but with memory use that doesn't grow with the length of the input: the input is
+    read, convolved and written one block at a time by one of the block-streaming convolvers, which only
+    keeps as much of the input as h[] needs (see createStreamingConvolver()). The whole input is never in
+    memory at once, and neither is the output.
+
+    Since the output is written before it has all been computed, it can't simply be scaled by its peak the
+    way createOutputFile() does. Depending on --normalize, it is instead:
+        peak:  written unscaled (as floats) to a temporary spill file while its peak is found, then read back
+               and scaled on a second sequential pass. Same output as without --stream, at the cost of
+               writing and reading 4 bytes per sample to and from disk.
+        bound: scaled by an upper bound of the peak worked out beforehand (see peakBound()), with max|x|
+               found by a quick first pass over the input file. Never clips, but usually comes out quieter.
+        none:  not scaled at all, with a limiter catching whatever goes over (see limitSamples()).
+*/
+void streamOutputFile(FileData* f)
+{
+    IrSpectrum* spectrum = loadIrSpectrum(f->impulse_name);
+    readInputFileHeaders(f, spectrum == NULL);
+
+    WavData* x = mapWavData(f->sample_file, &f->header_sample, f->sample_name); // audio file's data samples, converted a block at a time
+    int N = x->num_samples; // num data points in sample (per channel)
+    float* h[MAX_CHANNELS];
+    int M, numImpulses;
+    if (spectrum) {
+        h[0] = spectrum->samples;
+        M = spectrum->header->ir_length;
+        numImpulses = 1;
+    }
+    else {
+        WavData* impulses = mapWavData(f->impulse_file, &f->header_impulse, f->impulse_name);
+        M = impulses->num_samples;
+        numImpulses = impulses->num_channels;
+        for (int c = 0; c < numImpulses; c++)
+            h[c] = (float*)malloc(M * sizeof(float));
+        readChannels(impulses, 0, M, h);
+        unmapWavData(impulses);
+    }
+    ChannelRouting routing = routeChannels(x->num_channels, numImpulses);
+    int C = routing.num_outputs;
+    int P = N + M - 1;
+    if (f->options.verify)
+        printf("\n--verify needs the whole output in memory, so it is skipped with --stream\n");
+
+    Options plan = planConvolutionWithSpectrum(&f->options, spectrum, N, M);
+    if (plan.engine == ENGINE_HYBRID && plan.crossover == 0)
+        plan.crossover = chooseHybridCrossover(h[0], M);
+    int B = (plan.engine == ENGINE_HYBRID) ? plan.crossover : plan.block_size;
+    if (SHOW_DEBUG_OUTPUT)  printf("\nStreaming with --engine=%s, %d samples at a time\n", engineName(plan.engine), B);
+
+    float* in[MAX_CHANNELS];
+    float* out[MAX_CHANNELS];
+    for (int c = 0; c < routing.num_inputs; c++)
+        in[c] = (float*)malloc(B * sizeof(float));
+    for (int c = 0; c < C; c++)
+        out[c] = (float*)malloc(B * sizeof(float));
+    float* frames = (float*)malloc((size_t)B * C * sizeof(float));   // the output block, channels interleaved
+    void* blockSamples = malloc((size_t)B * C * sizeof(float));  // ... and converted (4 bytes per sample at most)
+    double startTime = secondsNow();
+
+    float largest = 1.0f;  // what the output gets divided by
+    if (plan.normalize == NORMALIZE_BOUND) {
+        // first pass: the largest sample in each input channel, for the bound on the output's peak
+        float largestInput[MAX_CHANNELS] = { 0.0f };
+        for (int n = 0; n < N; n += B) {
+            int count = (N - n < B) ? N - n : B;
+            readChannels(x, n, count, in);
+            for (int c = 0; c < routing.num_inputs; c++)
+                for (int i = 0; i < count; i++)
+                    if (fabsf(in[c][i]) > largestInput[c])  largestInput[c] = fabsf(in[c][i]);
+            releaseWavSamplesBefore(x, n + count);
+        }
+        double bound = channelPeakBound(h, M, &routing, largestInput);
+        largest = (bound > 0.0) ? (float)bound : 1.0f;
+        if (SHOW_DEBUG_OUTPUT)  printf("\nOutput scaled by 1 / %.4f (the bound on its peak)\n", bound);
+        x->released = 0;  // the second pass goes over them again
+    }
+    FILE* spill = NULL;
+    if (plan.normalize == NORMALIZE_PEAK) {
+        spill = tmpfile();
+        if (!spill) {
+            fprintf(stderr, "Couldn't create a temporary file for --normalize=peak (try --normalize=bound)\n");
+            exit(-1);
+        }
+    }
+    Limiter limiter;
+    startLimiter(&limiter, f->header_sample.sample_rate);
+
+    // convolve a block at a time, writing each one out (or to the spill file) as soon as it's done
+    writeOutputFileHeader(f, P, C);
+    ChannelConvolver* convolver = createChannelConvolver(plan.engine, h, M, &routing, B, plan.partitions);
+    Progress progress;
+    int numBlocks = (P + B - 1) / B;
+    SampleStats spilled;
+    startSampleStats(&spilled);
+    startProgress(&progress, numBlocks);
+
+    for (int b = 0; b < numBlocks; b++) {
+        int inLen = (N - b * B < B) ? N - b * B : B;  // x[] runs out before y[] does
+        if (inLen < 0)  inLen = 0;
+        readChannels(x, b * B, inLen, in);
+        for (int c = 0; c < routing.num_inputs; c++)
+            memset(in[c] + inLen, 0, (B - inLen) * sizeof(float));
+        releaseWavSamplesBefore(x, b * B + inLen);
+
+        processChannelBlock(convolver, in, out);
+
+        int outLen = (P - b * B < B) ? P - b * B : B;
+        interleaveChannels(out, C, outLen, frames);
+        if (spill) {
+            scanSamples(frames, outLen * C, &spilled);
+            fwrite(frames, sizeof(float), (size_t)outLen * C, spill);
+        }
+        else {
+            if (plan.normalize == NORMALIZE_NONE)
+                limitSamples(&limiter, frames, outLen, C);
+            writeScaledBlock(f, frames, outLen * C, largest, blockSamples);
+        }
+        advanceProgress(&progress, 1);
+    }
+    finishProgress(&progress);
+    destroyChannelConvolver(convolver);
+
+    if (spill) {
+        // second pass: scale the spilled output by its peak (as largestSampleIn() would find it) and write it out
+        largest = peakOf(&spilled);
+        rewind(spill);
+        for (int p = 0; p < P; p += B) {
+            int count = ((P - p < B) ? P - p : B) * C;
+            if (fread(frames, sizeof(float), count, spill) != (size_t)count) {
+                fprintf(stderr, "Couldn't read back the temporary file\n");
+                exit(-1);
+            }
+            writeScaledBlock(f, frames, count, largest, blockSamples);
+        }
+        fclose(spill);
+        if (SHOW_DEBUG_OUTPUT)  printf("\nOutput scaled by 1 / %.4f (its peak)\n", largest);
+    }
+    if (SHOW_DEBUG_OUTPUT) {
+        printf("\nConvolution took %.3lf seconds\n", secondsNow() - startTime);
+        printf("Peak memory use:  %.1lf MB\n", peakMemoryUseMB());
     }
-    writeOutputFile(f, y, P);
     printf("\n\nConvolution complete. Output file created  :)\n\n");
-    free(y_float_form); free(y);
+
+    for (int c = 0; c < routing.num_inputs; c++)  free(in[c]);
+    for (int c = 0; c < C; c++)  free(out[c]);
+    free(frames); free(blockSamples);
+    unmapWavData(x);
+    if (spectrum)  unloadIrSpectrum(spectrum);
+    else           for (int c = 0; c < numImpulses; c++)  free(h[c]);
+}
+
+
+// Divides n output samples by largest, converts them to the output's sample format (in scratch, which must
+// have room for 4 bytes per sample) and writes them to the output file (see finalizeSamples())
+void writeScaledBlock(FileData* f, float out[], int n, float largest, void* scratch)
+{
+    SampleFormat format = sampleFormatOf(&f->header_sample, f->sample_name);
+    finalizeSamples(format, out, n, largest, scratch, NULL);
+    fwrite(scratch, bytesPerSample(format), n, f->output_file);
 }
 
 
-void readInputFileHeaders(FileData* f)
+/*
+    Plans the convolution (see planConvolution()), unless the impulse response came from a spectrum file and
+    the engine is auto or upols: the spectra were made for the upols engine with a particular block size, so
+    that's the plan.
+*/
+Options planConvolutionWithSpectrum(Options* requested, IrSpectrum* spectrum, int N, int M)
 {
-    fread(&f->header_sample, sizeof(f->header_sample), 1, f->sample_file);
-    fread(&f->header_impulse, sizeof(f->header_impulse), 1, f->impulse_file);
+    if (!spectrum || (requested->engine != ENGINE_AUTO && requested->engine != ENGINE_UPOLS))
+        return planConvolution(requested, N, M);
+
+    Options plan = *requested;
+    plan.engine = ENGINE_UPOLS;
+    plan.block_size = spectrum->header->block_size;
+    plan.partitions = spectrum->partitions;
+    if (SHOW_DEBUG_OUTPUT)  printf("\nUsing precomputed spectra: upols engine, block size %d\n", plan.block_size);
+    return plan;
+}
 
-    // ^ This reads a little too far due to now having subchunk2 in the WavHeader struct.
-    // So, rewind back to where subchunk2 _should_ begin:
-    fseek(f->sample_file, sizeof(WavHeader)-8, SEEK_SET); 
-    fseek(f->impulse_file, sizeof(WavHeader)-8, SEEK_SET);
 
-    skipPastNullBytesInInputFileHeadersIfPresent(f);
+// Reads the headers of the input .wav files (the impulse response's too, if readImpulseHeader is set)
+void readInputFileHeaders(FileData* f, bool readImpulseHeader)
+{
+    readWavHeader(f->sample_file, &f->header_sample, f->sample_name);
+    if (readImpulseHeader)
+        readWavHeader(f->impulse_file, &f->header_impulse, f->impulse_name);
+}
 
-    fread(&f->header_sample.subchunk2_id,  4, 1, f->sample_file);
-    fread(&f->header_impulse.subchunk2_id, 4, 1, f->impulse_file);
 
-    ensureSubchunk2_idIsSetProperly(f);
+/*
+    Reads a .wav file's header, leaving the file positioned at the first data sample.
+
+    A .wav file is a RIFF file: a 12-byte "RIFF" <size> "WAVE" header followed by chunks, each an id, a size
+    and that many bytes of contents (plus a pad byte if the size is odd). Besides the "fmt " chunk (the
+    format) and the "data" chunk (the samples), there can be any number of others holding metadata (LIST,
+    bext, iXML...), in any order, so this walks the chunks one by one, skipping each one it doesn't need with
+    a single seek. The file's buffer is made big enough that, for most files, everything up to the data
+    chunk comes from a single read.
 
-    fread(&f->header_sample.subchunk2_size, sizeof(f->header_sample.subchunk2_size), 1, f->sample_file);
-    fread(&f->header_impulse.subchunk2_size, sizeof(f->header_impulse.subchunk2_size), 1, f->impulse_file);
+    Exits with an error if it isn't a .wav file, or has no format or data chunk.
+*/
+void readWavHeader(FILE* file, WavHeader* header, char* fileName)
+{
+    char error[ERROR_MESSAGE_SIZE];
+    if (!tryReadWavHeader(file, header, fileName, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        exit(-1);
+    }
 }
 
 
-// N = number of samples in audio file, M = number of samples in impulse response file
-void getDataSamplesFromInputFiles(short samples[], int N, short impulses[], int M, FileData* f)
+// Does what readWavHeader() does, but returns false (with what's wrong in error) instead of exiting
+bool tryReadWavHeader(FILE* file, WavHeader* header, char* fileName, char* error, size_t errorSize)
 {
-    fread(samples, 2, N, f->sample_file);  // 2 bytes per sample (mono...)
-    fread(impulses, 2, M, f->impulse_file);
+    setvbuf(file, NULL, _IOFBF, WAV_HEADER_BUFFER_SIZE);  // (has to be done before the first read)
+
+    if (fread(header->chunk_id, 1, 12, file) != 12 ||  // chunk_id, chunk_size and format
+        memcmp(header->chunk_id, "RIFF", 4) != 0 || memcmp(header->format, "WAVE", 4) != 0) {
+        snprintf(error, errorSize, "%s is not a .wav file", fileName);
+        return false;
+    }
+    bool haveFormat = false;
+    for (;;) {
+        char id[4];
+        uint32_t size;
+        if (fread(id, 1, 4, file) != 4 || fread(&size, 4, 1, file) != 1) {
+            snprintf(error, errorSize, "%s has no %s chunk", fileName, haveFormat ? "data" : "format");
+            return false;
+        }
+        if (memcmp(id, "fmt ", 4) == 0 && size >= 16) {
+            memcpy(header->subchunk1_id, id, 4);
+            header->subchunk1_size = size;  // <-- might not be 16; anything past what's needed is skipped
+            fread(&header->audio_format, 16, 1, file);  // audio_format .. bits_per_sample
+            uint32_t used = 16;
+            if ((uint16_t)header->audio_format == 0xFFFE && size >= 26) {
+                // WAVE_FORMAT_EXTENSIBLE: the actual format is the first 2 bytes of the sub-format GUID
+                unsigned char extension[10];
+                fread(extension, 1, 10, file);
+                header->audio_format = extension[8] | (extension[9] << 8);
+                used = 26;
+            }
+            skipBytes(file, size - used + (size & 1));
+            haveFormat = true;
+        }
+        else if (memcmp(id, "data", 4) == 0 && haveFormat) {
+            memcpy(header->subchunk2_id, id, 4);
+            header->subchunk2_size = size;
+            return true;
+        }
+        else
+            skipBytes(file, (long)size + (size & 1));
+    }
 }
 
 
-void skipPastNullBytesInInputFileHeadersIfPresent(FileData* f)
+// Sets N to the number of samples (per channel) the .wav file's data chunk says it holds, or returns false (with why in error) if the file can't be read
+bool readWavLength(char* fileName, int* N, char* error, size_t errorSize)
 {
-    if (f->header_sample.subchunk1_size != 16){
-        int junkBytes = f->header_sample.subchunk1_size-16;
-        fseek(f->sample_file, junkBytes, SEEK_CUR); 
+    FILE* file = fopen(fileName, "rb");
+    if (!file) {
+        snprintf(error, errorSize, "Couldn't open %s", fileName);
+        return false;
     }
-    if (f->header_impulse.subchunk1_size != 16){
-        int junkBytes = f->header_impulse.subchunk1_size-16;
-        fseek(f->impulse_file, junkBytes, SEEK_CUR); 
+    WavHeader header;
+    SampleFormat format;
+    bool readable = tryReadWavHeader(file, &header, fileName, error, errorSize) &&
+                    trySampleFormatOf(&header, fileName, &format, error, errorSize);
+    fclose(file);
+    if (readable)
+        *N = header.subchunk2_size / (bytesPerSample(format) * (header.num_channels > 0 ? header.num_channels : 1));
+    return readable;
+}
+
+
+// Skips over the next n bytes of the file: with one seek, or by reading them if the file can't seek (a pipe)
+void skipBytes(FILE* file, long n)
+{
+    if (n <= 0 || fseek(file, n, SEEK_CUR) == 0)
+        return;
+    char scratch[4096];
+    while (n > 0) {
+        size_t got = fread(scratch, 1, (n < (long)sizeof(scratch)) ? n : (long)sizeof(scratch), file);
+        if (got == 0)
+            return;
+        n -= got;
     }
 }
 
 
 /*
-    Ensure that each samples' header's subchunk2_id = "data" and that each file pointer is 
-    positioned properly to read the data samples on next read.
+    Gives access to the samples in a .wav file's data chunk, without reading them: the file is memory-mapped,
+    and samples points to where the data chunk is in the mapping. The file must be positioned at the first
+    data sample (as readWavHeader() leaves it). The kernel is told the samples will be read in order, so it
+    reads ahead, and can drop pages once they've been used (see releaseWavSamplesBefore()).
+
+    If the file can't be mapped (e.g. it's a pipe), the samples are read into memory the old way instead.
+    The number of samples (per channel) is the data chunk's, or as many as the file actually holds if it's
+    cut short. Exits with an error if the file has more than MAX_CHANNELS channels, or samples in a format
+    that can't be read.
+*/
+WavData* mapWavData(FILE* file, WavHeader* header, char* fileName)
+{
+    char error[ERROR_MESSAGE_SIZE];
+    WavData* data = tryMapWavData(file, header, fileName, error, sizeof(error));
+    if (!data) {
+        fprintf(stderr, "%s\n", error);
+        exit(-1);
+    }
+    return data;
+}
 
-    If not, advance the sample's file pointer until "data" is found and each sample's
-    header's subchunk2_id does = "data", with the file pointer then pointing to the byte
-    after the last 'a' in "data".
 
-    This is neccessary because sometimes a "LIST" chunk exists between subchunks 1 and 2
-    that holds metadata -info about the sample/song and the software used to produce it.
-*/
-void ensureSubchunk2_idIsSetProperly(FileData* f)
+// Does what mapWavData() does, but returns NULL (with what's wrong in error) instead of exiting
+WavData* tryMapWavData(FILE* file, WavHeader* header, char* fileName, char* error, size_t errorSize)
 {
-    while( ! (f->header_sample.subchunk2_id[0] == 'd' && f->header_sample.subchunk2_id[1] == 'a' && 
-              f->header_sample.subchunk2_id[2] == 't' && f->header_sample.subchunk2_id[3] == 'a'    )){
-        for (int i = 0; i < 4; i++) {
-            fread(&f->header_sample.subchunk2_id[i], 1, 1, f->sample_file);
-            if (f->header_sample.subchunk2_id[i] != "data"[i])
-                break;
-        }
+    SampleFormat format;
+    if (!trySampleFormatOf(header, fileName, &format, error, errorSize))
+        return NULL;
+    if (header->num_channels < 1 || header->num_channels > MAX_CHANNELS) {
+        snprintf(error, errorSize, "%s has %d channels; up to %d are supported", fileName, header->num_channels, MAX_CHANNELS);
+        return NULL;
     }
-    while( ! (f->header_impulse.subchunk2_id[0] == 'd' && f->header_impulse.subchunk2_id[1] == 'a' && 
-              f->header_impulse.subchunk2_id[2] == 't' && f->header_impulse.subchunk2_id[3] == 'a'    )){
-        for (int i = 0; i < 4; i++) {
-            fread(&f->header_impulse.subchunk2_id[i], 1, 1, f->impulse_file);
-            if (f->header_impulse.subchunk2_id[i] != "data"[i])
-                break;
+    WavData* data = (WavData*)malloc(sizeof(WavData));
+    long dataStart = ftell(file);
+    long numBytes = header->subchunk2_size;
+    data->map = NULL;
+    data->released = 0;
+    data->format = format;
+    data->bytes_per_sample = bytesPerSample(data->format);
+    data->num_channels = header->num_channels;
+    data->frame_size = data->bytes_per_sample * data->num_channels;
+
+    struct stat info;
+    if (dataStart >= 0 && fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > dataStart) {
+        void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            data->map = map;
+            data->map_length = info.st_size;
+            if (numBytes > info.st_size - dataStart || numBytes < 0)
+                numBytes = info.st_size - dataStart;
+            data->samples = (char*)map + dataStart;
+            data->num_samples = numBytes / data->frame_size;
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+            return data;
         }
     }
+    data->samples = (char*)malloc(numBytes > 0 ? numBytes : 1);
+    data->num_samples = fread(data->samples, data->frame_size, numBytes / data->frame_size, file);
+    return data;
+}
+
+
+void unmapWavData(WavData* data)
+{
+    if (data->map)  munmap(data->map, data->map_length);
+    else            free(data->samples);
+    free(data);
 }
 
 
-// NOTE: this function will work fine on little-endian machines (ie: most modern consumer devices)
-//       On big-endian machines, the simple method of conversion used here will likely cause the
-//       output file to be a noisy mess.
-void createFloatSamplesFromIntegerSamples(short* samples, int numSamples, float* floatSamples)
+/*
+    Tells the kernel the samples before the given one (of each channel) won't be needed again, so the pages of the mapping
+    holding them can be dropped from this process. Without this, every page of the file that has been read
+    would count towards the process's memory use until the end, which would defeat --stream.
+*/
+void releaseWavSamplesBefore(WavData* data, int sample)
 {
-    for (int i = 0; i < numSamples; i++)
-        floatSamples[i] = (samples[i] * 1.0) / 32768.0;
+    if (!data->map)
+        return;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t end = (data->samples + (size_t)sample * data->frame_size - (char*)data->map) / pageSize * pageSize;
+    if (end >= data->released + (1 << 20)) {  // a MB at a time
+        madvise((char*)data->map + data->released, end - data->released, MADV_DONTNEED);
+        data->released = end;
+    }
 }
 
 
-// NOTE: this function will work fine on little-endian machines (ie: most modern consumer devices)
-//       On big-endian machines, the simple method of conversion used here will likely cause the
-//       output file to be a noisy mess.
-void createShortIntegerSamplesFromFloatSamples(float* floatSamples, int numSamples, short* samples)
+/*
+    Converts n samples of each channel of the data, starting at sample first, to float, into one array per
+    channel. The data's channels are interleaved, so unless there's only one, the samples are converted
+    CHANNEL_CHUNK_SIZE at a time into a buffer small enough to stay in the L1 cache, and split up from there.
+*/
+void readChannels(WavData* data, int first, int n, float* channels[])
 {
-    for (int i = 0; i < numSamples; i++)
-        samples[i] = (short)(floatSamples[i] * 32768.0);
+    const char* samples = data->samples + (size_t)first * data->frame_size;
+    int C = data->num_channels;
+    if (C == 1) {
+        convertSamplesToFloat(data->format, samples, n, channels[0]);
+        return;
+    }
+    float chunk[CHANNEL_CHUNK_SIZE];
+    int framesPerChunk = CHANNEL_CHUNK_SIZE / C;
+    for (int i = 0; i < n; i += framesPerChunk) {
+        int count = (n - i < framesPerChunk) ? n - i : framesPerChunk;
+        convertSamplesToFloat(data->format, samples + (size_t)i * data->frame_size, count * C, chunk);
+        for (int c = 0; c < C; c++)
+            for (int k = 0; k < count; k++)
+                channels[c][i + k] = chunk[k * C + c];
+    }
 }
 
 
-void writeOutputFile(FileData* f, short y[], int P)
+// Writes the header of an output file that will hold P samples of each of numChannels channels, in the input
+// file's sample format
+void writeOutputFileHeader(FileData* f, int P, int numChannels)
 {
+    SampleFormat format = sampleFormatOf(&f->header_sample, f->sample_name);
+
     // prepare then write the header data
     f->header_output = f->header_sample;  // start with the audio file's header as a base
     f->header_output.subchunk1_size = 16; // force it to be this, since we're not preserving any junk data found
-    f->header_output.subchunk2_size = P * 2;
+    f->header_output.audio_format = (format == SAMPLE_FLOAT32) ? 3 : 1;  // (plain PCM or float, even if it was extensible)
+    f->header_output.num_channels = numChannels;
+    f->header_output.bits_per_sample = 8 * bytesPerSample(format);
+    f->header_output.block_align = bytesPerSample(format) * numChannels;
+    f->header_output.byte_rate = f->header_output.sample_rate * f->header_output.block_align;
+    memcpy(f->header_output.subchunk2_id, "data", 4);
+    f->header_output.subchunk2_size = P * f->header_output.block_align;
     f->header_output.chunk_size = 36 + f->header_output.subchunk2_size;
     fwrite(&f->header_output, sizeof(f->header_output), 1, f->output_file);
-
-    // write the actual samples
-    fwrite(y, sizeof(short), P, f->output_file);
 }
 
 
 /*
-    Performs time-domain convolution using the input-side algorithm on input samples x[] and
-    impulse samples h[] to produce the output (convolved) samples y[]
+    Works out what the convolved samples y[] (P samples of each output channel, interleaved) need to be
+    divided by to bring them into the range -1.0 to +1.0, the way options->normalize says to (see
+    NormalizeMode): their peak, the bound on their peak, or 1 (no scaling) after running the limiter over
+    them. The division itself is done by finalizeOutputFile(). All the channels are scaled alike, so the
+    balance between them is kept.
+*/
+float normalizeOutput(Options* options, float* x[], int N, float* h[], int M, ChannelRouting* routing, float y[], int P, int sampleRate)
+{
+    if (options->normalize == NORMALIZE_BOUND) {
+        float largestInput[MAX_CHANNELS] = { 0.0f };
+        for (int c = 0; c < routing->num_inputs; c++)
+            for (int n = 0; n < N; n++)
+                if (fabsf(x[c][n]) > largestInput[c])  largestInput[c] = fabsf(x[c][n]);
+        double bound = channelPeakBound(h, M, routing, largestInput);
+        if (SHOW_DEBUG_OUTPUT)  printf("\nOutput scaled by 1 / %.4f (the bound on its peak)\n", bound);
+        return (bound > 0.0) ? (float)bound : 1.0f;
+    }
+    if (options->normalize == NORMALIZE_NONE) {
+        Limiter limiter;
+        startLimiter(&limiter, sampleRate);
+        limitSamples(&limiter, y, P, routing->num_outputs);
+        return 1.0f;
+    }
+    if (SHOW_DEBUG_OUTPUT)  printf("\n-------------------------------");
+    return largestSampleIn(y, P * routing->num_outputs);
+}
 
-    Parameters: input array x[] (audio file samples) and its size N (ie: the number of samples it contains), 
-                input array h[] (impulse response samples) and its size M, 
-                and output array y[] of size P
 
-    Other: if SHOW_PROGRESS is set to 1 at top of this file, this function will display progress in 10% increments.
+/*
+    Returns the largest that any sample of x[] * h[] can possibly be, given that no x[] sample is bigger
+    than largestInput: sum|h| * max|x|. It's reached only if some run of x[] matches the signs of h[]
+    (reversed) at full scale, so for real audio it's usually well above the actual peak.
 */
-void convolve (float x[], int N, float h[], int M, float y[], int P)
+double peakBound(float h[], int M, float largestInput)
 {
-    // used for displaying progress, if SHOW_PROGRESS is set (see top of program)
-    int multiple = 1;
-    int next10er = (int)M * (multiple / 10.0);
+    double sumOfMagnitudes = 0.0;
+    for (int m = 0; m < M; m++)
+        sumOfMagnitudes += fabs(h[m]);
+    return sumOfMagnitudes * largestInput;
+}
 
-    // Clear output buffer y[]
-    for (int p = 0; p < P; p++)
-        y[p] = 0.0;
 
-    printf("\nStarting convolution. Please wait...\n"); fflush(stdout);
+// The largest peakBound() of any output channel: the sum of the bounds of the paths that go into it, given
+// the largest sample in each input channel
+double channelPeakBound(float* h[], int M, ChannelRouting* routing, float largestInput[])
+{
+    double bounds[MAX_CHANNELS] = { 0.0 }, largest = 0.0;
+    for (int p = 0; p < routing->num_paths; p++) {
+        ChannelPath* path = &routing->paths[p];
+        bounds[path->output] += peakBound(h[path->impulse], M, largestInput[path->input]);
+    }
+    for (int c = 0; c < routing->num_outputs; c++)
+        if (bounds[c] > largest)  largest = bounds[c];
+    return largest;
+}
 
-    for (int n = 0; n < N; n++) {  // loop through audio file samples
-        for (int m = 0; m < M; m++)  // loop through impulse response samples
-            y[n+m] += x[n] * h[m];
 
-        if (SHOW_PROGRESS && n == next10er) {  // does not meaningfully affect performance (I measured)
-            printf("%d0%%  ", multiple++); fflush(stdout);
-            next10er = (int)N * (multiple / 10.0);
-        }
+void startLimiter(Limiter* limiter, int sampleRate)
+{
+    limiter->gain = 1.0f;
+    limiter->release = (float)exp(-1.0 / (LIMITER_RELEASE_SECONDS * (sampleRate > 0 ? sampleRate : 44100)));
+}
+
+
+/*
+    Peak limiter for --normalize=none: keeps every sample within +- LIMITER_CEILING. As soon as a sample
+    would go over, the gain drops to just what's needed to bring it down (instant attack, so nothing gets
+    through); the gain then recovers smoothly towards 1 (release), so the samples after a peak are turned down
+    too, instead of being clipped one by one. Can be fed any number of samples at a time.
+
+    y[] holds n samples of each of numChannels channels, interleaved. The channels share one gain, set by
+    whichever is loudest, so that limiting one doesn't shift the balance between them.
+*/
+void limitSamples(Limiter* limiter, float y[], int n, int numChannels)
+{
+    float gain = limiter->gain, release = limiter->release;
+    for (int i = 0; i < n; i++) {
+        float* frame = y + (size_t)i * numChannels;
+        gain = 1.0f - (1.0f - gain) * release;
+        float magnitude = 0.0f;
+        for (int c = 0; c < numChannels; c++)
+            if (fabsf(frame[c]) > magnitude)  magnitude = fabsf(frame[c]);
+        if (magnitude * gain > LIMITER_CEILING)
+            gain = LIMITER_CEILING / magnitude;
+        for (int c = 0; c < numChannels; c++)
+            frame[c] *= gain;
     }
-    if (SHOW_PROGRESS) printf("100%%");
+    limiter->gain = gain;
+}
 
-    scaleValuesToRangeOfPlusMinus1(y, P);
+
+// The most memory this process has used so far (its peak resident set size), in MB
+double peakMemoryUseMB(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;  // ru_maxrss is in KB on Linux
 }
 
 
 /*  
-    Because of how the input-side algorithm works, some of the values in y[] are very likely 
-    to be outside our desired range of -1.0 to +1.0
+    Because of how the input-side algorithm works, some of the values in y[] (P samples of each of
+    numChannels channels, interleaved) are very likely to be outside our desired range of -1.0 to +1.0
 
-    So, let's scale all the samples relative to the largest value among them. This will scale them
-    down to fit within that range. Doing it this way, we preserve the all the data and we'll also
-    avoid aliasing/rollover upon conversion to short values.
+    So, normalizeOutput() works out what to scale all the samples by (by default, relative to the largest
+    value among them), and this scales them down to fit within that range, converts them to the output's
+    sample format and writes them out. Doing it this way, we preserve the all the data and we'll also
+    avoid aliasing/rollover upon conversion to integer values.
 
     (An alternative "solution" would be to clip (round down) all values outside the range to the max value,
     but that would result in losing a lot of data and would sound terrible in most cases.)
 
-    Optionally, will print some info about the contents of y[] if SHOW_DEBUG_OUTPUT is set to 1.
+    It's done in a single pass over y[], a chunk at a time, through a buffer that's written out whenever it
+    fills (see finalizeSamples()); y[] itself is left as it is.
+
+    Optionally, will print some info about the output samples if SHOW_DEBUG_OUTPUT is set to 1.
 */
-void scaleValuesToRangeOfPlusMinus1(float y[], int P)
+void finalizeOutputFile(FileData* f, float y[], int P, int numChannels, float largest)
 {
-    if (SHOW_DEBUG_OUTPUT)  printf("\n-------------------------------");
-    
-    float largest = largestSampleIn(y, P);
-    for (int p = 0; p < P; p++) {
-        y[p] /= largest;
-        if (y[p] > 0.999999) 
-            y[p] -= 0.000001;   // Logically, we shouldn't have to do this, but include it                     
-    }                           // to handle float's loss of precision in C when division used
+    SampleFormat format = sampleFormatOf(&f->header_sample, f->sample_name);
+    int bytes = bytesPerSample(format);
+    char* buffer = (char*)malloc((size_t)OUTPUT_BUFFER_SIZE * bytes);
+    SampleStats stats;
+    startSampleStats(&stats);
+
+    writeOutputFileHeader(f, P, numChannels);
+    size_t numSamples = (size_t)P * numChannels;
+    for (size_t p = 0; p < numSamples; p += OUTPUT_BUFFER_SIZE) {
+        int count = (numSamples - p < OUTPUT_BUFFER_SIZE) ? numSamples - p : OUTPUT_BUFFER_SIZE;
+        finalizeSamples(format, y + p, count, largest, buffer, &stats);
+        fwrite(buffer, bytes, count, f->output_file);
+    }
+    free(buffer);
 
     if (SHOW_DEBUG_OUTPUT){
         printf("------- AFTER scaling all values relative to the largest one:");
-        largestSampleIn(y, P);
+        reportSampleStats(&stats);
         printf("-------------------------------\n");
     }
 }
 
 
+/*
+    Divides n samples of y[] by largest, converts them to the given format and puts them in out (see
+    convertFloatToSamples()), adding them to stats (unless it's NULL) along the way. The samples are done
+    FINALIZE_CHUNK_SIZE at a time, scaled into a small buffer that stays in the L1 cache until it's
+    converted, so y[] is only read once and nothing but out is written to memory.
+*/
+void finalizeSamples(SampleFormat format, const float y[], int n, float largest, void* out, SampleStats* stats)
+{
+    float scaled[FINALIZE_CHUNK_SIZE];
+    SampleStats ignored;
+    if (!stats)  stats = &ignored;
+#if defined(__x86_64__) || defined(__i386__)
+    static IsaLevel isa = ISA_AUTO;
+    if (isa == ISA_AUTO)  isa = detectIsaLevel();
+#else
+    IsaLevel isa = ISA_SCALAR;
+#endif
+    int bytes = bytesPerSample(format);
+
+    for (int i = 0; i < n; i += FINALIZE_CHUNK_SIZE) {
+        int count = (n - i < FINALIZE_CHUNK_SIZE) ? n - i : FINALIZE_CHUNK_SIZE;
+        if (isa >= ISA_AVX2)  scaleSamplesAVX2(y + i, count, largest, scaled, stats);
+        else                  scaleSamplesScalar(y + i, count, largest, scaled, stats);
+        convertFloatToSamples(format, scaled, count, (char*)out + (size_t)i * bytes);
+    }
+}
+
+
+void scaleSamplesScalar(const float y[], int n, float largest, float out[], SampleStats* stats)
+{
+    float highest = stats->highest, lowest = stats->lowest;
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        float v = y[i] / largest;
+        if (v > 0.999999) 
+            v -= 0.000001;   // Logically, we shouldn't have to do this, but include it                     
+                             // to handle float's loss of precision in C when division used
+        if (v > highest)  highest = v;
+        if (v < lowest)   lowest = v;
+        sum += v;
+        out[i] = v;
+    }
+    stats->highest = highest;  stats->lowest = lowest;
+    stats->sum += sum;  stats->count += n;
+}
+
+
+void startSampleStats(SampleStats* stats)
+{
+    stats->highest = -INFINITY;  stats->lowest = INFINITY;
+    stats->sum = 0.0;  stats->count = 0;  stats->outside = 0;
+}
+
+
+// Adds the n samples in y[] to stats
+void scanSamples(const float y[], int n, SampleStats* stats)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static IsaLevel isa = ISA_AUTO;
+    if (isa == ISA_AUTO)  isa = detectIsaLevel();
+    if (isa >= ISA_AVX2) {
+        scanSamplesAVX2(y, n, stats);
+        return;
+    }
+#endif
+    scanSamplesScalar(y, n, stats);
+}
+
+
+void scanSamplesScalar(const float y[], int n, SampleStats* stats)
+{
+    for (int i = 0; i < n; i++) {
+        if (y[i] > stats->highest)  stats->highest = y[i];
+        if (y[i] < stats->lowest)   stats->lowest = y[i];
+        if (y[i] > 1.0 || y[i] < -1.0)
+            stats->outside++;
+        stats->sum += y[i];
+    }
+    stats->count += n;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void scanSamplesAVX2(const float y[], int n, SampleStats* stats)
+{
+    __m256 highest = _mm256_set1_ps(stats->highest), lowest = _mm256_set1_ps(stats->lowest);
+    __m256 one = _mm256_set1_ps(1.0f), minusOne = _mm256_set1_ps(-1.0f);
+    long outside = 0;
+    double sum = 0.0;
+    int i = 0;
+    while (i + 8 <= n) {
+        __m256 partialSum = _mm256_setzero_ps();  // summed in floats for a chunk at a time, then in a double
+        int chunkEnd = (n - i > FINALIZE_CHUNK_SIZE) ? i + FINALIZE_CHUNK_SIZE : n;
+        for (; i + 8 <= chunkEnd; i += 8) {
+            __m256 v = _mm256_loadu_ps(y + i);
+            highest = _mm256_max_ps(highest, v);
+            lowest = _mm256_min_ps(lowest, v);
+            __m256 beyond = _mm256_or_ps(_mm256_cmp_ps(v, one, _CMP_GT_OQ), _mm256_cmp_ps(v, minusOne, _CMP_LT_OQ));
+            outside += __builtin_popcount(_mm256_movemask_ps(beyond));
+            partialSum = _mm256_add_ps(partialSum, v);
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, partialSum);
+        for (int k = 0; k < 8; k++)  sum += lanes[k];
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, highest);
+    for (int k = 0; k < 8; k++)  if (lanes[k] > stats->highest)  stats->highest = lanes[k];
+    _mm256_storeu_ps(lanes, lowest);
+    for (int k = 0; k < 8; k++)  if (lanes[k] < stats->lowest)  stats->lowest = lanes[k];
+    stats->outside += outside;
+    stats->sum += sum;
+    stats->count += i;
+    scanSamplesScalar(y + i, n - i, stats);
+}
+
+
+/*
+    Same as scaleSamplesScalar(), 8 at a time: the division is an exact IEEE one either way, and so is the
+    nudge below 0.999999 (a float is above the double 0.999999 exactly when it's above the float nearest to
+    it, which is a little smaller), so both give exactly the same output.
+*/
+__attribute__((target("avx2")))
+void scaleSamplesAVX2(const float y[], int n, float largest, float out[], SampleStats* stats)
+{
+    __m256 divisor = _mm256_set1_ps(largest);
+    __m256 limit = _mm256_set1_ps(0.999999f), nudge = _mm256_set1_ps(0.000001f);
+    __m256 highest = _mm256_set1_ps(stats->highest), lowest = _mm256_set1_ps(stats->lowest);
+    __m256 partialSum = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_div_ps(_mm256_loadu_ps(y + i), divisor);
+        v = _mm256_sub_ps(v, _mm256_and_ps(_mm256_cmp_ps(v, limit, _CMP_GT_OQ), nudge));
+        highest = _mm256_max_ps(highest, v);
+        lowest = _mm256_min_ps(lowest, v);
+        partialSum = _mm256_add_ps(partialSum, v);
+        _mm256_storeu_ps(out + i, v);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, highest);
+    for (int k = 0; k < 8; k++)  if (lanes[k] > stats->highest)  stats->highest = lanes[k];
+    _mm256_storeu_ps(lanes, lowest);
+    for (int k = 0; k < 8; k++)  if (lanes[k] < stats->lowest)  stats->lowest = lanes[k];
+    _mm256_storeu_ps(lanes, partialSum);
+    for (int k = 0; k < 8; k++)  stats->sum += lanes[k];
+    stats->count += i;
+    scaleSamplesScalar(y + i, n - i, largest, out + i, stats);
+}
+#endif
+
+
 // Returns the largest sample found in y[] (in terms of magnitude) of size P
 // Optionally: if SHOW_DEBUG_OUTPUT == 1 (see top of program), print some info about the contents of y[]
 float largestSampleIn(float y[], int P)
 {
-    int numSamplesOutsideRange = 0;
-    float highest = -9999999.0, lowest = 9999999.0;
-    for (int p = 0; p < P; p++) {
-        if (y[p] > highest)
-            highest = y[p];
-        else if (y[p] < lowest)
-            lowest = y[p];
+    SampleStats stats;
+    startSampleStats(&stats);
+    scanSamples(y, P, &stats);
+    if (SHOW_DEBUG_OUTPUT)
+        reportSampleStats(&stats);
+    return peakOf(&stats);
+}
 
-        if (y[p] > 1.0 || y[p] < -1.0)
-            numSamplesOutsideRange++;
-    }
-    if (SHOW_DEBUG_OUTPUT) {
-        printf("\nNumber of samples that exceeded +- 1.0:  %d\n", numSamplesOutsideRange);
-        printf("Highest sample in the output:  %f\n", highest);
-        printf(" Lowest sample in the output: %f\n", lowest);
-        printMeanSampleInFloatArray(y, P);
-    }
+
+// Returns the largest sample (in terms of magnitude) among those added to stats, the way largestSampleIn() does
+float peakOf(SampleStats* stats)
+{
+    float highest = stats->highest, lowest = stats->lowest;
+    if (highest <= 0.0f && lowest >= 0.0f)
+        return 1.0f;  // silence (a silent input or impulse response): leave it as it is, rather than dividing by 0
     return highest > fabs(lowest) ? highest+0.000001 : fabs(lowest);
     //                                     ^
     //                                     ^
@@ -374,6 +1540,15 @@ float largestSampleIn(float y[], int P)
 }
 
 
+void reportSampleStats(SampleStats* stats)
+{
+    printf("\nNumber of samples that exceeded +- 1.0:  %ld\n", stats->outside);
+    printf("Highest sample in the output:  %f\n", stats->highest);
+    printf(" Lowest sample in the output: %f\n", stats->lowest);
+    printf("         Mean average sample:  %lf\n", stats->count ? stats->sum / stats->count : 0.0);
+}
+
+
 // Prints some information of the contents of "samples" when SHOW_DEBUG_OUTPUT flag is set to 1
 void reportMaxMinIntegerSamples(short* samples, int n, char* nameForSampleSet)
 {
@@ -391,23 +1566,1651 @@ void reportMaxMinIntegerSamples(short* samples, int n, char* nameForSampleSet)
 }
 
 
-void printMeanSampleInFloatArray(float samples[], int size)
+// Prints how closely test[] matches reference[] (both of size P), as a signal-to-noise ratio in dB
+void reportSignalToNoiseRatio(float reference[], float test[], int P)
 {
-    double sum = 0.0; 
-    for (int i = 0; i < size; i++)
-        sum += (double)samples[i];
+    double signal = 0.0, noise = 0.0;
+    for (int p = 0; p < P; p++) {
+        double diff = (double)reference[p] - test[p];
+        signal += (double)reference[p] * reference[p];
+        noise  += diff * diff;
+    }
+    if (noise == 0.0)
+        printf("\nSNR against the direct engine:  exact match\n");
+    else
+        printf("\nSNR against the direct engine:  %.1lf dB\n", 10.0 * log10(signal / noise));
+}
+
 
-    double avg = sum / (size * 1.0);
-    printf("         Mean average sample:  %lf\n", avg);
+// Works out how the input's channels are convolved with the impulse response's (see planChannelRouting()),
+// and exits with an error if they can't be
+ChannelRouting routeChannels(int numInputs, int numImpulses)
+{
+    ChannelRouting routing;
+    if (!planChannelRouting(numInputs, numImpulses, &routing)) {
+        fprintf(stderr, "Can't convolve a %d-channel input with a %d-channel impulse response "
+                        "(it needs 1 channel, the same number as the input, or 4 for a stereo input)\n", numInputs, numImpulses);
+        exit(-1);
+    }
+    return routing;
 }
 
 
-void printMeanSampleInShortArray(short samples[], int size)
+// ----- BATCH MODE -----------------------------------------------------------
+/*
+    --batch: convolves every input file in options.batch with the same impulse response, writing each output
+    to the output directory (under the input's name, unless the manifest gives one). Instead of running the
+    program once per file, which would load and transform the impulse response every time, it's loaded once,
+    the engine is planned once (for the length of the first input), and with upols (the usual choice for
+    long impulse responses) its partition spectra are computed once and shared by every file.
+
+    The files are handed out to a pool of --threads workers, each doing one file at a time on its own (with
+    buffers it keeps from file to file), which scales better than splitting each file across the threads.
+    A line is printed as each file is done, and the totals (files and seconds of audio per second) at the end.
+*/
+void runBatch(FileData* f)
 {
-    long int sum = 0; 
-    for (int i = 0; i < size; i++)
-        sum += samples[i];
+    BatchRun run = { .inputs = NULL, .outputs = NULL, .num_files = 0, .audio_seconds = 0.0 };
+    pthread_mutex_init(&run.lock, NULL);
+    atomic_init(&run.next, 0);
+    atomic_init(&run.failed, 0);
+    listBatchFiles(f->options.batch, f->output_name, &run);
+    if (run.num_files == 0) {
+        fprintf(stderr, "No input files found in %s\n", f->options.batch);
+        exit(-1);
+    }
+    mkdir(f->output_name, 0777);  // (if it isn't there already)
+
+    // the impulse response, once
+    IrSpectrum* spectrum = loadIrSpectrum(f->impulse_name);
+    if (spectrum) {
+        run.h[0] = spectrum->samples;
+        run.M = spectrum->header->ir_length;
+        run.num_impulses = 1;
+    }
+    else {
+        f->impulse_file = fopen(f->impulse_name, "rb");
+        if (!f->impulse_file) {
+            fprintf(stderr, "Couldn't open %s\n", f->impulse_name);
+            exit(-1);
+        }
+        readWavHeader(f->impulse_file, &f->header_impulse, f->impulse_name);
+        WavData* impulses = mapWavData(f->impulse_file, &f->header_impulse, f->impulse_name);
+        run.M = impulses->num_samples;
+        run.num_impulses = impulses->num_channels;
+        for (int c = 0; c < run.num_impulses; c++)
+            run.h[c] = (float*)malloc(run.M * sizeof(float));
+        readChannels(impulses, 0, run.M, run.h);
+        unmapWavData(impulses);
+        fclose(f->impulse_file);
+    }
 
-    double avg = (sum * 1.0) / (size * 1.0);
-    printf("\nMean average sample:  %.5lf\n", avg);
-}
\ No newline at end of file
+    // the plan, once: for the length of the first input that can be read, with each file done on a single
+    // thread (any before it are counted as failed, and the workers start after them)
+    int N = 0, firstReadable = 0;
+    for (; firstReadable < run.num_files; firstReadable++) {
+        char error[ERROR_MESSAGE_SIZE];
+        if (readWavLength(run.inputs[firstReadable], &N, error, sizeof(error)))
+            break;
+        fprintf(stderr, "%s\n", error);
+        atomic_fetch_add(&run.failed, 1);
+    }
+    atomic_store(&run.next, firstReadable);
+    Options requested = f->options;
+    requested.threads = 1;
+    run.plan = planConvolutionWithSpectrum(&requested, spectrum, N, run.M);
+    if (run.plan.engine == ENGINE_HYBRID && run.plan.crossover == 0)
+        run.plan.crossover = chooseHybridCrossover(run.h[0], run.M);
+    Complex* partitions = NULL;
+    if (run.plan.engine == ENGINE_UPOLS && !run.plan.partitions) {
+        partitions = createChannelPartitionSpectra(run.h, run.num_impulses, run.M, run.plan.block_size);
+        run.plan.partitions = partitions;
+    }
+    int numWorkers = (f->options.threads < run.num_files) ? f->options.threads : run.num_files;
+    printf("\nConvolving %d files with %s (--engine=%s), %d at a time\n\n", run.num_files, f->impulse_name,
+           engineName(run.plan.engine), numWorkers);
+    runBatchWorkers(&run, numWorkers);
+
+    free(partitions);
+    if (spectrum)  unloadIrSpectrum(spectrum);
+    else           for (int c = 0; c < run.num_impulses; c++)  free(run.h[c]);
+    for (int i = 0; i < run.num_files; i++) {
+        free(run.inputs[i]); free(run.outputs[i]);
+    }
+    free(run.inputs); free(run.outputs);
+    pthread_mutex_destroy(&run.lock);
+}
+
+
+/*
+    Fills in run's list of input and output files from list, which is one of:
+        a directory:       every .wav (or .irspec) file in it
+        a pattern:         every file matching it (anything with a *, ? or [ in it, e.g. "*.wav")
+        a manifest file:   one input file per line, optionally followed by a tab and the output file to write
+                           (blank lines and lines starting with # are skipped)
+    Outputs not given go in outputDirectory, with the same names as their inputs (as .wav files).
+*/
+void listBatchFiles(char* list, char* outputDirectory, BatchRun* run)
+{
+    struct stat info;
+    bool isDirectory = stat(list, &info) == 0 && S_ISDIR(info.st_mode);
+
+    if (isDirectory || strpbrk(list, "*?[")) {
+        char* pattern = list;
+        if (isDirectory) {
+            pattern = (char*)malloc(strlen(list) + 32);
+            sprintf(pattern, "%s/{*.[wW][aA][vV],*.irspec}", list);
+        }
+        glob_t matches;
+        if (glob(pattern, GLOB_BRACE, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++)
+                addBatchFile(run, matches.gl_pathv[i], NULL, outputDirectory);
+            globfree(&matches);
+        }
+        if (pattern != list)  free(pattern);
+        return;
+    }
+    FILE* manifest = fopen(list, "r");
+    if (!manifest) {
+        fprintf(stderr, "Couldn't open %s\n", list);
+        exit(-1);
+    }
+    char* line = NULL;
+    size_t lineSize = 0;
+    while (getline(&line, &lineSize, manifest) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        char* output = strchr(line, '\t');
+        if (output)  *output++ = '\0';
+        addBatchFile(run, line, output, outputDirectory);
+    }
+    free(line);
+    fclose(manifest);
+}
+
+
+// Adds input to run's list of files, with output as its output file (or, if that's NULL, one of the same name in outputDirectory)
+void addBatchFile(BatchRun* run, char* input, char* output, char* outputDirectory)
+{
+    run->inputs = (char**)realloc(run->inputs, (run->num_files + 1) * sizeof(char*));
+    run->outputs = (char**)realloc(run->outputs, (run->num_files + 1) * sizeof(char*));
+    run->inputs[run->num_files] = strdup(input);
+    if (output)
+        run->outputs[run->num_files] = strdup(output);
+    else {
+        char* name = strrchr(input, '/') ? strrchr(input, '/') + 1 : input;
+        char* extension = strrchr(name, '.');
+        int nameLength = (extension && strcasecmp(extension, ".wav") != 0) ? extension - name : (int)strlen(name);
+        run->outputs[run->num_files] = (char*)malloc(strlen(outputDirectory) + nameLength + 8);
+        sprintf(run->outputs[run->num_files], "%s/%.*s%s", outputDirectory, nameLength, name, (nameLength < (int)strlen(name)) ? ".wav" : "");
+    }
+    run->num_files++;
+}
+
+
+/*
+    --sweep: convolves one input file with every impulse response in options.sweep, writing each output to the
+    output directory (under the impulse response's name, unless the manifest gives one). It works like the
+    upols engine, but the other way round: the input is cut into overlap-save windows of 2 * block_size
+    samples and each one's spectrum is computed once, up front, and kept. For each impulse response, all
+    that's left is its partitions' spectra, the spectral multiply-accumulates and the inverse FFTs
+    (see convolveSweepFile()). The impulse responses are shared out among a pool of --threads workers, as
+    with --batch; those in spectrum files made with the same --block-size don't even need transforming.
+*/
+void runSweep(FileData* f)
+{
+    BatchRun run = { .inputs = NULL, .outputs = NULL, .num_files = 0, .audio_seconds = 0.0, .sweep = true };
+    pthread_mutex_init(&run.lock, NULL);
+    atomic_init(&run.next, 0);
+    atomic_init(&run.failed, 0);
+    listBatchFiles(f->options.sweep, f->output_name, &run);
+    if (run.num_files == 0) {
+        fprintf(stderr, "No impulse responses found in %s\n", f->options.sweep);
+        exit(-1);
+    }
+    mkdir(f->output_name, 0777);  // (if it isn't there already)
+
+    // the input, once
+    f->sample_file = fopen(f->sample_name, "rb");
+    if (!f->sample_file) {
+        fprintf(stderr, "Couldn't open %s\n", f->sample_name);
+        exit(-1);
+    }
+    readWavHeader(f->sample_file, &run.header, f->sample_name);
+    WavData* x = mapWavData(f->sample_file, &run.header, f->sample_name);
+    run.N = x->num_samples;
+    run.num_inputs = x->num_channels;
+    for (int c = 0; c < run.num_inputs; c++)
+        run.x[c] = (float*)malloc(run.N * sizeof(float));
+    readChannels(x, 0, run.N, run.x);
+    unmapWavData(x);
+    fclose(f->sample_file);
+
+    // ... and its spectra: window j is input blocks j-1 and j, so the last one that isn't silent is the
+    // one after the input's last block
+    run.plan = f->options;
+    run.plan.engine = ENGINE_UPOLS;
+    int B = run.plan.block_size, bins = B + 1;
+    run.fft_plan = createFftPlan(2 * B);
+    run.num_x_blocks = (run.N + B - 1) / B + 1;
+    float* window = (float*)malloc(2 * B * sizeof(float));
+    for (int c = 0; c < run.num_inputs; c++) {
+        run.x_spectra[c] = (Complex*)malloc((size_t)run.num_x_blocks * bins * sizeof(Complex));
+        for (int j = 0; j < run.num_x_blocks; j++) {
+            for (int i = 0; i < 2 * B; i++) {
+                long n = (long)(j - 1) * B + i;
+                window[i] = (n >= 0 && n < run.N) ? run.x[c][n] : 0.0f;
+            }
+            forwardRealFFT(run.fft_plan, window, run.x_spectra[c] + (size_t)j * bins);
+        }
+    }
+    free(window);
+
+    int numWorkers = (f->options.threads < run.num_files) ? f->options.threads : run.num_files;
+    printf("\nConvolving %s with %d impulse responses (--engine=upols, block size %d), %d at a time\n\n",
+           f->sample_name, run.num_files, B, numWorkers);
+    runBatchWorkers(&run, numWorkers);
+
+    destroyFftPlan(run.fft_plan);
+    for (int c = 0; c < run.num_inputs; c++) {
+        free(run.x[c]); free(run.x_spectra[c]);
+    }
+    for (int i = 0; i < run.num_files; i++) {
+        free(run.inputs[i]); free(run.outputs[i]);
+    }
+    free(run.inputs); free(run.outputs);
+    pthread_mutex_destroy(&run.lock);
+}
+
+
+/*
+    Does one impulse response of a sweep: gets its partition spectra (from its spectrum file, or by
+    transforming it), then makes each block j of each output channel from the inverse FFT of the sum, over
+    the paths into that channel and over the partitions k, of (input window j - k's spectrum) * (partition
+    k's spectrum). That's the same sum processChannelBlock() does, in the same order, so the output is the
+    same as from the upols engine with the same block size. Sets audioSeconds to the input's length, and
+    returns false, with why in error, if the impulse response can't be read or used with the input, or the
+    output can't be created; the sweep goes on with the others.
+*/
+bool convolveSweepFile(BatchWorker* worker, char* impulse, char* output, double* audioSeconds, char* error, size_t errorSize)
+{
+    BatchRun* run = worker->run;
+    int B = run->plan.block_size, bins = B + 1;
+    float* h[MAX_CHANNELS];  // (the worker's input buffers hold the impulse response)
+    Complex* partitions[MAX_CHANNELS] = { NULL };
+    int M, numImpulses;
+
+    IrSpectrum* spectrum = tryLoadIrSpectrum(impulse, error, errorSize);
+    if (spectrum) {
+        if ((int)spectrum->header->block_size != B) {
+            snprintf(error, errorSize, "%s was made for a block size of %d, not %d", impulse, spectrum->header->block_size, B);
+            unloadIrSpectrum(spectrum);
+            return false;
+        }
+        M = spectrum->header->ir_length;
+        numImpulses = 1;
+        h[0] = spectrum->samples;
+        partitions[0] = spectrum->partitions;
+    }
+    else if (error[0])
+        return false;
+    else {
+        FILE* file = fopen(impulse, "rb");
+        if (!file) {
+            snprintf(error, errorSize, "Couldn't open %s", impulse);
+            return false;
+        }
+        WavHeader header;
+        WavData* data = NULL;
+        if (!tryReadWavHeader(file, &header, impulse, error, errorSize) ||
+            !(data = tryMapWavData(file, &header, impulse, error, errorSize))) {
+            fclose(file);
+            return false;
+        }
+        M = data->num_samples;
+        numImpulses = data->num_channels;
+        for (int c = 0; c < numImpulses; c++)
+            h[c] = worker->x[c] = growBuffer(worker->x[c], &worker->x_capacity[c], M);
+        readChannels(data, 0, M, h);
+        unmapWavData(data);
+        fclose(file);
+        for (int c = 0; c < numImpulses; c++)
+            partitions[c] = createPartitionSpectra(h[c], M, B, run->fft_plan);
+    }
+    ChannelRouting routing;
+    if (!planChannelRouting(run->num_inputs, numImpulses, &routing)) {
+        snprintf(error, errorSize, "Can't convolve the %d-channel input with the %d-channel %s", run->num_inputs, numImpulses, impulse);
+        if (spectrum)  unloadIrSpectrum(spectrum);
+        else           for (int c = 0; c < numImpulses; c++)  free(partitions[c]);
+        return false;
+    }
+    int C = routing.num_outputs, N = run->N, P = N + M - 1;
+    int K = (M + B - 1) / B, numBlocks = (P + B - 1) / B;
+    if (K < 1)  K = 1;
+
+    Complex* accumulator = (Complex*)malloc(bins * sizeof(Complex));
+    float* time = (float*)malloc(2 * B * sizeof(float));
+    for (int c = 0; c < C; c++)
+        worker->y[c] = growBuffer(worker->y[c], &worker->y_capacity[c], P);
+
+    for (int o = 0; o < C; o++) {
+        for (int j = 0; j < numBlocks; j++) {
+            memset(accumulator, 0, bins * sizeof(Complex));
+            int firstK = (j - run->num_x_blocks + 1 > 0) ? j - run->num_x_blocks + 1 : 0;  // (older windows are silent)
+            int lastK = (j < K - 1) ? j : K - 1;  // (and there are none before the first)
+            for (int p = 0; p < routing.num_paths; p++) {
+                ChannelPath* path = &routing.paths[p];
+                if (path->output != o)
+                    continue;
+                for (int k = firstK; k <= lastK; k++)
+                    multiplyAccumulateSpectra(run->x_spectra[path->input] + (size_t)(j - k) * bins,
+                                              partitions[path->impulse] + (size_t)k * bins, accumulator, bins);
+            }
+            inverseRealFFT(run->fft_plan, accumulator, time);
+            int count = (P - j * B < B) ? P - j * B : B;
+            memcpy(worker->y[o] + (size_t)j * B, time + B, count * sizeof(float));
+        }
+    }
+    free(accumulator); free(time);
+
+    float* y = worker->y[0];
+    if (C > 1) {
+        worker->frames = growBuffer(worker->frames, &worker->frames_capacity, (size_t)P * C);
+        interleaveChannels(worker->y, C, P, worker->frames);
+        y = worker->frames;
+    }
+    float largest = normalizeOutput(&run->plan, run->x, N,  h, M,  &routing,  y, P, run->header.sample_rate);
+    if (spectrum)  unloadIrSpectrum(spectrum);
+    else           for (int c = 0; c < numImpulses; c++)  free(partitions[c]);
+
+    FileData f;
+    memset(&f, 0, sizeof(f));
+    f.sample_name = impulse;  f.output_name = output;
+    f.header_sample = run->header;
+    f.output_file = fopen(output, "wb");
+    if (!f.output_file) {
+        snprintf(error, errorSize, "Couldn't create %s", output);
+        return false;
+    }
+    finalizeOutputFile(&f, y, P, C, largest);
+    fclose(f.output_file);
+    *audioSeconds = (double)N / (run->header.sample_rate > 0 ? run->header.sample_rate : 44100);
+    return true;
+}
+
+
+// Has numWorkers threads convolve all the run's files, and reports how fast that went
+void runBatchWorkers(BatchRun* run, int numWorkers)
+{
+    SHOW_DEBUG_OUTPUT = 0;
+    SHOW_PROGRESS = 0;
+
+    double startTime = secondsNow();
+    BatchWorker* workers = (BatchWorker*)calloc(numWorkers, sizeof(BatchWorker));
+    for (int w = 0; w < numWorkers; w++) {
+        workers[w].run = run;
+        pthread_create(&workers[w].thread, NULL, batchWorkerThread, &workers[w]);
+    }
+    for (int w = 0; w < numWorkers; w++)
+        pthread_join(workers[w].thread, NULL);
+    double seconds = secondsNow() - startTime;
+    free(workers);
+
+    int done = run->num_files - atomic_load(&run->failed);
+    printf("\n%s complete: %d of %d files convolved (%.1lf seconds of audio) in %.2lf seconds\n",
+           run->sweep ? "Sweep" : "Batch", done, run->num_files, run->audio_seconds, seconds);
+    printf("  %.2lf files/sec, %.1lf audio-seconds/sec\n\n", done / seconds, run->audio_seconds / seconds);
+}
+
+
+// Picks up files from the run's list one after another, until there are none left
+void* batchWorkerThread(void* arg)
+{
+    BatchWorker* worker = (BatchWorker*)arg;
+    BatchRun* run = worker->run;
+
+    for (int i = atomic_fetch_add(&run->next, 1); i < run->num_files; i = atomic_fetch_add(&run->next, 1)) {
+        double audioSeconds = 0.0, startTime = secondsNow();
+        char error[ERROR_MESSAGE_SIZE] = "";
+        bool ok = run->sweep ? convolveSweepFile(worker, run->inputs[i], run->outputs[i], &audioSeconds, error, sizeof(error))
+                             : convolveBatchFile(worker, run->inputs[i], run->outputs[i], &audioSeconds, error, sizeof(error));
+
+        pthread_mutex_lock(&run->lock);
+        if (ok) {
+            run->audio_seconds += audioSeconds;
+            printf("  %s -> %s  (%.1lf s of audio in %.3lf s)\n", run->inputs[i], run->outputs[i], audioSeconds, secondsNow() - startTime);
+        }
+        else {
+            atomic_fetch_add(&run->failed, 1);
+            if (error[0])
+                fprintf(stderr, "%s\n", error);
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&run->lock);
+    }
+    for (int c = 0; c < MAX_CHANNELS; c++) {
+        free(worker->x[c]); free(worker->y[c]);
+    }
+    free(worker->frames);
+    return NULL;
+}
+
+
+/*
+    Does for one file of a batch what createOutputFile() does, with the run's impulse response and plan, and
+    the worker's buffers. Sets audioSeconds to the input's length. Returns false, with why in error, if the
+    input can't be read or convolved with the impulse response, or the output can't be created; it never
+    exits, as the daemon uses it too.
+*/
+bool convolveBatchFile(BatchWorker* worker, char* input, char* output, double* audioSeconds, char* error, size_t errorSize)
+{
+    BatchRun* run = worker->run;
+    FileData f;
+    memset(&f, 0, sizeof(f));
+    f.sample_name = input;  f.output_name = output;
+    f.options = run->plan;
+
+    f.sample_file = fopen(input, "rb");
+    if (!f.sample_file) {
+        snprintf(error, errorSize, "Couldn't open %s", input);
+        return false;
+    }
+    WavData* x = NULL;
+    if (!tryReadWavHeader(f.sample_file, &f.header_sample, input, error, errorSize) ||
+        !(x = tryMapWavData(f.sample_file, &f.header_sample, input, error, errorSize))) {
+        fclose(f.sample_file);
+        return false;
+    }
+    int N = x->num_samples, M = run->M, P = N + M - 1;
+    ChannelRouting routing;
+    if (!planChannelRouting(x->num_channels, run->num_impulses, &routing)) {
+        snprintf(error, errorSize, "Can't convolve the %d-channel %s with a %d-channel impulse response", x->num_channels,
+                 input, run->num_impulses);
+        unmapWavData(x);
+        fclose(f.sample_file);
+        return false;
+    }
+    int C = routing.num_outputs;
+
+    for (int c = 0; c < routing.num_inputs; c++)
+        worker->x[c] = growBuffer(worker->x[c], &worker->x_capacity[c], N);
+    for (int c = 0; c < C; c++)
+        worker->y[c] = growBuffer(worker->y[c], &worker->y_capacity[c], P);
+    readChannels(x, 0, N, worker->x);
+    unmapWavData(x);
+    fclose(f.sample_file);
+
+    convolveChannels(&run->plan, worker->x, N,  run->h, M,  &routing,  worker->y, P);
+    float* y = worker->y[0];
+    if (C > 1) {
+        worker->frames = growBuffer(worker->frames, &worker->frames_capacity, (size_t)P * C);
+        interleaveChannels(worker->y, C, P, worker->frames);
+        y = worker->frames;
+    }
+    float largest = normalizeOutput(&run->plan, worker->x, N,  run->h, M,  &routing,  y, P, f.header_sample.sample_rate);
+
+    f.output_file = fopen(output, "wb");
+    if (!f.output_file) {
+        snprintf(error, errorSize, "Couldn't create %s", output);
+        return false;
+    }
+    finalizeOutputFile(&f, y, P, C, largest);
+    fclose(f.output_file);
+    *audioSeconds = (double)N / (f.header_sample.sample_rate > 0 ? f.header_sample.sample_rate : 44100);
+    return true;
+}
+
+
+// Returns buffer, or a bigger one in its place if it has room for fewer than needed floats (updating capacity)
+float* growBuffer(float* buffer, size_t* capacity, size_t needed)
+{
+    if (needed <= *capacity)
+        return buffer;
+    free(buffer);
+    *capacity = needed;
+    return (float*)malloc(needed * sizeof(float));
+}
+
+
+// ----- DAEMON ---------------------------------------------------------------
+/*
+    --daemon: instead of convolving, waits for jobs on a Unix domain socket, and does them with a pool of
+    --threads workers, each doing one job at a time (as with --batch). A job is an input file, an impulse
+    response file, an output file and the engine settings to use; jobs are sent with --submit (see
+    submitJob()), which waits for the answer. For small jobs, most of the time a normal run takes goes on
+    starting up, loading and transforming the impulse response and making the FFT tables; the daemon does all
+    that once, and keeps the impulse responses (with their partition spectra, for upols) and the FFT plans in
+    memory for every job after the first. Impulse responses are known by their file names, so a file that
+    changes needs a restart of the daemon to be picked up.
+
+    Jobs wait in a queue of DAEMON_QUEUE_SIZE; while it's full, no more connections are accepted, so
+    submitters wait (in the socket's backlog) until there's room. The listening thread only accepts
+    connections: each job's request is read by the worker that takes it, so a submitter that's slow to send
+    it only holds up that worker. Each job's times are sent back to its
+    submitter, and logged with the daemon's running totals. Up to DAEMON_MAX_IMPULSES impulse responses are
+    kept loaded; after that, the one least recently used (by no job that's still running) makes room.
+
+    The daemon reads the files with the try...() readers, which return an error rather than exiting, so a job
+    whose files can't be used (whatever the submitter found when it checked them) just gets "ERROR <reason>"
+    back, and the daemon carries on with the next.
+*/
+void runDaemon(FileData* f)
+{
+    Daemon* daemon = (Daemon*)calloc(1, sizeof(Daemon));
+    daemon->options = f->options;
+    pthread_mutex_init(&daemon->lock, NULL);
+    pthread_cond_init(&daemon->queue_changed, NULL);
+    pthread_mutex_init(&daemon->impulses_lock, NULL);
+    pthread_cond_init(&daemon->impulse_loaded, NULL);
+    for (int i = 0; i < DAEMON_MAX_IMPULSES; i++)
+        pthread_mutex_init(&daemon->impulses[i].lock, NULL);
+    if (f->options.calibrate) {  // (once, rather than for every job)
+        Options requested = f->options;
+        requested.engine = ENGINE_AUTO;
+        planConvolution(&requested, 1, 1);
+        daemon->options.calibrate = false;
+    }
+    signal(SIGPIPE, SIG_IGN);  // (a submitter that's gone away shouldn't take the daemon with it)
+    int listener = listenOnSocket(f->options.daemon);
+
+    printf("\nconvolve daemon listening on %s, %d worker%s\n\n", f->options.daemon, f->options.threads,
+           (f->options.threads == 1) ? "" : "s");
+    fflush(stdout);
+    SHOW_DEBUG_OUTPUT = 0;
+    SHOW_PROGRESS = 0;
+    for (int w = 0; w < f->options.threads; w++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, daemonWorkerThread, daemon);
+        pthread_detach(thread);
+    }
+
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+            continue;
+        struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };  // (so a submitter that says nothing can't hold up its worker)
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        DaemonJob job = { .client = client, .queued_at = secondsNow() };  // (the request is read by the worker)
+
+        pthread_mutex_lock(&daemon->lock);
+        while (daemon->queue_length == DAEMON_QUEUE_SIZE)
+            pthread_cond_wait(&daemon->queue_changed, &daemon->lock);
+        daemon->queue[(daemon->queue_start + daemon->queue_length++) % DAEMON_QUEUE_SIZE] = job;
+        pthread_cond_broadcast(&daemon->queue_changed);
+        pthread_mutex_unlock(&daemon->lock);
+    }
+}
+
+
+// Returns a socket listening on the Unix domain socket path, or exits if it can't be made (or a daemon is already using it)
+int listenOnSocket(char* path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(-1);
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "A daemon is already listening on %s\n", path);
+        exit(-1);
+    }
+    unlink(path);  // (left over from a daemon that's no longer running)
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        fprintf(stderr, "Couldn't listen on %s\n", path);
+        exit(-1);
+    }
+    return listener;
+}
+
+
+/*
+    Reads a job request from a submitter's connection into job, returning false if it isn't a valid one.
+    A request is one line:
+        JOB <engine> <normalize> <fft size> <block size> <crossover> <isa> <max latency>\t<input>\t<impulse response>\t<output>
+    with the enums as numbers and the files as absolute paths (see submitJob()).
+*/
+bool readDaemonRequest(int client, DaemonJob* job)
+{
+    char request[DAEMON_REQUEST_SIZE];
+    int length = 0;
+    while (length < DAEMON_REQUEST_SIZE - 1) {
+        ssize_t got = read(client, request + length, DAEMON_REQUEST_SIZE - 1 - length);
+        if (got <= 0)
+            return false;
+        length += got;
+        if (memchr(request, '\n', length))
+            break;
+    }
+    request[length] = '\0';
+    char* end = strchr(request, '\n');
+    if (!end)
+        return false;
+    *end = '\0';
+
+    int engine, normalize, isa, used = 0;
+    Options* o = &job->options;
+    if (sscanf(request, "JOB %d %d %d %d %d %d %d%n", &engine, &normalize, &o->fft_size, &o->block_size,
+               &o->crossover, &isa, &o->max_latency, &used) != 7 || request[used] != '\t')
+        return false;
+    if (engine < 0 || engine > ENGINE_AUTO || normalize < NORMALIZE_PEAK || normalize > NORMALIZE_NONE ||
+        isa < ISA_SCALAR || isa > ISA_AUTO ||
+        (o->fft_size != 0 && (o->fft_size < 16 || o->fft_size > MAX_BLOCK_SIZE || nextPowerOf2(o->fft_size) != o->fft_size)) ||
+        o->block_size < 8 || o->block_size > MAX_BLOCK_SIZE || nextPowerOf2(o->block_size) != o->block_size ||
+        (o->crossover != 0 && (o->crossover < 8 || o->crossover > MAX_BLOCK_SIZE || nextPowerOf2(o->crossover) != o->crossover)))
+        return false;
+    o->engine = engine;  o->normalize = normalize;  o->isa = isa;
+
+    char* files[3];
+    char* field = request + used + 1;
+    for (int i = 0; i < 3; i++) {
+        char* tab = strchr(field, '\t');
+        if ((tab == NULL) != (i == 2) || field[0] != '/')
+            return false;
+        if (tab)  *tab = '\0';
+        files[i] = field;
+        field = tab + 1;
+    }
+    job->input = strdup(files[0]);  job->impulse = strdup(files[1]);  job->output = strdup(files[2]);
+    return true;
+}
+
+
+// Takes jobs from the daemon's queue one after another, forever, answering each job's submitter
+void* daemonWorkerThread(void* arg)
+{
+    Daemon* daemon = (Daemon*)arg;
+    BatchWorker worker;  // (just for its buffers, which are kept from one job to the next)
+    memset(&worker, 0, sizeof(worker));
+
+    for (;;) {
+        pthread_mutex_lock(&daemon->lock);
+        while (daemon->queue_length == 0)
+            pthread_cond_wait(&daemon->queue_changed, &daemon->lock);
+        DaemonJob job = daemon->queue[daemon->queue_start];
+        daemon->queue_start = (daemon->queue_start + 1) % DAEMON_QUEUE_SIZE;
+        daemon->queue_length--;
+        pthread_cond_broadcast(&daemon->queue_changed);
+        pthread_mutex_unlock(&daemon->lock);
+
+        if (!readDaemonRequest(job.client, &job)) {
+            dprintf(job.client, "ERROR bad request\n");
+            close(job.client);
+            continue;
+        }
+        double startTime = secondsNow();
+        char reply[ERROR_MESSAGE_SIZE];
+        bool ok = runDaemonJob(daemon, &worker, &job, reply, sizeof(reply));
+        double endTime = secondsNow();
+
+        // what the submitter gets back: OK <seconds queued> <seconds convolving> <seconds of audio> <engine>
+        if (ok)
+            dprintf(job.client, "OK %.6lf %.6lf %s\n", startTime - job.queued_at, endTime - startTime, reply);
+        else
+            dprintf(job.client, "ERROR %s\n", reply);
+        close(job.client);
+
+        pthread_mutex_lock(&daemon->lock);
+        if (ok) {
+            double audioSeconds = atof(reply);
+            daemon->jobs_done++;
+            daemon->audio_seconds += audioSeconds;
+            daemon->latency_seconds += endTime - job.queued_at;
+            printf("  %s -> %s  (%.1lf s of audio: queued %.3lf s, convolved in %.3lf s, %.0lfx real time)"
+                   "   [%ld done, %ld failed, mean latency %.3lf s]\n", job.input, job.output, audioSeconds,
+                   startTime - job.queued_at, endTime - startTime, audioSeconds / (endTime - startTime),
+                   daemon->jobs_done, daemon->jobs_failed, daemon->latency_seconds / daemon->jobs_done);
+        }
+        else {
+            daemon->jobs_failed++;
+            printf("  %s -> %s  failed: %s\n", job.input, job.output, reply);
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&daemon->lock);
+        free(job.input); free(job.impulse); free(job.output);
+    }
+    return NULL;
+}
+
+
+/*
+    Does one job, with the impulse response kept by the daemon and the worker's buffers, planning it (on a
+    single thread) as a normal run would. On success, puts "<seconds of audio> <engine>" in reply and
+    returns true; otherwise puts what went wrong there and returns false.
+*/
+bool runDaemonJob(Daemon* daemon, BatchWorker* worker, DaemonJob* job, char* reply, size_t replySize)
+{
+    int N;
+    if (!readWavLength(job->input, &N, reply, replySize))
+        return false;
+
+    DaemonImpulse* impulse = findDaemonImpulse(daemon, job->impulse, reply, replySize);
+    if (!impulse)
+        return false;
+    BatchRun run;
+    memset(&run, 0, sizeof(run));
+    memcpy(run.h, impulse->h, sizeof(run.h));
+    run.M = impulse->M;
+    run.num_impulses = impulse->num_impulses;
+
+    Options requested = daemon->options;
+    requested.engine = job->options.engine;
+    requested.normalize = job->options.normalize;
+    requested.fft_size = job->options.fft_size;
+    requested.block_size = job->options.block_size;
+    requested.crossover = job->options.crossover;
+    requested.isa = job->options.isa;
+    requested.max_latency = job->options.max_latency;
+    requested.threads = 1;
+    run.plan = planConvolutionWithSpectrum(&requested, impulse->spectrum, N, run.M);
+    if (run.plan.engine == ENGINE_UPOLS && !run.plan.partitions)
+        run.plan.partitions = daemonPartitions(daemon, impulse, run.plan.block_size);
+    if (run.plan.engine == ENGINE_HYBRID && run.plan.crossover == 0) {
+        pthread_mutex_lock(&impulse->lock);
+        if (impulse->crossover == 0)
+            impulse->crossover = chooseHybridCrossover(impulse->h[0], impulse->M);
+        run.plan.crossover = impulse->crossover;
+        pthread_mutex_unlock(&impulse->lock);
+    }
+
+    worker->run = &run;
+    double audioSeconds;
+    bool ok = convolveBatchFile(worker, job->input, job->output, &audioSeconds, reply, replySize);
+    releaseDaemonImpulse(daemon, impulse);
+    if (ok)
+        snprintf(reply, replySize, "%.6lf %s", audioSeconds, engineName(run.plan.engine));
+    return ok;
+}
+
+
+/*
+    Returns the daemon's copy of the impulse response in file name, loading it if it's the first job to use
+    it, and marks it as in use until releaseDaemonImpulse(). If DAEMON_MAX_IMPULSES are loaded already, the
+    least recently used one that no job is using is dropped to make room. Returns NULL, with why in error, if
+    the file can't be loaded, or every impulse response loaded is in use.
+
+    The loading is done with impulses_lock released, the slot marked as loading; any other job that wants
+    the same impulse response meanwhile waits for it, and jobs that want others carry on.
+*/
+DaemonImpulse* findDaemonImpulse(Daemon* daemon, char* name, char* error, size_t errorSize)
+{
+    pthread_mutex_lock(&daemon->impulses_lock);
+    DaemonImpulse* impulse;
+    for (;;) {
+        impulse = NULL;
+        for (int i = 0; i < daemon->num_impulses && !impulse; i++)
+            if (daemon->impulses[i].name && strcmp(daemon->impulses[i].name, name) == 0)
+                impulse = &daemon->impulses[i];
+        if (!impulse || !impulse->loading)
+            break;
+        pthread_cond_wait(&daemon->impulse_loaded, &daemon->impulses_lock);  // (another job is loading it)
+    }
+    if (impulse) {
+        impulse->users++;
+        impulse->last_used = secondsNow();
+        pthread_mutex_unlock(&daemon->impulses_lock);
+        return impulse;
+    }
+
+    // a slot for it: an empty one, a new one, or else the least recently used one that no job is using
+    DaemonImpulse* slot = NULL;
+    for (int i = 0; i < daemon->num_impulses && !slot; i++)
+        if (!daemon->impulses[i].name)
+            slot = &daemon->impulses[i];
+    if (!slot && daemon->num_impulses < DAEMON_MAX_IMPULSES)
+        slot = &daemon->impulses[daemon->num_impulses++];
+    if (!slot)
+        for (int i = 0; i < DAEMON_MAX_IMPULSES; i++) {
+            DaemonImpulse* candidate = &daemon->impulses[i];
+            if (candidate->users == 0 && !candidate->loading && (!slot || candidate->last_used < slot->last_used))
+                slot = candidate;
+        }
+    if (!slot) {
+        snprintf(error, errorSize, "all %d impulse responses the daemon keeps are in use", DAEMON_MAX_IMPULSES);
+        pthread_mutex_unlock(&daemon->impulses_lock);
+        return NULL;
+    }
+    if (slot->name)
+        unloadDaemonImpulse(slot);
+    slot->name = strdup(name);
+    slot->loading = true;
+    slot->users = 1;
+    slot->last_used = secondsNow();
+    pthread_mutex_unlock(&daemon->impulses_lock);
+
+    bool loaded = loadDaemonImpulse(slot, name, error, errorSize);
+
+    pthread_mutex_lock(&daemon->impulses_lock);
+    slot->loading = false;
+    if (!loaded) {
+        unloadDaemonImpulse(slot);  // (leaving the slot empty; a job waiting for it will try for itself)
+        slot = NULL;
+    }
+    pthread_cond_broadcast(&daemon->impulse_loaded);
+    pthread_mutex_unlock(&daemon->impulses_lock);
+    return slot;
+}
+
+
+// Says a job has finished with an impulse response from findDaemonImpulse(), so that it can be dropped if the room is needed
+void releaseDaemonImpulse(Daemon* daemon, DaemonImpulse* impulse)
+{
+    pthread_mutex_lock(&daemon->impulses_lock);
+    impulse->users--;
+    pthread_mutex_unlock(&daemon->impulses_lock);
+}
+
+
+// Loads the impulse response in file name (a spectrum or .wav file) into impulse, an empty slot, returning false (with why in error) if it can't
+bool loadDaemonImpulse(DaemonImpulse* impulse, char* name, char* error, size_t errorSize)
+{
+    impulse->spectrum = tryLoadIrSpectrum(name, error, errorSize);
+    if (impulse->spectrum) {
+        impulse->h[0] = impulse->spectrum->samples;
+        impulse->M = impulse->spectrum->header->ir_length;
+        impulse->num_impulses = 1;
+        return true;
+    }
+    if (error[0])
+        return false;
+
+    FILE* file = fopen(name, "rb");
+    if (!file) {
+        snprintf(error, errorSize, "couldn't open %s", name);
+        return false;
+    }
+    WavHeader header;
+    WavData* data = NULL;
+    if (!tryReadWavHeader(file, &header, name, error, errorSize) ||
+        !(data = tryMapWavData(file, &header, name, error, errorSize))) {
+        fclose(file);
+        return false;
+    }
+    if (data->num_samples < 1) {
+        snprintf(error, errorSize, "%s has no samples", name);
+        unmapWavData(data);
+        fclose(file);
+        return false;
+    }
+    impulse->M = data->num_samples;
+    impulse->num_impulses = data->num_channels;
+    for (int c = 0; c < impulse->num_impulses; c++)
+        impulse->h[c] = (float*)malloc(impulse->M * sizeof(float));
+    readChannels(data, 0, impulse->M, impulse->h);
+    unmapWavData(data);
+    fclose(file);
+    return true;
+}
+
+
+// Frees everything loadDaemonImpulse() and daemonPartitions() made for an impulse response, leaving its slot empty
+void unloadDaemonImpulse(DaemonImpulse* impulse)
+{
+    if (impulse->spectrum)
+        unloadIrSpectrum(impulse->spectrum);
+    else
+        for (int c = 0; c < impulse->num_impulses; c++)
+            free(impulse->h[c]);
+    for (int i = 0; i < 32; i++) {
+        free(impulse->partitions[i]);
+        impulse->partitions[i] = NULL;
+    }
+    free(impulse->name);
+    impulse->name = NULL;
+    impulse->spectrum = NULL;
+    memset(impulse->h, 0, sizeof(impulse->h));
+    impulse->M = 0;
+    impulse->num_impulses = 0;
+    impulse->crossover = 0;
+    impulse->users = 0;
+}
+
+
+// Returns the partition spectra of all the impulse response's channels for the upols engine with block size B, working them out if they haven't been yet
+Complex* daemonPartitions(Daemon* daemon, DaemonImpulse* impulse, int B)
+{
+    int log2B = 0;
+    while ((1 << log2B) < B)
+        log2B++;
+
+    pthread_mutex_lock(&impulse->lock);  // (just this impulse response's: jobs using others carry on)
+    if (!impulse->partitions[log2B])
+        impulse->partitions[log2B] = createChannelPartitionSpectra(impulse->h, impulse->num_impulses, impulse->M, B);
+    Complex* partitions = impulse->partitions[log2B];
+    pthread_mutex_unlock(&impulse->lock);
+    return partitions;
+}
+
+
+/*
+    --submit: sends the convolution given on the command line to the daemon listening on options.submit, as
+    a job request (see readDaemonRequest()), waits for it to be done, and prints how long it took. The files
+    are checked here first, so that mistakes get the usual errors without a trip to the daemon (which checks
+    them again itself, as they may change in between). --threads is ignored: the daemon does each job on one
+    thread.
+*/
+void submitJob(FileData* f)
+{
+    SHOW_DEBUG_OUTPUT = 0;
+    Options* o = &f->options;
+
+    // check the input and impulse response (readWavHeader() and routeChannels() exit if they're no good)
+    f->sample_file = fopen(f->sample_name, "rb");
+    if (!f->sample_file) {
+        fprintf(stderr, "Couldn't open %s\n", f->sample_name);
+        exit(-1);
+    }
+    readWavHeader(f->sample_file, &f->header_sample, f->sample_name);
+    sampleFormatOf(&f->header_sample, f->sample_name);
+    fclose(f->sample_file);
+    int numImpulses = 1;
+    IrSpectrum* spectrum = loadIrSpectrum(f->impulse_name);
+    if (spectrum)
+        unloadIrSpectrum(spectrum);
+    else {
+        f->impulse_file = fopen(f->impulse_name, "rb");
+        if (!f->impulse_file) {
+            fprintf(stderr, "Couldn't open %s\n", f->impulse_name);
+            exit(-1);
+        }
+        readWavHeader(f->impulse_file, &f->header_impulse, f->impulse_name);
+        sampleFormatOf(&f->header_impulse, f->impulse_name);
+        fclose(f->impulse_file);
+        numImpulses = f->header_impulse.num_channels;
+    }
+    if (f->header_sample.num_channels > MAX_CHANNELS || numImpulses > MAX_CHANNELS) {
+        fprintf(stderr, "Files can have at most %d channels\n", MAX_CHANNELS);
+        exit(-1);
+    }
+    routeChannels(f->header_sample.num_channels, numImpulses);
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, o->submit, sizeof(address.sun_path) - 1);
+    int daemon = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(daemon, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "No daemon is listening on %s\n", o->submit);
+        exit(-1);
+    }
+    char* input = absolutePath(f->sample_name);
+    char* impulse = absolutePath(f->impulse_name);
+    char* output = absolutePath(f->output_name);
+    double startTime = secondsNow();
+    dprintf(daemon, "JOB %d %d %d %d %d %d %d\t%s\t%s\t%s\n", o->engine, o->normalize, o->fft_size, o->block_size,
+            o->crossover, o->isa, o->max_latency, input, impulse, output);
+
+    char reply[512];
+    int length = 0;
+    ssize_t got;
+    while (length < (int)sizeof(reply) - 1 && (got = read(daemon, reply + length, sizeof(reply) - 1 - length)) > 0)
+        length += got;
+    reply[length] = '\0';
+    close(daemon);
+    double seconds = secondsNow() - startTime;
+
+    double queued, convolving, audioSeconds;
+    char engine[32];
+    if (sscanf(reply, "OK %lf %lf %lf %31s", &queued, &convolving, &audioSeconds, engine) != 4) {
+        fprintf(stderr, "The daemon couldn't do it: %s", (strncmp(reply, "ERROR ", 6) == 0) ? reply + 6 : "no answer\n");
+        exit(-1);
+    }
+    printf("%s -> %s  (%.1lf s of audio, --engine=%s): queued %.3lf s, convolved in %.3lf s, %.3lf s in all "
+           "(%.0lfx real time)\n", f->sample_name, f->output_name, audioSeconds, engine, queued, convolving, seconds,
+           audioSeconds / seconds);
+    free(input); free(impulse); free(output);
+}
+
+
+// Returns a copy of path made absolute (relative to the current directory), to pass on to another process
+char* absolutePath(char* path)
+{
+    if (path[0] == '/')
+        return strdup(path);
+    char directory[4096];
+    if (!getcwd(directory, sizeof(directory)))
+        strcpy(directory, ".");
+    char* absolute = (char*)malloc(strlen(directory) + strlen(path) + 2);
+    sprintf(absolute, "%s/%s", directory, path);
+    return absolute;
+}
+
+
+// ----- SAMPLE FORMAT CONVERSION ---------------------------------------------
+// Returns the format of a .wav file's samples, or exits if it isn't one that can be read
+SampleFormat sampleFormatOf(WavHeader* header, char* fileName)
+{
+    char error[ERROR_MESSAGE_SIZE];
+    SampleFormat format;
+    if (!trySampleFormatOf(header, fileName, &format, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        exit(-1);
+    }
+    return format;
+}
+
+
+// Sets format to the format of a .wav file's samples, or returns false (with what's wrong in error) if it isn't one that can be read
+bool trySampleFormatOf(WavHeader* header, char* fileName, SampleFormat* format, char* error, size_t errorSize)
+{
+    if (header->audio_format == 1 && header->bits_per_sample == 16)       *format = SAMPLE_INT16;
+    else if (header->audio_format == 1 && header->bits_per_sample == 24)  *format = SAMPLE_INT24;
+    else if (header->audio_format == 1 && header->bits_per_sample == 32)  *format = SAMPLE_INT32;
+    else if (header->audio_format == 3 && header->bits_per_sample == 32)  *format = SAMPLE_FLOAT32;
+    else {
+        snprintf(error, errorSize, "%s: unsupported sample format (%d-bit, format code %d); 16, 24 or 32-bit PCM or 32-bit float only",
+                 fileName, header->bits_per_sample, header->audio_format);
+        return false;
+    }
+    return true;
+}
+
+
+int bytesPerSample(SampleFormat format)
+{
+    switch (format) {
+        case SAMPLE_INT16:  return 2;
+        case SAMPLE_INT24:  return 3;
+        default:            return 4;
+    }
+}
+
+
+/*
+    Converts numSamples samples in the given format to floats in the range -1.0 to +1.0 (integers are divided
+    by 2^15, 2^23 or 2^31; floats are copied as they are). Uses the vector converters if the CPU has them.
+
+    NOTE: the converters assume a little-endian machine (ie: most modern consumer devices), like the .wav format.
+*/
+void convertSamplesToFloat(SampleFormat format, const void* samples, int numSamples, float* floatSamples)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static IsaLevel isa = ISA_AUTO;
+    if (isa == ISA_AUTO)  isa = detectIsaLevel();
+
+    if (isa >= ISA_AVX2) {
+        if (format == SAMPLE_INT16)  { int16ToFloatAVX2(samples, numSamples, floatSamples);  return; }
+        if (format == SAMPLE_INT24)  { int24ToFloatAVX2(samples, numSamples, floatSamples);  return; }
+        if (format == SAMPLE_INT32)  { int32ToFloatAVX2(samples, numSamples, floatSamples);  return; }
+    }
+    else if (isa == ISA_SSE) {
+        if (format == SAMPLE_INT16)  { int16ToFloatSSE2(samples, numSamples, floatSamples);  return; }
+        if (format == SAMPLE_INT32)  { int32ToFloatSSE2(samples, numSamples, floatSamples);  return; }
+    }
+#endif
+    switch (format) {
+        case SAMPLE_INT16:  int16ToFloatScalar(samples, numSamples, floatSamples);  break;
+        case SAMPLE_INT24:  int24ToFloatScalar(samples, numSamples, floatSamples);  break;
+        case SAMPLE_INT32:  int32ToFloatScalar(samples, numSamples, floatSamples);  break;
+        case SAMPLE_FLOAT32:  memcpy(floatSamples, samples, numSamples * sizeof(float));  break;
+    }
+}
+
+
+/*
+    Converts numSamples floats (nominally -1.0 to +1.0) to samples in the given format. Integers are rounded
+    to the nearest value, and anything beyond full scale saturates to the largest positive or negative value
+    instead of wrapping around. Floats are copied as they are.
+*/
+void convertFloatToSamples(SampleFormat format, const float* floatSamples, int numSamples, void* samples)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static IsaLevel isa = ISA_AUTO;
+    if (isa == ISA_AUTO)  isa = detectIsaLevel();
+
+    if (isa >= ISA_AVX2) {
+        if (format == SAMPLE_INT16)  { floatToInt16AVX2(floatSamples, numSamples, samples);  return; }
+        if (format == SAMPLE_INT24)  { floatToInt24AVX2(floatSamples, numSamples, samples);  return; }
+        if (format == SAMPLE_INT32)  { floatToInt32AVX2(floatSamples, numSamples, samples);  return; }
+    }
+    else if (isa == ISA_SSE) {
+        if (format == SAMPLE_INT16)  { floatToInt16SSE2(floatSamples, numSamples, samples);  return; }
+        if (format == SAMPLE_INT32)  { floatToInt32SSE2(floatSamples, numSamples, samples);  return; }
+    }
+#endif
+    switch (format) {
+        case SAMPLE_INT16:  floatToInt16Scalar(floatSamples, numSamples, samples);  break;
+        case SAMPLE_INT24:  floatToInt24Scalar(floatSamples, numSamples, samples);  break;
+        case SAMPLE_INT32:  floatToInt32Scalar(floatSamples, numSamples, samples);  break;
+        case SAMPLE_FLOAT32:  memcpy(samples, floatSamples, numSamples * sizeof(float));  break;
+    }
+}
+
+
+/*
+    The scalar converters, which the vector ones hand whatever doesn't fill a whole vector to. The limits
+    the integer ones clamp to are the largest floats that still convert to in-range integers (2^31 - 1 isn't
+    a float, so the 32-bit limit is the float just below it). A NaN becomes 0: clamped as it is, it would come
+    out as the most negative integer (fmaxf() and the vector max both pick the limit over a NaN).
+*/
+void int16ToFloatScalar(const void* samples, int n, float* out)
+{
+    const int16_t* in = (const int16_t*)samples;
+    for (int i = 0; i < n; i++)
+        out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+
+void int24ToFloatScalar(const void* samples, int n, float* out)
+{
+    const unsigned char* in = (const unsigned char*)samples;
+    for (int i = 0; i < n; i++, in += 3) {
+        int32_t value = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 24);
+        out[i] = value * (1.0f / 2147483648.0f);  // (value is the sample << 8)
+    }
+}
+
+
+void int32ToFloatScalar(const void* samples, int n, float* out)
+{
+    const int32_t* in = (const int32_t*)samples;
+    for (int i = 0; i < n; i++)
+        out[i] = in[i] * (1.0f / 2147483648.0f);
+}
+
+
+void floatToInt16Scalar(const float* in, int n, void* samples)
+{
+    int16_t* out = (int16_t*)samples;
+    for (int i = 0; i < n; i++)
+        out[i] = isnan(in[i]) ? 0 : (int16_t)lrintf(fminf(fmaxf(in[i] * 32768.0f, -32768.0f), 32767.0f));
+}
+
+
+void floatToInt24Scalar(const float* in, int n, void* samples)
+{
+    unsigned char* out = (unsigned char*)samples;
+    for (int i = 0; i < n; i++, out += 3) {
+        int32_t value = isnan(in[i]) ? 0 : (int32_t)lrintf(fminf(fmaxf(in[i] * 8388608.0f, -8388608.0f), 8388607.0f));
+        out[0] = value & 0xFF;  out[1] = (value >> 8) & 0xFF;  out[2] = (value >> 16) & 0xFF;
+    }
+}
+
+
+void floatToInt32Scalar(const float* in, int n, void* samples)
+{
+    int32_t* out = (int32_t*)samples;
+    for (int i = 0; i < n; i++)
+        out[i] = isnan(in[i]) ? 0 : (int32_t)lrintf(fminf(fmaxf(in[i] * 2147483648.0f, -2147483648.0f), 2147483520.0f));
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void int16ToFloatSSE2(const void* samples, int n, float* out)
+{
+    const int16_t* in = (const int16_t*)samples;
+    __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);  // sign-extend to 32 bits
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    int16ToFloatScalar(in + i, n - i, out + i);
+}
+
+
+__attribute__((target("sse2")))
+void int32ToFloatSSE2(const void* samples, int n, float* out)
+{
+    const int32_t* in = (const int32_t*)samples;
+    __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(in + i))), scale));
+    int32ToFloatScalar(in + i, n - i, out + i);
+}
+
+
+__attribute__((target("sse2")))
+void floatToInt16SSE2(const float* in, int n, void* samples)
+{
+    int16_t* out = (int16_t*)samples;
+    __m128 scale = _mm_set1_ps(32768.0f), low = _mm_set1_ps(-32768.0f), high = _mm_set1_ps(32767.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 x = _mm_loadu_ps(in + i), y = _mm_loadu_ps(in + i + 4);
+        x = _mm_and_ps(x, _mm_cmpord_ps(x, x));  // (NaNs to 0)
+        y = _mm_and_ps(y, _mm_cmpord_ps(y, y));
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(x, scale), low), high);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(y, scale), low), high);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+    floatToInt16Scalar(in + i, n - i, out + i);
+}
+
+
+__attribute__((target("sse2")))
+void floatToInt32SSE2(const float* in, int n, void* samples)
+{
+    int32_t* out = (int32_t*)samples;
+    __m128 scale = _mm_set1_ps(2147483648.0f), low = _mm_set1_ps(-2147483648.0f), high = _mm_set1_ps(2147483520.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(in + i);
+        x = _mm_and_ps(x, _mm_cmpord_ps(x, x));  // (NaNs to 0)
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(x, scale), low), high);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_cvtps_epi32(a));
+    }
+    floatToInt32Scalar(in + i, n - i, out + i);
+}
+
+
+__attribute__((target("avx2")))
+void int16ToFloatAVX2(const void* samples, int n, float* out)
+{
+    const int16_t* in = (const int16_t*)samples;
+    __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+    }
+    int16ToFloatScalar(in + i, n - i, out + i);
+}
+
+
+/*
+    8 packed 24-bit samples (24 bytes) at a time: each 128-bit lane gets 12 of the bytes, and a shuffle moves
+    each sample's 3 bytes to the top of a 32-bit slot, which makes it the sample << 8, sign included. The
+    second load reads 4 bytes past the 8 samples, hence the loop condition.
+*/
+__attribute__((target("avx2")))
+void int24ToFloatAVX2(const void* samples, int n, float* out)
+{
+    const unsigned char* in = (const unsigned char*)samples;
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                             -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    int i = 0;
+    for (; i + 10 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(in + 3 * i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(in + 3 * i + 12));
+        __m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuffle);
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    int24ToFloatScalar(in + 3 * i, n - i, out + i);
+}
+
+
+__attribute__((target("avx2")))
+void int32ToFloatAVX2(const void* samples, int n, float* out)
+{
+    const int32_t* in = (const int32_t*)samples;
+    __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(in + i))), scale));
+    int32ToFloatScalar(in + i, n - i, out + i);
+}
+
+
+__attribute__((target("avx2")))
+void floatToInt16AVX2(const float* in, int n, void* samples)
+{
+    int16_t* out = (int16_t*)samples;
+    __m256 scale = _mm256_set1_ps(32768.0f), low = _mm256_set1_ps(-32768.0f), high = _mm256_set1_ps(32767.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 x = _mm256_loadu_ps(in + i), y = _mm256_loadu_ps(in + i + 8);
+        x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));  // (NaNs to 0)
+        y = _mm256_and_ps(y, _mm256_cmp_ps(y, y, _CMP_ORD_Q));
+        __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(x, scale), low), high);
+        __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(y, scale), low), high);
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));  // packs within lanes,
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(packed, 0xD8));  // so put them in order
+    }
+    floatToInt16Scalar(in + i, n - i, out + i);
+}
+
+
+__attribute__((target("avx2")))
+void floatToInt24AVX2(const float* in, int n, void* samples)
+{
+    unsigned char* out = (unsigned char*)samples;
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m256 scale = _mm256_set1_ps(8388608.0f), low = _mm256_set1_ps(-8388608.0f), high = _mm256_set1_ps(8388607.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));  // (NaNs to 0)
+        __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(x, scale), low), high);
+        __m256i v = _mm256_shuffle_epi8(_mm256_cvtps_epi32(a), shuffle);  // 12 bytes at the bottom of each lane
+        __m128i lo = _mm256_castsi256_si128(v), hi = _mm256_extracti128_si256(v, 1);
+        unsigned char* o = out + 3 * i;
+        _mm_storel_epi64((__m128i*)o, lo);
+        uint32_t rest = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+        memcpy(o + 8, &rest, 4);
+        _mm_storel_epi64((__m128i*)(o + 12), hi);
+        rest = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+        memcpy(o + 20, &rest, 4);
+    }
+    floatToInt24Scalar(in + i, n - i, out + 3 * i);
+}
+
+
+__attribute__((target("avx2")))
+void floatToInt32AVX2(const float* in, int n, void* samples)
+{
+    int32_t* out = (int32_t*)samples;
+    __m256 scale = _mm256_set1_ps(2147483648.0f), low = _mm256_set1_ps(-2147483648.0f), high = _mm256_set1_ps(2147483520.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));  // (NaNs to 0)
+        __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(x, scale), low), high);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_cvtps_epi32(a));
+    }
+    floatToInt32Scalar(in + i, n - i, out + i);
+}
+#endif
+
+
+// ----- IMPULSE RESPONSE SPECTRUM FILES --------------------------------------
+/*
+    For --make-irspec: reads the impulse response .wav file, computes the spectra of its partitions for the
+    upols engine (see createUniformConvolver()), and saves them, along with the impulse response's samples,
+    to a spectrum file (see IrSpectrumHeader). Convolving with the spectrum file in place of the .wav file
+    then skips reading and converting the .wav file and all of the impulse response's FFTs, which matters
+    when the same impulse response is used over and over.
+*/
+void createIrSpectrumFile(FileData* f)
+{
+    f->impulse_file = fopen(f->impulse_name, "rb");
+    if (!f->impulse_file) {
+        fprintf(stderr, "Couldn't open %s\n", f->impulse_name);
+        exit(-1);
+    }
+    readWavHeader(f->impulse_file, &f->header_impulse, f->impulse_name);
+    WavData* h = mapWavData(f->impulse_file, &f->header_impulse, f->impulse_name);
+    int M = h->num_samples;
+    if (h->num_channels != 1) {
+        fprintf(stderr, "%s has %d channels; spectrum files can only be made of mono impulse responses\n", f->impulse_name, h->num_channels);
+        exit(-1);
+    }
+
+    float* h_float_form = (float*)malloc(M * sizeof(float));
+    convertSamplesToFloat(h->format, h->samples, M, h_float_form);
+    unmapWavData(h);
+    fclose(f->impulse_file);
+
+    int B = f->options.block_size;
+    UniformConvolver* c = createUniformConvolver(h_float_form, M, B);
+
+    IrSpectrumHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CNVIRSPC", 8);
+    header.version = IR_SPECTRUM_VERSION;
+    header.isa = detectIsaLevel();
+    header.alignment = IR_SPECTRUM_ALIGNMENT;
+    header.block_size = B;
+    header.num_partitions = c->num_partitions;
+    header.num_bins = c->num_bins;
+    header.ir_length = M;
+    header.sample_rate = f->header_impulse.sample_rate;
+    size_t samplesBytes = (size_t)M * sizeof(float);
+    size_t spectraBytes = (size_t)c->num_partitions * c->num_bins * sizeof(Complex);
+    header.samples_offset = (sizeof(header) + IR_SPECTRUM_ALIGNMENT - 1) / IR_SPECTRUM_ALIGNMENT * IR_SPECTRUM_ALIGNMENT;
+    header.spectra_offset = (header.samples_offset + samplesBytes + IR_SPECTRUM_ALIGNMENT - 1) / IR_SPECTRUM_ALIGNMENT * IR_SPECTRUM_ALIGNMENT;
+
+    FILE* out = fopen(f->output_name, "wb");
+    if (!out) {
+        fprintf(stderr, "Couldn't create %s\n", f->output_name);
+        exit(-1);
+    }
+    static const char padding[IR_SPECTRUM_ALIGNMENT];
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(padding, 1, header.samples_offset - sizeof(header), out);
+    fwrite(h_float_form, 1, samplesBytes, out);
+    fwrite(padding, 1, header.spectra_offset - header.samples_offset - samplesBytes, out);
+    bool ok = fwrite(c->partitions, 1, spectraBytes, out) == spectraBytes;
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Couldn't write %s\n", f->output_name);
+        exit(-1);
+    }
+    printf("\nSaved the spectra of %d partitions of %d samples (%d taps) to %s\n", c->num_partitions, B, M, f->output_name);
+
+    destroyUniformConvolver(c);
+    free(h_float_form);
+}
+
+
+/*
+    If the named file is an impulse response spectrum file (see createIrSpectrumFile()), maps it into memory
+    and returns where its parts are; the samples and spectra are used straight from the mapping, without
+    being read or copied. Returns NULL if it isn't one (e.g. if it's a .wav file), and exits if it is one
+    but is damaged or from an incompatible version of this program.
+*/
+IrSpectrum* loadIrSpectrum(char* fileName)
+{
+    char error[ERROR_MESSAGE_SIZE];
+    IrSpectrum* spectrum = tryLoadIrSpectrum(fileName, error, sizeof(error));
+    if (!spectrum && error[0]) {
+        fprintf(stderr, "%s\n", error);
+        exit(-1);
+    }
+    return spectrum;
+}
+
+
+// Does what loadIrSpectrum() does, but instead of exiting, returns NULL with what's wrong in error (which is
+// left empty when the file just isn't a spectrum file)
+IrSpectrum* tryLoadIrSpectrum(char* fileName, char* error, size_t errorSize)
+{
+    error[0] = '\0';
+    int fd = open(fileName, O_RDONLY);
+    char magic[8];
+    struct stat info;
+    if (fd < 0 || pread(fd, magic, 8, 0) != 8 || memcmp(magic, "CNVIRSPC", 8) != 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0)  close(fd);
+        return NULL;
+    }
+    void* map = ((size_t)info.st_size >= sizeof(IrSpectrumHeader))
+                ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        snprintf(error, errorSize, "Couldn't read the spectrum file %s", fileName);
+        return NULL;
+    }
+
+    IrSpectrumHeader* header = (IrSpectrumHeader*)map;
+    uint64_t B = header->block_size, M = header->ir_length;
+    bool valid = header->version == IR_SPECTRUM_VERSION
+                 && B >= 8 && (B & (B - 1)) == 0 && M >= 1
+                 && header->num_bins == B + 1 && header->num_partitions == (M + B - 1) / B
+                 && header->alignment >= sizeof(float) && header->samples_offset % header->alignment == 0
+                 && header->spectra_offset % header->alignment == 0
+                 && header->samples_offset + M * sizeof(float) <= (uint64_t)info.st_size
+                 && header->spectra_offset + (uint64_t)header->num_partitions * header->num_bins * sizeof(Complex) <= (uint64_t)info.st_size;
+    if (!valid) {
+        munmap(map, info.st_size);
+        snprintf(error, errorSize, "%s is not a usable spectrum file (damaged, or made by a different version)", fileName);
+        return NULL;
+    }
+    madvise(map, info.st_size, MADV_WILLNEED);
+
+    IrSpectrum* spectrum = (IrSpectrum*)malloc(sizeof(IrSpectrum));
+    spectrum->header = header;
+    spectrum->length = info.st_size;
+    spectrum->samples = (float*)((char*)map + header->samples_offset);
+    spectrum->partitions = (Complex*)((char*)map + header->spectra_offset);
+    return spectrum;
+}
+
+
+void unloadIrSpectrum(IrSpectrum* spectrum)
+{
+    munmap(spectrum->header, spectrum->length);
+    free(spectrum);
+}
+
+
+// ----- REAL-TIME TEST HARNESS -----------------------------------------------
+/*
+    --realtime=FRAMES: a test harness for the real-time convolver. Convolves the input file as an audio
+    callback would: FRAMES samples at a time, each call made when that many samples' worth of time has gone
+    by since the last (so the tail thread gets the time it would in a real audio system), and times every
+    call. Reports the mean, 99th percentile and worst-case call times against the time a call has (FRAMES
+    samples' worth), and how many tail samples came late. The output is written as usual, to check.
+
+    The head's block size is the biggest power of 2 (up to 1024) that divides FRAMES, the tail's is
+    --block-size. Each path of a multichannel convolution (see planChannelRouting()) has its own convolver,
+    all processed in the same call. The convolvers are HotSwapConvolvers, and with --swap-ir, halfway
+    through the input they're each given their channel of that impulse response (which must have as many
+    channels as the first), so the times include a swap and its crossfade.
+*/
+void runRealtimeHarness(FileData* f)
+{
+    IrSpectrum* spectrum = loadIrSpectrum(f->impulse_name);
+    readInputFileHeaders(f, spectrum == NULL);
+    WavData* x = mapWavData(f->sample_file, &f->header_sample, f->sample_name);
+    WavData* h = spectrum ? NULL : mapWavData(f->impulse_file, &f->header_impulse, f->impulse_name);
+    int N = x->num_samples, M = spectrum ? (int)spectrum->header->ir_length : h->num_samples;
+    ChannelRouting routing = routeChannels(x->num_channels, h ? h->num_channels : 1);
+    float* x_channels[MAX_CHANNELS];
+    float* h_channels[MAX_CHANNELS];
+    for (int c = 0; c < routing.num_inputs; c++)
+        x_channels[c] = (float*)malloc(N * sizeof(float));
+    readChannels(x, 0, N, x_channels);
+    if (spectrum)
+        h_channels[0] = spectrum->samples;
+    else {
+        for (int c = 0; c < routing.num_impulses; c++)
+            h_channels[c] = (float*)malloc(M * sizeof(float));
+        readChannels(h, 0, M, h_channels);
+    }
+    unmapWavData(x);
+    if (h)  unmapWavData(h);
+
+    // the impulse response to swap to, if any
+    float* swap_channels[MAX_CHANNELS];
+    int swapLength = 0;
+    IrSpectrum* swapSpectrum = NULL;
+    if (f->options.swap_ir) {
+        swapSpectrum = loadIrSpectrum(f->options.swap_ir);
+        int numSwapChannels = 1;
+        if (swapSpectrum) {
+            swap_channels[0] = swapSpectrum->samples;
+            swapLength = swapSpectrum->header->ir_length;
+        }
+        else {
+            FILE* file = fopen(f->options.swap_ir, "rb");
+            if (!file) {
+                fprintf(stderr, "Couldn't open %s\n", f->options.swap_ir);
+                exit(-1);
+            }
+            WavHeader header;
+            readWavHeader(file, &header, f->options.swap_ir);
+            WavData* data = mapWavData(file, &header, f->options.swap_ir);
+            swapLength = data->num_samples;
+            numSwapChannels = data->num_channels;
+            for (int c = 0; c < numSwapChannels && c < routing.num_impulses; c++)
+                swap_channels[c] = (float*)malloc(swapLength * sizeof(float));
+            if (numSwapChannels == routing.num_impulses)
+                readChannels(data, 0, swapLength, swap_channels);
+            unmapWavData(data);
+            fclose(file);
+        }
+        if (numSwapChannels != routing.num_impulses) {
+            fprintf(stderr, "%s has %d channels, but the impulse response it replaces has %d\n", f->options.swap_ir,
+                    numSwapChannels, routing.num_impulses);
+            exit(-1);
+        }
+    }
+
+    int frames = f->options.realtime, B = 1;
+    while (frames % (2 * B) == 0 && 2 * B <= 1024)
+        B *= 2;
+    int rate = (f->header_sample.sample_rate > 0) ? f->header_sample.sample_rate : 44100;
+    HotSwapConvolver* convolvers[MAX_CHANNELS];
+    for (int p = 0; p < routing.num_paths; p++)
+        convolvers[p] = createHotSwapConvolver(h_channels[routing.paths[p].impulse], M, B, f->options.block_size, f->options.crossfade);
+    printf("\nReal-time convolver: %d-frame callbacks (%.2lf ms at %d Hz), head block size %d, tail block size %d%s\n",
+           frames, 1000.0 * frames / rate, rate, B, convolvers[0]->tail_block_size, convolvers[0]->current->tail ? "" : " (no tail needed)");
+
+    // the callbacks, with buffers that are made beforehand as a real callback's would be
+    int P = N + ((swapLength > M) ? swapLength : M) - 1, C = routing.num_outputs, numCalls = (P + frames - 1) / frames;
+    int swapCall = f->options.swap_ir ? (N / 2) / frames : -1;
+    float* y_channels[MAX_CHANNELS];
+    for (int c = 0; c < C; c++)
+        y_channels[c] = (float*)calloc((size_t)numCalls * frames, sizeof(float));
+    float* in = (float*)malloc(frames * sizeof(float));
+    float* out = (float*)malloc(frames * sizeof(float));
+    double* callTimes = (double*)malloc(numCalls * sizeof(double));
+    double period = (double)frames / rate, start = secondsNow();
+    for (int call = 0; call < numCalls; call++) {
+        double due = start + call * period;  // (wait for the next callback's time to come round)
+        struct timespec wait = { .tv_sec = (time_t)due, .tv_nsec = (long)((due - (time_t)due) * 1e9) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wait, NULL);
+        if (call == swapCall) {  // (as a control thread would, between callbacks)
+            for (int p = 0; p < routing.num_paths; p++)
+                swapImpulseResponse(convolvers[p], swap_channels[routing.paths[p].impulse], swapLength);
+            printf("\nSwapping to %s at %.2lf s, with a %d-sample crossfade\n", f->options.swap_ir, (double)call * frames / rate, f->options.crossfade);
+        }
+
+        double callStart = secondsNow();
+        long first = (long)call * frames;
+        for (int p = 0; p < routing.num_paths; p++) {
+            ChannelPath* path = &routing.paths[p];
+            for (int k = 0; k < frames; k++)
+                in[k] = (first + k < N) ? x_channels[path->input][first + k] : 0.0f;
+            processHotSwap(convolvers[p], in, out, frames);
+            float* y = y_channels[path->output] + first;
+            for (int k = 0; k < frames; k++)
+                y[k] += out[k];
+        }
+        callTimes[call] = secondsNow() - callStart;
+    }
+
+    // how it went
+    double total = 0.0, worst = 0.0;
+    long late = 0, dropped = 0, overruns = 0;
+    for (int call = 0; call < numCalls; call++) {
+        total += callTimes[call];
+        if (callTimes[call] > worst)  worst = callTimes[call];
+        if (callTimes[call] > period)  overruns++;
+    }
+    for (int p = 0; p < routing.num_paths; p++) {
+        late += atomic_load(&convolvers[p]->current->late_samples);  // (since the last swap)
+        dropped += atomic_load(&convolvers[p]->current->dropped_samples);
+        if (f->options.swap_ir && atomic_load(&convolvers[p]->swaps) == 0)
+            printf("\nThe swap to %s never happened (the input was too short for it to be loaded in time)\n", f->options.swap_ir);
+        destroyHotSwapConvolver(convolvers[p]);
+    }
+    for (int i = 1; i < numCalls; i++) {  // (sorted, for the percentile)
+        double t = callTimes[i];
+        int j = i;
+        for (; j > 0 && callTimes[j - 1] > t; j--)
+            callTimes[j] = callTimes[j - 1];
+        callTimes[j] = t;
+    }
+    printf("\n%d callbacks:  mean %.1lf us,  99th percentile %.1lf us,  worst %.1lf us  (%.1lf%% of the %.1lf us a callback has)\n",
+           numCalls, 1e6 * total / numCalls, 1e6 * callTimes[(int)(0.99 * (numCalls - 1))], 1e6 * worst,
+           100.0 * worst / period, 1e6 * period);
+    printf("  %ld callbacks over time,  %ld tail samples late,  %ld input samples dropped\n", overruns, late, dropped);
+
+    float* y = y_channels[0];
+    if (C > 1) {
+        y = (float*)malloc((size_t)P * C * sizeof(float));
+        interleaveChannels(y_channels, C, P, y);
+        for (int c = 0; c < C; c++)  free(y_channels[c]);
+    }
+    float largest = normalizeOutput(&f->options, x_channels, N,  h_channels, M,  &routing,  y, P, rate);
+    finalizeOutputFile(f, y, P, C, largest);
+    printf("\n\nConvolution complete. Output file created  :)\n\n");
+
+    for (int c = 0; c < routing.num_inputs; c++)
+        free(x_channels[c]);
+    if (spectrum)  unloadIrSpectrum(spectrum);
+    else           for (int c = 0; c < routing.num_impulses; c++)  free(h_channels[c]);
+    if (swapSpectrum)  unloadIrSpectrum(swapSpectrum);
+    else if (f->options.swap_ir)  for (int c = 0; c < routing.num_impulses; c++)  free(swap_channels[c]);
+    free(y); free(in); free(out); free(callTimes);
+}
@@ -0,0 +1,604 @@
+/*
+    The internals of the convolution engines, shared by the library that has them (libconvolve.c) and the
+    command line program (convolve.c): their settings, types and functions. Programs using the library go
+    through its interface instead (libconvolve.h), which stays the same however these change.
+*/
+#ifndef CONVOLVE_ENGINE_H
+#define CONVOLVE_ENGINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+
+extern int SHOW_DEBUG_OUTPUT;  // show debug/regression test data?  1 for yes, 0 for no
+extern int SHOW_PROGRESS;      //  show progress while convolving?  1 for yes, 0 for no
+extern FILE* messageOutput;    // where the library's messages go (NULL for nowhere)
+
+
+// the process-wide FFT plan cache (see findCachedFftPlan())
+extern char*           fftPlanCacheFile;      // NULL = no cache
+extern pthread_mutex_t fftPlanCacheLock;
+extern bool            fftPlanCacheOpened;
+extern void*           fftPlanCacheMap;       // the whole file, mapped read-only
+extern size_t          fftPlanCacheMapLength;
+
+
+#define MAX_NONUNIFORM_PARTITION_SIZE  16384  // non-uniform partitions stop doubling in size once they reach this
+#define MAX_NONUNIFORM_SEGMENTS        32
+#define OUTPUT_TILE_SIZE               1024   // cache blocking for convolveOutputSideBlocked(): outputs per tile
+#define TAP_TILE_SIZE                  2048   //                                              taps per tile
+#define MIN_HYBRID_CROSSOVER           16     // range of direct-form head lengths the hybrid engine's benchmark tries
+#define MAX_HYBRID_CROSSOVER           4096
+#define MAX_CACHED_FFT_PLANS           32     // FFT sizes the on-disk plan cache has room for (see findCachedFftPlan())
+#define FFT_PLAN_CACHE_VERSION         2
+#define MAX_CHANNELS                   8      // most channels an input or impulse response file can have
+#define MAX_BLOCK_SIZE                 (1 << 24)  // largest block, FFT or crossover size accepted from a user
+#define CHANNEL_CHUNK_SIZE             4096   // samples (de)interleaved at a time (see readChannels())
+#define TYPED_KERNEL_WIDTH             8      // outputs the typed direct-form kernels work on at once (see DEFINE_TYPED_CONVOLUTION())
+
+
+// which algorithm convolve the samples with
+typedef enum {
+    ENGINE_DIRECT,   // time-domain, input side algorithm: convolve()
+    ENGINE_SIMD,     // time-domain, output side with vector kernels: convolveDirectSIMD()
+    ENGINE_BLOCKED,  // time-domain, output side, cache-blocked: convolveOutputSideBlocked()
+    ENGINE_FFT,      // frequency-domain overlap-add: convolveFFT()
+    ENGINE_UPOLS,    // uniformly partitioned overlap-save: convolveUniformPartitioned()
+    ENGINE_NONUNIFORM, // non-uniformly partitioned, tail computed in the background: convolveNonUniformPartitioned()
+    ENGINE_HYBRID,   // zero latency: direct-form head plus non-uniformly partitioned tail: convolveHybrid()
+    ENGINE_AUTO      // whichever of the above planConvolution() estimates is fastest
+} EngineType;
+
+
+// how the output is brought into the range -1.0 to +1.0 before being converted to shorts
+typedef enum {
+    NORMALIZE_PEAK,  // scale by the actual peak: largestSampleIn(), or with --stream a spill file
+    NORMALIZE_BOUND, // scale by sum|h| * max|x|, which no output sample can exceed: peakBound()
+    NORMALIZE_NONE   // leave the level alone, and limit whatever goes over: limitSamples()
+} NormalizeMode;
+
+
+// instruction set levels that the vector kernels are written for, in increasing order of capability
+typedef enum {
+    ISA_SCALAR,
+    ISA_SSE,
+    ISA_AVX2,        // AVX2 + FMA
+    ISA_AVX512,      // AVX-512F
+    ISA_AUTO         // the best one the CPU supports (see detectIsaLevel())
+} IsaLevel;
+
+
+// the types the direct engine stores samples in and accumulates products in (see convolveDirectTyped())
+typedef enum {
+    PRECISION_FLOAT,        // float and float, like every other engine
+    PRECISION_FLOAT_DOUBLE, // float samples, double accumulators
+    PRECISION_DOUBLE,       // double and double
+    PRECISION_INT16         // 16-bit (Q15) fixed-point samples, 32-bit accumulators
+} Precision;
+
+
+/*
+    How long this machine takes for the basic operations the engines are made of, used by the planner to
+    estimate each engine's run time (see planConvolution()). Measured by measureMachineCosts() and kept in a
+    wisdom file; there are built-in defaults for when there isn't one.
+*/
+typedef struct {
+    double direct_mac;      // seconds per multiply-add in the (vector) direct-form kernels
+    double fft_unit;        // seconds per n*log2(n) of a real FFT of size n (forward or inverse)
+    double spectral_mac;    // seconds per complex multiply-accumulate of two spectra
+    double block_overhead;  // seconds of fixed cost per block in the block-based engines (copies, calls)
+} MachineCosts;
+
+
+// one run of equal-size partitions of h[] in the non-uniform layout (see planNonUniformSegments())
+typedef struct {
+    int offset;   // where in h[] the run starts
+    int size;     // partition size
+    int length;   // taps covered
+} SegmentLayout;
+
+
+// a direct-form kernel: y[p] += sum over k of hr[k] * xp[p + k], for p = 0..count-1 (see convolveDirectSIMD())
+typedef void (*DirectKernel)(const float*, const float*, int, float*, int);
+
+
+// a direct-form kernel written for one length of h[] (see directKernelForLength())
+typedef struct {
+    IsaLevel     isa;
+    int          length;
+    DirectKernel kernel;
+} FixedLengthKernel;
+
+
+// one complex number (spectral bin)
+typedef struct {
+    float re;
+    float im;
+} Complex;
+
+
+// one input channel convolved with one impulse response channel, and added into one output channel
+typedef struct {
+    int input;
+    int impulse;
+    int output;
+} ChannelPath;
+
+
+/*
+    Which channels of the input get convolved with which channels of the impulse response, and which output
+    channel each result goes into (see planChannelRouting()). Outputs with more than one path are the sum
+    of them.
+*/
+typedef struct {
+    int num_inputs;            // channels in the input file
+    int num_impulses;          // channels in the impulse response
+    int num_outputs;           // channels in the output file
+    int num_paths;
+    ChannelPath paths[MAX_CHANNELS];
+} ChannelRouting;
+
+
+// struct to hold the settings given on the command line (or through the library interface: see convolve_set_option())
+typedef struct {
+    EngineType engine;
+    int        fft_size;   // 0 = choose automatically from the impulse response length
+    int        block_size; // partition size for the partitioned engines
+    int        crossover;  // direct-form taps for the hybrid engine, 0 = choose by benchmark
+    IsaLevel   isa;        // instruction set for the vector kernels
+    int        threads;    // number of threads to split the convolution across
+    int        max_latency;  // for the planner: most samples of latency allowed, -1 = no limit
+    bool       calibrate;  // measure machine costs and save them to the wisdom file before planning
+    char*      wisdom_file;
+    bool       verify;     // compare the result against convolve() and report the SNR
+    bool       make_irspec;  // save the impulse response's partition spectra instead of convolving
+    bool       stream;     // read, convolve and write a block at a time (see streamOutputFile())
+    NormalizeMode normalize;
+    Precision  precision;  // sample and accumulator types for the direct engine
+    Complex*   partitions; // precomputed partition spectra of h[] for the upols engine (from a spectrum file), or NULL.
+                           // For a multichannel h[], each channel's follow one another.
+    char*      batch;      // --batch: the manifest file, directory or pattern listing the input files, or NULL
+    char*      sweep;      // --sweep: the same, listing the impulse responses, or NULL
+    char*      daemon;     // --daemon: the socket to take jobs on, or NULL
+    char*      submit;     // --submit: the socket of the daemon to send the job to, or NULL
+    int        realtime;   // --realtime: frames per simulated audio callback, or 0
+    char*      swap_ir;    // --swap-ir: the impulse response --realtime switches to halfway through, or NULL
+    int        crossfade;  // samples the switch is crossfaded over
+} Options;
+
+
+// used for displaying progress in 10% increments, if SHOW_PROGRESS is set (see top of program).
+// Can be advanced from several threads at once.
+typedef struct {
+    int             total;      // number of work items (samples, blocks...) to get through
+    atomic_int      done;       // number of them finished so far
+    atomic_int      multiple;   // next multiple of 10% to report
+    pthread_mutex_t lock;       // held while reporting, so the percentages come out in order
+} Progress;
+
+
+// precomputed tables for a real-input FFT of a particular size
+typedef struct {
+    int      size;           // real transform length n (a power of 2)
+    int      half;           // n/2: length of the complex FFT that does the actual work
+    int*     bit_reversed;   // bit-reversal permutation for the half-length complex FFT
+    Complex* twiddles;       // butterfly twiddles: the stage with span s uses twiddles[s-1 .. 2s-2]
+    Complex* split_twiddles; // exp(-2*pi*i*k/n) for k = 0..n/4, used to split/merge the real spectrum
+    bool     owns_tables;    // false if the tables are the plan cache's (in its mapping, or kept by the process)
+} FftPlan;
+
+
+/*
+    Start of the on-disk FFT plan cache file (see findCachedFftPlan()). Each plan's tables are stored at its
+    offset, in the same layout as in memory: bit_reversed, then twiddles, then split_twiddles, each starting
+    on a 64-byte boundary (see fftPlanTableLayout()).
+*/
+typedef struct {
+    char     magic[8];         // "CNVFFTPC"
+    uint32_t version;          // FFT_PLAN_CACHE_VERSION
+    uint32_t num_plans;
+    struct {
+        uint32_t size;         // FFT size
+        uint32_t reserved;
+        uint64_t offset;       // where in the file its tables start
+    } plans[MAX_CACHED_FFT_PLANS];
+} FftPlanCacheHeader;
+
+
+// state for uniformly partitioned overlap-save convolution (see createUniformConvolver())
+typedef struct {
+    int      block_size;      // B: samples consumed and produced per processUniformBlock() call
+    int      num_partitions;  // K: number of B-sample pieces h[] was split into
+    int      num_bins;        // B + 1 bins per spectrum (FFT size is 2B)
+    FftPlan* plan;
+    Complex* partitions;      // K spectra, one per piece of h[]: partition k starts at partitions[k * num_bins]
+    bool     owns_partitions; // false if they belong to someone else (e.g. a memory-mapped spectrum file)
+    Complex* delay_line;      // frequency-domain delay line: spectra of the last K input blocks (circular)
+    int      newest;          // which delay_line slot holds the most recent input block's spectrum
+    float*   input_window;    // the previous and the current input block (2B samples)
+    float*   time_scratch;    // 2B samples
+    Complex* accumulator;     // num_bins
+} UniformConvolver;
+
+
+/*
+    One segment of a non-uniformly partitioned convolver: a run of equal-size partitions of h[], starting
+    offset samples into it, handled by its own UniformConvolver on its own worker thread (see
+    createNonUniformConvolver() for the timing rules this relies on).
+*/
+typedef struct {
+    UniformConvolver* convolver;
+    int       offset;            // where in h[] this segment's partitions start; also its output delay
+    int       block_size;        // S: this segment's partition size
+    int       num_slots;         // number of S-sample result blocks kept
+    float*    inputs[2];         // input blocks being collected / being worked on, alternately
+    int       input_fill;        // samples collected so far in inputs[submitted % 2]
+    float*    results;           // result block i (of x[] * this segment's slice of h[]) is in slot i % num_slots
+    long      submitted;         // number of input blocks handed to the worker
+    long      completed;         // number of those the worker has finished
+    bool      quit;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;     // signalled whenever submitted, completed or quit changes
+} NonUniformSegment;
+
+
+// state for non-uniformly partitioned convolution (see createNonUniformConvolver())
+typedef struct {
+    int      block_size;         // B: samples consumed and produced per processNonUniformBlock() call
+    UniformConvolver* head;      // segment 0: the first partitions of h[], all of size B, done in the caller's thread
+    int      num_segments;       // number of tail segments
+    NonUniformSegment segments[MAX_NONUNIFORM_SEGMENTS];
+    long     time;               // number of samples processed so far
+} NonUniformConvolver;
+
+
+/*
+    State for zero-latency hybrid convolution (see createHybridConvolver()): the first crossover taps of h[]
+    are done in direct form, the rest by a NonUniformConvolver whose block size is crossover.
+*/
+typedef struct {
+    int      crossover;          // K: taps done in direct form (also the tail's block size)
+    float*   head_reversed;      // h[0 .. K), reversed, for the direct-form kernel
+    DirectKernel kernel;
+    float*   history;            // the last K-1 input samples, followed by room for up to K new ones
+    NonUniformConvolver* tail;   // convolves with h[K ..], or NULL if h[] is no longer than K
+    float*   tail_in;            // input samples collected for the tail's next block
+    float*   tail_out;           // the tail's output for the block in progress
+    int      fill;               // position within the current block of K samples
+} HybridConvolver;
+
+
+/*
+    State for convolving all the channels of a ChannelRouting together, a block at a time (see
+    createChannelConvolver()). With the upols engine, each input channel has one delay line of spectra that
+    all the paths from it share, and each impulse response channel's partition spectra are computed once;
+    with the other block-streaming engines, each path has a convolver of its own.
+*/
+typedef struct {
+    ChannelRouting routing;
+    EngineType engine;
+    int        block_size;
+    UniformConvolver* inputs[MAX_CHANNELS];    // upols: one per input channel, for its delay line
+    Complex*   impulses[MAX_CHANNELS];         // upols: partition spectra of each impulse response channel
+    bool       owns_impulses;                  // false if they were given to createChannelConvolver()
+    Complex*   accumulator;                    // upols: num_bins
+    float*     time_scratch;                   // upols: 2 * block_size
+    void*      paths[MAX_CHANNELS];            // other engines: each path's convolver (see createStreamingConvolver())
+    float*     path_out;                       // other engines: block_size
+} ChannelConvolver;
+
+
+// a lock-free queue of samples between one producer thread and one consumer thread (see writeSampleRing())
+typedef struct {
+    float*      samples;
+    int         capacity;          // a power of 2
+    atomic_long written;           // samples written so far (only changed by the producer)
+    atomic_long read;              // samples read so far (only changed by the consumer)
+} SampleRing;
+
+
+/*
+    State for real-time convolution, for use in an audio callback (see createRealtimeConvolver()). The head
+    of h[] is done in the callback; the tail, in big partitions, on a thread of its own, which the callback
+    only talks to through the two rings.
+*/
+typedef struct {
+    int        block_size;         // B: the head's partition size (frames per call must be a multiple of it)
+    int        tail_block_size;    // S: the tail's partition size; the tail starts 2S samples into h[]
+    UniformConvolver* head;        // h[0 .. 2S), in the callback
+    UniformConvolver* tail;        // h[2S ..], on the tail thread, or NULL if h[] is no longer than 2S
+    SampleRing to_tail;            // input samples, from the callback to the tail thread
+    SampleRing from_tail;          // the tail's output, from the tail thread to the callback
+    float*     head_in;            // B: the callback's (see processRealtime())
+    float*     tail_block;         // B
+    float*     silence;            // B zeros, to give the tail in place of input it had no room for
+    float*     tail_in;            // S: the tail thread's
+    float*     tail_out;           // S
+    long       tail_owed;          // tail output samples the callback went without, to be skipped when they come
+    long       input_owed;         // input samples the tail had no room for, to be given it as silence
+    atomic_long late_samples;      // tail output samples that weren't ready when needed, since the last reset
+    atomic_long dropped_samples;   // input samples the tail thread had no room for (since the last reset)
+    sem_t      tail_wake;          // posted by the callback while there's a block of S input samples waiting
+    atomic_bool quit;
+    pthread_t  tail_thread;
+} RealtimeConvolver;
+
+
+/*
+    A RealtimeConvolver whose impulse response can be changed while it's running, without a break in the
+    sound (see createHotSwapConvolver()). The callback only ever uses current and fading, and picks up new
+    convolvers from incoming and hands back old ones through retired, both atomic pointers; everything else
+    (loading, transforming, freeing) is done by the swap thread.
+*/
+typedef struct {
+    int        block_size;         // B, as for the RealtimeConvolvers
+    int        tail_block_size;    // S
+    int        crossfade;          // F: samples each swap is crossfaded over
+    float*     fade_gains;         // F: the new convolver's gain over the crossfade (the old one's is the same, backwards)
+    RealtimeConvolver* current;    // the convolver in use (being faded in, during a crossfade)
+    RealtimeConvolver* fading;     // the one being faded out, or NULL
+    int        faded;              // samples of the crossfade done so far
+    float*     block_in;           // B: a copy of the input block, for feeding both during a crossfade
+    float*     fade_out;           // B: the old convolver's output
+    _Atomic(RealtimeConvolver*) incoming;  // loaded by the swap thread, not yet picked up by the callback
+    _Atomic(RealtimeConvolver*) retired;   // finished with by the callback, not yet destroyed by the swap thread
+    atomic_long swaps;             // number of swaps the callback has started
+    float*     request;            // a copy of the impulse response to load next, or NULL (swap thread's side)
+    int        request_length;
+    bool       quit;
+    pthread_mutex_t lock;          // held while using request and quit (never by the callback)
+    pthread_cond_t  changed;       // signalled when they change
+    pthread_t  swap_thread;
+} HotSwapConvolver;
+
+
+/*
+    Everything the threads working on one convolution share (see runInParallel()). y[] is split into work
+    items of item_size outputs each, and each thread gets a contiguous run of them to fill in. Only the
+    fields the engine in question uses are filled in.
+*/
+typedef struct {
+    float*       x;  int N;  float* h;  int M;  float* y;  int P;
+    int          item_size;          // outputs per work item
+    Progress     progress;
+    DirectKernel kernel;             // simd and blocked engines: kernel, padded x[], reversed h[], taps per tile
+    float*       xp;
+    float*       hr;
+    int          tap_tile_size;
+    const void*  typed_xp;           // direct engine: padded x[], reversed h[] and y[] in its sample type
+    const void*  typed_hr;           // (see DEFINE_TYPED_CONVOLUTION())
+    void*        typed_y;
+    FftPlan*     plan;               // fft engine: plan and h[]'s spectrum (L = item_size)
+    Complex*     H;                  // (upols engine: h[]'s partition spectra if precomputed, or NULL)
+    EngineType   streaming_engine;   // upols, nonuniform and hybrid engines: which block-streaming convolver to use
+    ChannelRouting* routing;         // multichannel: how x_channels[] and h_channels[] make y_channels[] (see convolveChannels())
+    float**      x_channels;
+    float**      h_channels;
+    float**      y_channels;
+} ConvolutionJob;
+
+
+// does work items [first, last) of a ConvolutionJob
+typedef void (*RangeWorker)(ConvolutionJob*, int, int);
+
+
+// what each thread runInParallel() uses is given
+typedef struct {
+    ConvolutionJob* job;
+    RangeWorker     worker;
+    int             first_item;
+    int             last_item;
+    int*            unfinished;      // threads of the run still working (under workerPoolLock)
+    pthread_cond_t* finished;        // signalled when that gets to 0
+} RangeWorkerArgs;
+
+
+// a thread of the worker pool (see runInParallel()), kept waiting between runs for its next range of work items
+typedef struct PoolThread {
+    pthread_t          id;
+    pthread_cond_t     wake;         // signalled when it's given work, or the pool is stopping
+    RangeWorkerArgs*   work;         // NULL while idle
+    struct PoolThread* next_idle;    // the idle list
+    struct PoolThread* next;         // the list of all the pool's threads
+    bool               left_busy;    // still working when the pool was stopped, so it frees itself when done
+} PoolThread;
+
+
+/*
+    Defines a direct-form convolution engine for samples stored as Sample and products summed as
+    Accumulator, the way a C++ template on the two types would be instantiated:
+
+        void name(const Sample x[], int N, const Sample h[], int M, Sample y[], int P, int numThreads)
+
+    It works like convolveDirectSIMD(): the output side algorithm on a padded x[] and reversed h[], with
+    the threads splitting up y[]. Each output is summed in an Accumulator, in the same order as convolve()
+    adds its products, and turned back into a Sample by store(), a macro or function given the sum. The
+    kernel sums TYPED_KERNEL_WIDTH outputs at a time in an array of accumulators, which the compiler can
+    keep in vector registers; as the types are fixed at compile time, there is nothing to decide while it
+    runs. The float/float instance gives exactly the same y[] as convolve().
+
+    Also defines nameKernel() and nameWorker(), which it uses. See convolveDirectTyped() for the instances.
+*/
+#define DEFINE_TYPED_CONVOLUTION(name, Sample, Accumulator, store)                                          \
+void name##Kernel(const Sample* xp, const Sample* hr, int M, Sample* y, int count)                          \
+{                                                                                                           \
+    int p = 0;                                                                                              \
+    for (; p + TYPED_KERNEL_WIDTH <= count; p += TYPED_KERNEL_WIDTH) {                                      \
+        Accumulator sums[TYPED_KERNEL_WIDTH] = { 0 };                                                       \
+        for (int k = 0; k < M; k++) {                                                                       \
+            Accumulator tap = hr[k];                                                                        \
+            for (int j = 0; j < TYPED_KERNEL_WIDTH; j++)                                                    \
+                sums[j] += tap * (Accumulator)xp[p + k + j];                                                \
+        }                                                                                                   \
+        for (int j = 0; j < TYPED_KERNEL_WIDTH; j++)                                                        \
+            y[p + j] = store(sums[j]);                                                                      \
+    }                                                                                                       \
+    for (; p < count; p++) {                                                                                \
+        Accumulator sum = 0;                                                                                \
+        for (int k = 0; k < M; k++)                                                                         \
+            sum += (Accumulator)hr[k] * (Accumulator)xp[p + k];                                             \
+        y[p] = store(sum);                                                                                  \
+    }                                                                                                       \
+}                                                                                                           \
+                                                                                                            \
+void name##Worker(ConvolutionJob* job, int firstItem, int lastItem)                                         \
+{                                                                                                           \
+    const Sample* xp = (const Sample*)job->typed_xp;                                                        \
+    const Sample* hr = (const Sample*)job->typed_hr;                                                        \
+    Sample* y = (Sample*)job->typed_y;                                                                      \
+    for (int item = firstItem; item < lastItem; item++) {                                                   \
+        int start, end, first, last;                                                                        \
+        outputsOfItem(job, item, &start, &end);                                                             \
+        tapsReachingInput(start, end - start, job->N, job->M, &first, &last);                               \
+        if (first >= last)                                                                                  \
+            memset(y + start, 0, (end - start) * sizeof(Sample));                                           \
+        else                                                                                                \
+            name##Kernel(xp + start + first, hr + first, last - first, y + start, end - start);             \
+        advanceProgress(&job->progress, 1);                                                                 \
+    }                                                                                                       \
+}                                                                                                           \
+                                                                                                            \
+void name(const Sample x[], int N, const Sample h[], int M, Sample y[], int P, int numThreads)              \
+{                                                                                                           \
+    Sample* xp = (Sample*)calloc(N + 2 * (M - 1), sizeof(Sample));                                          \
+    Sample* hr = (Sample*)malloc(M * sizeof(Sample));                                                       \
+    memcpy(xp + M - 1, x, N * sizeof(Sample));                                                              \
+    for (int m = 0; m < M; m++)                                                                             \
+        hr[m] = h[M - 1 - m];                                                                               \
+                                                                                                            \
+    ConvolutionJob job = { .N = N, .M = M, .P = P, .item_size = 4096,                                       \
+                           .typed_xp = xp, .typed_hr = hr, .typed_y = y };                                  \
+    runInParallel(&job, name##Worker, numThreads);                                                          \
+                                                                                                            \
+    free(xp); free(hr);                                                                                     \
+}
+
+
+// ----- FUNCTION PROTOTYPES --------------------------------------------------
+ bool isStreamingEngine(EngineType);
+ void interleaveChannels(float*[], int, int, float[]);
+ bool planChannelRouting(int, int, ChannelRouting*);
+ bool channelsCanBeRouted(int, int);
+RealtimeConvolver* createRealtimeConvolver(float[], int, int, int);
+ bool processRealtime(RealtimeConvolver*, const float[], float[], int);
+ void resetRealtimeConvolver(RealtimeConvolver*);
+ void clearRealtimeState(RealtimeConvolver*);
+ void destroyRealtimeConvolver(RealtimeConvolver*);
+void* realtimeTailThread(void*);
+ void startRealtimeTail(RealtimeConvolver*);
+ void stopRealtimeTail(RealtimeConvolver*);
+ void initSampleRing(SampleRing*, int);
+ void clearSampleRing(SampleRing*);
+ long sampleRingAvailable(SampleRing*);
+ long sampleRingSpace(SampleRing*);
+ void writeSampleRing(SampleRing*, const float[], int);
+ void readSampleRing(SampleRing*, float[], int);
+HotSwapConvolver* createHotSwapConvolver(float[], int, int, int, int);
+ bool processHotSwap(HotSwapConvolver*, const float[], float[], int);
+ void swapImpulseResponse(HotSwapConvolver*, float[], int);
+ void destroyHotSwapConvolver(HotSwapConvolver*);
+void* hotSwapThread(void*);
+ void convolve(float[], int, float[], int, float[], int);
+ void convolveFFT(float[], int, float[], int, float[], int, int, int);
+ void overlapAddWorker(ConvolutionJob*, int, int);
+ void streamingWorker(ConvolutionJob*, int, int);
+void* createStreamingConvolver(EngineType, float[], int, int, Complex[]);
+ void processStreamingBlock(EngineType, void*, float[], float[], int);
+ void destroyStreamingConvolver(EngineType, void*);
+ void outputSideWorker(ConvolutionJob*, int, int);
+ void runInParallel(ConvolutionJob*, RangeWorker, int);
+void* poolThread(void*);
+void stopWorkerPool(void);
+ void outputsOfItem(ConvolutionJob*, int, int*, int*);
+  int numberOfCPUs(void);
+ void runConvolutionEngine(Options*, float[], int, float[], int, float[], int);
+ void startProgress(Progress*, int);
+ void advanceProgress(Progress*, int);
+ void finishProgress(Progress*);
+ void showMessage(const char*, ...);
+  int nextPowerOf2(int);
+FftPlan* createFftPlan(int);
+FftPlan* buildFftPlan(int);
+FftPlan* findCachedFftPlan(int);
+ void addToFftPlanCache(FftPlan*);
+FftPlan* keepFftPlan(FftPlan*);
+FftPlan* sharedFftPlan(FftPlan*);
+  int openLockedFftPlanCache(void);
+ void startFftPlanCache(FftPlan*);
+ bool writeFftPlanTables(int, FftPlan*, uint64_t);
+ void fftPlanTableLayout(int, size_t*, size_t*, size_t*);
+char* homeDirectoryFile(const char*);
+ void destroyFftPlan(FftPlan*);
+ void forwardRealFFT(FftPlan*, float[], Complex[]);
+ void inverseRealFFT(FftPlan*, Complex[], float[]);
+ void complexFFTButterflies(FftPlan*, Complex[], bool);
+ void multiplySpectra(Complex[], Complex[], Complex[], int);
+ void multiplyAccumulateSpectra(Complex[], Complex[], Complex[], int);
+ void convolveUniformPartitioned(float[], int, float[], int, float[], int, int, Complex[], int);
+UniformConvolver* createUniformConvolver(float[], int, int);
+UniformConvolver* createUniformConvolverFromSpectra(Complex[], int, int);
+ void destroyUniformConvolver(UniformConvolver*);
+ void resetUniformConvolver(UniformConvolver*);
+ void processUniformBlock(UniformConvolver*, float[], float[]);
+ void addUniformInput(UniformConvolver*, float[]);
+ void accumulateUniformOutput(UniformConvolver*, Complex[], Complex[]);
+Complex* createPartitionSpectra(float[], int, int, FftPlan*);
+Complex* createChannelPartitionSpectra(float*[], int, int, int);
+ void convolveNonUniformPartitioned(float[], int, float[], int, float[], int, int, int);
+NonUniformConvolver* createNonUniformConvolver(float[], int, int);
+ void destroyNonUniformConvolver(NonUniformConvolver*);
+ void processNonUniformBlock(NonUniformConvolver*, float[], float[]);
+void* nonUniformSegmentWorker(void*);
+  int planNonUniformSegments(int, int, SegmentLayout[]);
+Options planConvolution(Options*, int, int);
+ void considerEngine(Options[], double[], Options*, EngineType, double, int, int, int, int);
+double fftCost(MachineCosts*, int);
+double uniformBlockCost(MachineCosts*, int, int);
+double nonUniformCostPerSample(MachineCosts*, int, int);
+ void measureMachineCosts(MachineCosts*);
+ bool loadWisdom(char*, MachineCosts*);
+ void saveWisdom(char*, MachineCosts*);
+const char* engineName(EngineType);
+ void convolveHybrid(float[], int, float[], int, float[], int, int, int);
+HybridConvolver* createHybridConvolver(float[], int, int);
+ void destroyHybridConvolver(HybridConvolver*);
+ void processHybrid(HybridConvolver*, float[], float[], int);
+  int chooseHybridCrossover(float[], int);
+ void convolveChannels(Options*, float*[], int, float*[], int, ChannelRouting*, float*[], int);
+ void channelStreamingWorker(ConvolutionJob*, int, int);
+ChannelConvolver* createChannelConvolver(EngineType, float*[], int, ChannelRouting*, int, Complex[]);
+ void destroyChannelConvolver(ChannelConvolver*);
+ void processChannelBlock(ChannelConvolver*, float*[], float*[]);
+double secondsNow(void);
+ void convolveDirectTyped(Precision, float[], int, float[], int, float[], int, int);
+ void convolveTypedFloat(const float[], int, const float[], int, float[], int, int);
+ void convolveTypedFloatDouble(const float[], int, const float[], int, float[], int, int);
+ void convolveTypedDouble(const double[], int, const double[], int, double[], int, int);
+ void convolveTypedInt16(const int16_t[], int, const int16_t[], int, int16_t[], int, int);
+int16_t saturateToInt16(long);
+ void convolveDirectSIMD(float[], int, float[], int, float[], int, IsaLevel, int);
+ void convolveOutputSideBlocked(float[], int, float[], int, float[], int, IsaLevel, int);
+DirectKernel chooseDirectKernel(IsaLevel, int);
+float* createPaddedInput(float[], int, int);
+float* createReversedImpulse(float[], int);
+ void tapsReachingInput(int, int, int, int, int*, int*);
+IsaLevel detectIsaLevel(void);
+const char* isaName(IsaLevel);
+DirectKernel directKernelFor(IsaLevel);
+DirectKernel directKernelForLength(IsaLevel, int);
+ void directKernelScalar(const float*, const float*, int, float*, int);
+ void directKernelSSE(const float*, const float*, int, float*, int);
+ void directKernelAVX2(const float*, const float*, int, float*, int);
+ void directKernelAVX512(const float*, const float*, int, float*, int);
+ void directKernelAVX512Taps64(const float*, const float*, int, float*, int);
+ void directKernelAVX512Taps128(const float*, const float*, int, float*, int);
+ void directKernelAVX512Taps256(const float*, const float*, int, float*, int);
+ void directKernelAVX512Taps512(const float*, const float*, int, float*, int);
+// ----------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,3180 @@
+/*
+    The convolution engines, as a library (libconvolve): the engines the command line program convolve.c
+    runs, and the interface other programs use them through (see libconvolve.h). Everything below the
+    LIBRARY INTERFACE section is shared with convolve.c by way of engine.h.
+
+    Build:          make (see the Makefile), which gives libconvolve.a and libconvolve.so as well as the
+                    program, or gcc -O2 -pthread -o convolve convolve.c libconvolve.c -lm for just the program.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <semaphore.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "libconvolve.h"
+#include "engine.h"
+
+
+int SHOW_DEBUG_OUTPUT = 0;  // show debug/regression test data?  1 for yes, 0 for no
+int SHOW_PROGRESS     = 0;  //  show progress while convolving?  1 for yes, 0 for no
+                            // (off for programs using the library; the command line program turns them on)
+FILE* messageOutput   = NULL;  // where the library's messages go (see showMessage()): nowhere unless the program says
+
+
+// the process-wide FFT plan cache (see findCachedFftPlan())
+char*           fftPlanCacheFile = NULL;      // NULL = no cache
+pthread_mutex_t fftPlanCacheLock = PTHREAD_MUTEX_INITIALIZER;
+bool            fftPlanCacheOpened = false;
+void*           fftPlanCacheMap = NULL;       // the whole file, mapped read-only
+size_t          fftPlanCacheMapLength = 0;
+FftPlan*        fftPlansKept[32] = { NULL };  // by log2 of the size: plans already found or built (see createFftPlan())
+
+// the worker pool's threads (see runInParallel())
+pthread_mutex_t workerPoolLock = PTHREAD_MUTEX_INITIALIZER;
+PoolThread*     idlePoolThreads = NULL;       // those waiting for work
+PoolThread*     poolThreads = NULL;           // all of them
+bool            workerPoolStopping = false;   // set by stopWorkerPool()
+
+
+/*
+    An engine handle of the library interface (see convolve_create()): its settings, its copy of the impulse
+    response and what has been worked out from it, and the stream it's convolving, if any.
+*/
+struct convolve_engine {
+    Options  settings;               // as the command line would give them (see convolve_set_option())
+    float*   h[MAX_CHANNELS];        // the impulse response, one array per channel
+    int      M;
+    int      num_impulses;           // its channels, 0 = none set yet
+    Complex* partitions[32];         // upols: its partition spectra, indexed by log2 of the block size, or NULL
+    int      crossover;              // hybrid: direct-form taps picked for it by benchmark, 0 = not yet
+    Options  plan;                   // convolve_process_buffer(): the plan for buffers of planned_length samples
+    bool     planned;
+    int      planned_length;
+    Options  stream_plan;            // convolve_process_stream(): the plan ...
+    int      stream_block_size;      //     ... and its block size, 0 = not planned yet
+    ChannelRouting stream_routing;
+    ChannelConvolver* stream;        // NULL = no stream under way
+    float*   stream_in[MAX_CHANNELS];   // input collected for the next block
+    float*   stream_out[MAX_CHANNELS];  // output of the last block, handed out as the next block's input comes in
+    int      stream_fill;            // samples of each block so far
+};
+
+
+// a real-time convolver of the library interface (see convolve_realtime_create())
+struct convolve_realtime {
+    HotSwapConvolver* convolver;
+};
+
+
+// ----- FUNCTION PROTOTYPES --------------------------------------------------
+Options planEngineRun(convolve_engine*, Options*, int);
+ void endStream(convolve_engine*);
+ void forgetPlans(convolve_engine*);
+ void forgetImpulseResponse(convolve_engine*);
+EngineType engineTypeOfApiEngine(int);
+// ----------------------------------------------------------------------------
+
+
+// ----- LIBRARY INTERFACE ----------------------------------------------------
+convolve_engine* convolve_create(void)
+{
+    convolve_engine* e = (convolve_engine*)calloc(1, sizeof(convolve_engine));
+    if (!e)
+        return NULL;
+
+    // the same defaults as the command line program (see processCommandLineArgs())
+    e->settings.engine = ENGINE_AUTO;
+    e->settings.fft_size = 0;
+    e->settings.block_size = 2048;
+    e->settings.crossover = 0;
+    e->settings.isa = ISA_AUTO;
+    e->settings.threads = 1;
+    e->settings.max_latency = -1;
+    e->settings.wisdom_file = homeDirectoryFile(".convolve_wisdom");
+    e->settings.normalize = NORMALIZE_NONE;
+    e->settings.precision = PRECISION_FLOAT;
+    return e;
+}
+
+
+void convolve_free(convolve_engine* e)
+{
+    if (!e)
+        return;
+    forgetImpulseResponse(e);
+    free(e->settings.wisdom_file);
+    free(e);
+}
+
+
+int convolve_set_option(convolve_engine* e, convolve_option option, int value)
+{
+    if (!e)
+        return CONVOLVE_ERROR_ARGUMENT;
+
+    // checked as processCommandLineArgs() checks the options of the same names
+    Options* s = &e->settings;
+    switch (option) {
+        case CONVOLVE_OPTION_ENGINE:
+            if (value < CONVOLVE_ENGINE_AUTO || value > CONVOLVE_ENGINE_HYBRID)
+                return CONVOLVE_ERROR_ARGUMENT;
+            s->engine = engineTypeOfApiEngine(value);
+            break;
+        case CONVOLVE_OPTION_THREADS:
+            if (value < 0)
+                return CONVOLVE_ERROR_ARGUMENT;
+            s->threads = (value == 0) ? numberOfCPUs() : value;
+            break;
+        case CONVOLVE_OPTION_BLOCK_SIZE:
+            if (value < 8 || value > MAX_BLOCK_SIZE || nextPowerOf2(value) != value)
+                return CONVOLVE_ERROR_ARGUMENT;
+            s->block_size = value;
+            break;
+        case CONVOLVE_OPTION_FFT_SIZE:
+            if (value != 0 && (value < 16 || value > MAX_BLOCK_SIZE || nextPowerOf2(value) != value))
+                return CONVOLVE_ERROR_ARGUMENT;
+            s->fft_size = value;
+            break;
+        case CONVOLVE_OPTION_CROSSOVER:
+            if (value != 0 && (value < 8 || value > MAX_BLOCK_SIZE || nextPowerOf2(value) != value))
+                return CONVOLVE_ERROR_ARGUMENT;
+            s->crossover = value;
+            break;
+        case CONVOLVE_OPTION_MAX_LATENCY:
+            s->max_latency = (value < 0) ? -1 : value;
+            break;
+        case CONVOLVE_OPTION_ISA:
+            if (value < CONVOLVE_ISA_AUTO || value > CONVOLVE_ISA_AVX512)
+                return CONVOLVE_ERROR_ARGUMENT;
+            s->isa = (value == CONVOLVE_ISA_AUTO) ? ISA_AUTO : (IsaLevel)(value - CONVOLVE_ISA_SCALAR + ISA_SCALAR);
+            break;
+        default:
+            return CONVOLVE_ERROR_ARGUMENT;
+    }
+    forgetPlans(e);
+    return CONVOLVE_OK;
+}
+
+
+int convolve_set_wisdom_file(convolve_engine* e, const char* path)
+{
+    if (!e)
+        return CONVOLVE_ERROR_ARGUMENT;
+    free(e->settings.wisdom_file);
+    e->settings.wisdom_file = path ? strdup(path) : NULL;
+    forgetPlans(e);
+    return CONVOLVE_OK;
+}
+
+
+int convolve_set_plan_cache(const char* path)
+{
+    pthread_mutex_lock(&fftPlanCacheLock);
+    bool opened = fftPlanCacheOpened;
+    if (!opened)
+        fftPlanCacheFile = path ? strdup(path) : NULL;  // (kept for as long as the process runs)
+    pthread_mutex_unlock(&fftPlanCacheLock);
+    return opened ? CONVOLVE_ERROR_ARGUMENT : CONVOLVE_OK;
+}
+
+
+int convolve_set_ir(convolve_engine* e, const float* const h[], int channels, int length)
+{
+    if (!e || !h || channels < 1 || channels > MAX_CHANNELS || length < 1)
+        return CONVOLVE_ERROR_ARGUMENT;
+    for (int c = 0; c < channels; c++)
+        if (!h[c])
+            return CONVOLVE_ERROR_ARGUMENT;
+
+    forgetImpulseResponse(e);
+    for (int c = 0; c < channels; c++) {
+        e->h[c] = (float*)malloc((size_t)length * sizeof(float));
+        memcpy(e->h[c], h[c], (size_t)length * sizeof(float));
+    }
+    e->M = length;
+    e->num_impulses = channels;
+    return CONVOLVE_OK;
+}
+
+
+int convolve_output_channels(convolve_engine* e, int inputChannels)
+{
+    if (!e || inputChannels < 1 || inputChannels > MAX_CHANNELS)
+        return CONVOLVE_ERROR_ARGUMENT;
+    if (e->num_impulses == 0)
+        return CONVOLVE_ERROR_NO_IR;
+    ChannelRouting routing;
+    if (!planChannelRouting(inputChannels, e->num_impulses, &routing))
+        return CONVOLVE_ERROR_CHANNELS;
+    return routing.num_outputs;
+}
+
+
+int convolve_process_buffer(convolve_engine* e, const float* const x[], int channels, int length, float* const y[])
+{
+    int numOutputs = convolve_output_channels(e, channels);
+    if (numOutputs < 0)
+        return numOutputs;
+    if (!x || !y || length < 1)
+        return CONVOLVE_ERROR_ARGUMENT;
+
+    if (!e->planned || e->planned_length != length) {
+        e->plan = planEngineRun(e, &e->settings, length);
+        e->planned = true;
+        e->planned_length = length;
+    }
+    ChannelRouting routing;
+    planChannelRouting(channels, e->num_impulses, &routing);  // (can't fail: convolve_output_channels() checked)
+    convolveChannels(&e->plan, (float**)x, length, e->h, e->M, &routing, (float**)y, length + e->M - 1);
+    return CONVOLVE_OK;
+}
+
+
+/*
+    The stream is convolved a block at a time by a ChannelConvolver, which has no latency of its own. The
+    input is collected until there's a block of it, and each block's output is handed out while the next
+    block's input is coming in: hence the latency of one block, whatever the number of frames per call.
+*/
+int convolve_process_stream(convolve_engine* e, const float* const x[], int channels, float* const y[], int frames)
+{
+    int numOutputs = convolve_output_channels(e, channels);
+    if (numOutputs < 0)
+        return numOutputs;
+    if (!x || !y || frames < 0)
+        return CONVOLVE_ERROR_ARGUMENT;
+    int B = convolve_stream_latency(e);
+    if (B < 0)
+        return B;
+
+    if (!e->stream) {
+        planChannelRouting(channels, e->num_impulses, &e->stream_routing);
+        e->stream = createChannelConvolver(e->stream_plan.engine, e->h, e->M, &e->stream_routing, B, e->stream_plan.partitions);
+        for (int c = 0; c < channels; c++)
+            e->stream_in[c] = (float*)calloc(B, sizeof(float));
+        for (int c = 0; c < numOutputs; c++)
+            e->stream_out[c] = (float*)calloc(B, sizeof(float));
+        e->stream_fill = 0;
+    }
+    else if (channels != e->stream_routing.num_inputs)
+        return CONVOLVE_ERROR_CHANNELS;
+
+    for (int done = 0; done < frames; ) {
+        int n = (frames - done < B - e->stream_fill) ? frames - done : B - e->stream_fill;
+        for (int c = 0; c < channels; c++)
+            memcpy(e->stream_in[c] + e->stream_fill, x[c] + done, n * sizeof(float));
+        for (int c = 0; c < numOutputs; c++)
+            memcpy(y[c] + done, e->stream_out[c] + e->stream_fill, n * sizeof(float));
+        e->stream_fill += n;
+        done += n;
+        if (e->stream_fill == B) {
+            processChannelBlock(e->stream, e->stream_in, e->stream_out);
+            e->stream_fill = 0;
+        }
+    }
+    return CONVOLVE_OK;
+}
+
+
+int convolve_stream_latency(convolve_engine* e)
+{
+    if (!e)
+        return CONVOLVE_ERROR_ARGUMENT;
+    if (e->num_impulses == 0)
+        return CONVOLVE_ERROR_NO_IR;
+    if (e->settings.engine != ENGINE_AUTO && !isStreamingEngine(e->settings.engine))
+        return CONVOLVE_ERROR_ENGINE;
+
+    if (e->stream_block_size == 0) {
+        // planned as for --stream, for a nominal ten seconds or so of input: the block engines' costs per
+        // sample hardly depend on its length
+        Options requested = e->settings;
+        requested.stream = true;
+        e->stream_plan = planEngineRun(e, &requested, 1 << 19);
+        e->stream_block_size = (e->stream_plan.engine == ENGINE_HYBRID) ? e->stream_plan.crossover : e->stream_plan.block_size;
+    }
+    return e->stream_block_size;
+}
+
+
+int convolve_reset(convolve_engine* e)
+{
+    if (!e)
+        return CONVOLVE_ERROR_ARGUMENT;
+    endStream(e);
+    return CONVOLVE_OK;
+}
+
+
+convolve_realtime* convolve_realtime_create(const float* h, int length, int block_size, int tail_block_size, int crossfade)
+{
+    if (!h || length < 1 || block_size > MAX_BLOCK_SIZE || tail_block_size < 1 || tail_block_size > MAX_BLOCK_SIZE ||
+        crossfade < 0)
+        return NULL;
+    HotSwapConvolver* convolver = createHotSwapConvolver((float*)h, length, block_size, tail_block_size, crossfade);
+    if (!convolver)  // (block_size isn't a power of 2)
+        return NULL;
+    convolve_realtime* rt = (convolve_realtime*)malloc(sizeof(convolve_realtime));
+    rt->convolver = convolver;
+    return rt;
+}
+
+
+int convolve_realtime_process(convolve_realtime* rt, const float* in, float* out, int frames)
+{
+    if (!rt || !in || !out || frames < 0)
+        return CONVOLVE_ERROR_ARGUMENT;
+    return processHotSwap(rt->convolver, in, out, frames) ? CONVOLVE_OK : CONVOLVE_ERROR_ARGUMENT;
+}
+
+
+int convolve_realtime_swap_ir(convolve_realtime* rt, const float* h, int length)
+{
+    if (!rt || !h || length < 1)
+        return CONVOLVE_ERROR_ARGUMENT;
+    swapImpulseResponse(rt->convolver, (float*)h, length);
+    return CONVOLVE_OK;
+}
+
+
+void convolve_realtime_free(convolve_realtime* rt)
+{
+    if (!rt)
+        return;
+    destroyHotSwapConvolver(rt->convolver);
+    free(rt);
+}
+
+
+const char* convolve_error_string(int error)
+{
+    switch (error) {
+        case CONVOLVE_OK:              return "no error";
+        case CONVOLVE_ERROR_ARGUMENT:  return "invalid argument";
+        case CONVOLVE_ERROR_NO_IR:     return "no impulse response has been set";
+        case CONVOLVE_ERROR_CHANNELS:  return "the input's channels can't be convolved with the impulse response's";
+        case CONVOLVE_ERROR_ENGINE:    return "the engine can't do that (only upols, nonuniform and hybrid can stream)";
+        default:                       return "unknown error";
+    }
+}
+
+
+int convolve_version(void)
+{
+    return CONVOLVE_API_VERSION;
+}
+
+
+/*
+    Plans a run of the engine on N samples of input with the requested settings (see planConvolution()),
+    and fills in what the plan needs that can be kept from one run to the next: the partition spectra of
+    the impulse response for the upols engine, and the hybrid engine's crossover. They are worked out the
+    first time they're needed and kept until the impulse response changes.
+*/
+Options planEngineRun(convolve_engine* e, Options* requested, int N)
+{
+    Options plan = planConvolution(requested, N, e->M);
+
+    if (plan.engine == ENGINE_UPOLS) {
+        int log2B = 0;
+        while ((1 << log2B) < plan.block_size)
+            log2B++;
+        if (!e->partitions[log2B])
+            e->partitions[log2B] = createChannelPartitionSpectra(e->h, e->num_impulses, e->M, plan.block_size);
+        plan.partitions = e->partitions[log2B];
+    }
+    if (plan.engine == ENGINE_HYBRID && plan.crossover == 0) {
+        if (e->crossover == 0)
+            e->crossover = chooseHybridCrossover(e->h[0], e->M);
+        plan.crossover = e->crossover;
+    }
+    return plan;
+}
+
+
+// Ends the stream being convolved, if there is one (see convolve_process_stream())
+void endStream(convolve_engine* e)
+{
+    if (!e->stream)
+        return;
+    destroyChannelConvolver(e->stream);
+    e->stream = NULL;
+    for (int c = 0; c < e->stream_routing.num_inputs; c++)
+        free(e->stream_in[c]);
+    for (int c = 0; c < e->stream_routing.num_outputs; c++)
+        free(e->stream_out[c]);
+}
+
+
+// Forgets the plans made with the settings, when they change, along with the stream
+void forgetPlans(convolve_engine* e)
+{
+    endStream(e);
+    e->planned = false;
+    e->stream_block_size = 0;
+}
+
+
+// Forgets the impulse response and everything worked out from it
+void forgetImpulseResponse(convolve_engine* e)
+{
+    forgetPlans(e);
+    for (int c = 0; c < e->num_impulses; c++)
+        free(e->h[c]);
+    e->num_impulses = 0;
+    for (int i = 0; i < 32; i++) {
+        free(e->partitions[i]);
+        e->partitions[i] = NULL;
+    }
+    e->crossover = 0;
+}
+
+
+// The engine a CONVOLVE_ENGINE value of the library interface stands for
+EngineType engineTypeOfApiEngine(int engine)
+{
+    switch (engine) {
+        case CONVOLVE_ENGINE_DIRECT:     return ENGINE_DIRECT;
+        case CONVOLVE_ENGINE_SIMD:       return ENGINE_SIMD;
+        case CONVOLVE_ENGINE_BLOCKED:    return ENGINE_BLOCKED;
+        case CONVOLVE_ENGINE_FFT:        return ENGINE_FFT;
+        case CONVOLVE_ENGINE_UPOLS:      return ENGINE_UPOLS;
+        case CONVOLVE_ENGINE_NONUNIFORM: return ENGINE_NONUNIFORM;
+        case CONVOLVE_ENGINE_HYBRID:     return ENGINE_HYBRID;
+        case CONVOLVE_ENGINE_AUTO:
+        default:                         return ENGINE_AUTO;
+    }
+}
+
+
+// ----- CONVOLUTION ENGINES --------------------------------------------------
+/*
+    Performs time-domain convolution using the input-side algorithm on input samples x[] and
+    impulse samples h[] to produce the output (convolved) samples y[]
+
+    Parameters: input array x[] (audio file samples) and its size N (ie: the number of samples it contains), 
+                input array h[] (impulse response samples) and its size M, 
+                and output array y[] of size P
+
+    Other: if SHOW_PROGRESS is set to 1, this function will display progress in 10% increments.
+
+    The direct engine runs the float instance of the typed direct-form engine (see convolveDirectTyped()),
+    which gives exactly the same y[] as this; this is kept as the reference the other engines are
+    described against.
+*/
+void convolve (float x[], int N, float h[], int M, float y[], int P)
+{
+    Progress progress;
+
+    // Clear output buffer y[]
+    for (int p = 0; p < P; p++)
+        y[p] = 0.0;
+
+    startProgress(&progress, N);
+
+    for (int n = 0; n < N; n++) {  // loop through audio file samples
+        for (int m = 0; m < M; m++)  // loop through impulse response samples
+            y[n+m] += x[n] * h[m];
+
+        advanceProgress(&progress, 1);  // does not meaningfully affect performance (I measured)
+    }
+    finishProgress(&progress);
+}
+
+
+/*
+    Performs frequency-domain convolution using the overlap-add method. Produces the same y[] as convolve(),
+    just much faster: O(N log M) instead of O(N * M).
+
+    h[] is zero-padded to the FFT size and transformed once. x[] is then cut into blocks of L = fftSize - M + 1
+    samples; each block is zero-padded, transformed, multiplied by h[]'s spectrum and transformed back, giving
+    fftSize samples of (linear, not circular) convolution which get added into y[] starting at the block's offset.
+
+    With more than one thread, each thread owns a range of y[] (a whole number of L-sample stretches) and
+    does the blocks that overlap it, adding in only the part that falls in its range. Blocks that straddle
+    the boundary between two threads get done by both.
+
+    Parameters: same as convolve(), plus the FFT size to use (a power of 2 greater than or equal to M, or 0 to
+                choose one automatically: the power of 2 at or above 2*M, so that blocks are at least M long),
+                and the number of threads to use
+
+    Accuracy:   the result matches convolve() with an SNR of about 115 dB or better (single-precision rounding
+                noise only; run with --verify to measure it for a particular pair of files). That is well below
+                the 16-bit quantization floor (~96 dB), so the output files are (near) identical.
+*/
+void convolveFFT(float x[], int N, float h[], int M, float y[], int P, int fftSize, int numThreads)
+{
+    if (fftSize == 0) {
+        fftSize = nextPowerOf2(2 * M);
+        if (fftSize < 256)  fftSize = 256;
+    }
+    while (fftSize < M + 1)  // need room for at least one input sample per block
+        fftSize *= 2;
+
+    FftPlan* plan = createFftPlan(fftSize);
+    float* block = (float*)calloc(fftSize, sizeof(float));
+    Complex* H = (Complex*)malloc((plan->half + 1) * sizeof(Complex));
+
+    // transform the impulse response once
+    memcpy(block, h, M * sizeof(float));
+    forwardRealFFT(plan, block, H);
+    free(block);
+
+    ConvolutionJob job = { .x = x, .N = N, .h = h, .M = M, .y = y, .P = P,
+                           .item_size = fftSize - M + 1, .plan = plan, .H = H };
+    runInParallel(&job, overlapAddWorker, numThreads);
+
+    free(H);
+    destroyFftPlan(plan);
+}
+
+
+// Work item i is y[i*L .. (i+1)*L), which gets contributions from input blocks i and a few before it
+void overlapAddWorker(ConvolutionJob* job, int firstItem, int lastItem)
+{
+    int fftSize = job->plan->size, L = job->item_size, numBins = job->plan->half + 1;
+    int blocksPerOutput = (fftSize + L - 1) / L;  // number of blocks that reach any one output
+    int numInputBlocks = (job->N + L - 1) / L;
+
+    float*   block    = (float*)malloc(fftSize * sizeof(float));
+    Complex* spectrum = (Complex*)malloc(numBins * sizeof(Complex));
+
+    int rangeStart, rangeEnd, unused;
+    outputsOfItem(job, firstItem, &rangeStart, &unused);
+    outputsOfItem(job, lastItem - 1, &unused, &rangeEnd);
+    for (int p = rangeStart; p < rangeEnd; p++)
+        job->y[p] = 0.0;
+
+    int firstBlock = (firstItem - blocksPerOutput + 1 > 0) ? firstItem - blocksPerOutput + 1 : 0;
+    int endBlock = (lastItem < numInputBlocks) ? lastItem : numInputBlocks;
+
+    for (int b = firstBlock; b < endBlock; b++) {
+        int start = b * L;
+        int len = (job->N - start < L) ? job->N - start : L;
+
+        memcpy(block, job->x + start, len * sizeof(float));
+        memset(block + len, 0, (fftSize - len) * sizeof(float));
+        forwardRealFFT(job->plan, block, spectrum);
+        multiplySpectra(spectrum, job->H, spectrum, numBins);
+        inverseRealFFT(job->plan, spectrum, block);
+
+        int from = (rangeStart > start) ? rangeStart : start;  // overlap-add the part that's in our range
+        int to = (rangeEnd < start + fftSize) ? rangeEnd : start + fftSize;
+        for (int p = from; p < to; p++)
+            job->y[p] += block[p - start];
+
+        if (b >= firstItem)
+            advanceProgress(&job->progress, 1);
+    }
+    int itemsWithoutBlock = lastItem - (endBlock > firstItem ? endBlock : firstItem);
+    if (itemsWithoutBlock > 0)  // stretches of y[] past the end of x[] have no input block of their own
+        advanceProgress(&job->progress, itemsWithoutBlock);
+
+    free(block); free(spectrum);
+}
+
+
+/*
+    Performs uniformly partitioned overlap-save (UPOLS) convolution. Produces the same y[] as convolve() and
+    convolveFFT(), but never needs an FFT bigger than 2 * blockSize, however long h[] is. That keeps the working
+    set in cache for very long impulse responses (e.g. 10+ second cathedral tails) where convolveFFT() would
+    need one enormous FFT.
+
+    Parameters: same as convolve(), plus the partition size (a power of 2), h[]'s partition spectra if they
+                have already been computed for that partition size (e.g. loaded from a spectrum file), or
+                NULL, and the number of threads (see streamingWorker()). Smaller blocks mean more partitions
+                to multiply-accumulate per block; larger blocks mean bigger FFTs.
+*/
+void convolveUniformPartitioned(float x[], int N, float h[], int M, float y[], int P, int blockSize, Complex partitions[], int numThreads)
+{
+    ConvolutionJob job = { .x = x, .N = N, .h = h, .M = M, .y = y, .P = P,
+                           .item_size = blockSize, .H = partitions, .streaming_engine = ENGINE_UPOLS };
+    runInParallel(&job, streamingWorker, numThreads);
+}
+
+
+/*
+    Performs non-uniformly partitioned convolution: produces the same y[] as convolve(), by streaming x[]
+    through a NonUniformConvolver blockSize samples at a time. Only the first few partitions of h[] are the
+    size of a block; the rest grow towards the tail and are computed by background threads (see
+    createNonUniformConvolver()).
+
+    Parameters: same as convolve(), plus the size of the first partitions (a power of 2), which is also the
+                latency the engine would have if it were used live, and the number of threads to split the
+                work across (see streamingWorker(); each one has its own background threads as well)
+*/
+void convolveNonUniformPartitioned(float x[], int N, float h[], int M, float y[], int P, int blockSize, int numThreads)
+{
+    ConvolutionJob job = { .x = x, .N = N, .h = h, .M = M, .y = y, .P = P,
+                           .item_size = blockSize, .streaming_engine = ENGINE_NONUNIFORM };
+    runInParallel(&job, streamingWorker, numThreads);
+}
+
+
+/*
+    Performs zero-latency hybrid convolution: produces the same y[] as convolve(), by streaming x[] through a
+    HybridConvolver (see createHybridConvolver()).
+
+    Parameters: same as convolve(), plus the number of taps to do in direct form (a power of 2, or 0 to have
+                chooseHybridCrossover() pick the fastest by benchmarking this machine) and the number of
+                threads (see streamingWorker())
+*/
+void convolveHybrid(float x[], int N, float h[], int M, float y[], int P, int crossover, int numThreads)
+{
+    if (crossover == 0) {
+        crossover = chooseHybridCrossover(h, M);
+        if (SHOW_DEBUG_OUTPUT)  showMessage("\nHybrid engine crossover (direct-form taps):  %d\n", crossover);
+    }
+    // any number of samples can be processed per call; use chunks of crossover to split up the work
+    ConvolutionJob job = { .x = x, .N = N, .h = h, .M = M, .y = y, .P = P,
+                           .item_size = crossover, .streaming_engine = ENGINE_HYBRID };
+    runInParallel(&job, streamingWorker, numThreads);
+}
+
+
+/*
+    Streams x[] through one of the block-streaming convolvers (UniformConvolver, NonUniformConvolver or
+    HybridConvolver) to produce the work items' outputs, one block (item) at a time.
+
+    A thread that starts part way through y[] has its own convolver, which starts out as if x[] had been
+    silent up to that point, so it first feeds in (without keeping the output) the M-1 samples before its
+    range, which is enough for the convolver's history to be right by the time it gets there.
+*/
+void streamingWorker(ConvolutionJob* job, int firstItem, int lastItem)
+{
+    int B = job->item_size;
+    void* convolver = createStreamingConvolver(job->streaming_engine, job->h, job->M, B,
+                                               (job->streaming_engine == ENGINE_UPOLS) ? job->H : NULL);
+    float* in = (float*)malloc(B * sizeof(float));
+    float* out = (float*)malloc(B * sizeof(float));
+
+    int warmUpStart = firstItem * B - (job->M - 1);
+    int firstBlock = (warmUpStart > 0) ? warmUpStart / B : 0;
+
+    for (int b = firstBlock; b < lastItem; b++) {
+        int start = b * B;
+        int inLen = (job->N - start < B) ? job->N - start : B;  // x[] runs out before y[] does
+        if (inLen < 0)  inLen = 0;
+        memcpy(in, job->x + start, inLen * sizeof(float));
+        memset(in + inLen, 0, (B - inLen) * sizeof(float));
+
+        processStreamingBlock(job->streaming_engine, convolver, in, out, B);
+
+        if (b >= firstItem) {
+            int outLen = (job->P - start < B) ? job->P - start : B;
+            memcpy(job->y + start, out, outLen * sizeof(float));
+            advanceProgress(&job->progress, 1);
+        }
+    }
+    free(in); free(out);
+    destroyStreamingConvolver(job->streaming_engine, convolver);
+}
+
+
+// Creates the block-streaming convolver for the given engine (upols, nonuniform or hybrid). For upols,
+// partitions[] can be h[]'s partition spectra for this block size, if they've already been computed.
+void* createStreamingConvolver(EngineType engine, float h[], int M, int blockSize, Complex partitions[])
+{
+    if (engine == ENGINE_UPOLS && partitions)
+        return createUniformConvolverFromSpectra(partitions, (M + blockSize - 1) / blockSize, blockSize);
+
+    switch (engine) {
+        case ENGINE_NONUNIFORM:  return createNonUniformConvolver(h, M, blockSize);
+        case ENGINE_HYBRID:      return createHybridConvolver(h, M, blockSize);
+        case ENGINE_UPOLS:
+        default:                 return createUniformConvolver(h, M, blockSize);
+    }
+}
+
+
+// Whether the engine has a block-streaming convolver (see createStreamingConvolver())
+bool isStreamingEngine(EngineType engine)
+{
+    return engine == ENGINE_UPOLS || engine == ENGINE_NONUNIFORM || engine == ENGINE_HYBRID;
+}
+
+
+void processStreamingBlock(EngineType engine, void* convolver, float in[], float out[], int blockSize)
+{
+    switch (engine) {
+        case ENGINE_NONUNIFORM:  processNonUniformBlock(convolver, in, out);  break;
+        case ENGINE_HYBRID:      processHybrid(convolver, in, out, blockSize);  break;
+        case ENGINE_UPOLS:
+        default:                 processUniformBlock(convolver, in, out);  break;
+    }
+}
+
+
+void destroyStreamingConvolver(EngineType engine, void* convolver)
+{
+    switch (engine) {
+        case ENGINE_NONUNIFORM:  destroyNonUniformConvolver(convolver);  break;
+        case ENGINE_HYBRID:      destroyHybridConvolver(convolver);  break;
+        case ENGINE_UPOLS:
+        default:                 destroyUniformConvolver(convolver);  break;
+    }
+}
+
+
+/*
+    Performs time-domain convolution like convolve(), but with the output side algorithm and vector kernels:
+    each y[p] is computed once, in registers, as the dot product of h[] (reversed) with the x[] samples that
+    contribute to it, instead of y[] being read and written back M times. The kernels work on 32 (AVX2) or 64
+    (AVX-512) consecutive outputs at once, so each h[] value loaded is used for all of them.
+
+    This is the fastest engine for short impulse responses (up to roughly 128 taps); beyond that the FFT
+    engines win.
+
+    Parameters: same as convolve(), plus the instruction set to use (ISA_AUTO for the best the CPU supports;
+                anything the CPU doesn't support is lowered to what it does) and the number of threads
+*/
+void convolveDirectSIMD(float x[], int N, float h[], int M, float y[], int P, IsaLevel isa, int numThreads)
+{
+    ConvolutionJob job = { .x = x, .N = N, .h = h, .M = M, .y = y, .P = P, .item_size = 4096,
+                           .kernel = chooseDirectKernel(isa, M), .tap_tile_size = M };
+    job.xp = createPaddedInput(x, N, M);
+    job.hr = createReversedImpulse(h, M);
+
+    runInParallel(&job, outputSideWorker, numThreads);
+
+    free(job.xp); free(job.hr);
+}
+
+
+/*
+    Performs time-domain convolution with the output side algorithm like convolveDirectSIMD(), but tiled
+    over both the outputs and the taps so that the working set stays in L1 however long h[] is: for each
+    tile of OUTPUT_TILE_SIZE outputs, h[] is gone through TAP_TILE_SIZE taps at a time, and each tile of
+    (reversed) h[] plus the x[] samples it touches (about 20 KB) is reused by every output in the tile before
+    moving on. Without the tiling, every block of outputs streams all of h[] and a matching stretch of x[]
+    through the cache, which misses all the way out to memory once h[] is bigger than L2.
+
+    Parameters: same as convolveDirectSIMD()
+*/
+void convolveOutputSideBlocked(float x[], int N, float h[], int M, float y[], int P, IsaLevel isa, int numThreads)
+{
+    ConvolutionJob job = { .x = x, .N = N, .h = h, .M = M, .y = y, .P = P, .item_size = OUTPUT_TILE_SIZE,
+                           .kernel = chooseDirectKernel(isa, (M < TAP_TILE_SIZE) ? M : TAP_TILE_SIZE),
+                           .tap_tile_size = TAP_TILE_SIZE };
+    job.xp = createPaddedInput(x, N, M);
+    job.hr = createReversedImpulse(h, M);
+
+    runInParallel(&job, outputSideWorker, numThreads);
+
+    free(job.xp); free(job.hr);
+}
+
+
+// Each work item is a tile of outputs, done tap_tile_size taps at a time
+void outputSideWorker(ConvolutionJob* job, int firstItem, int lastItem)
+{
+    for (int item = firstItem; item < lastItem; item++) {
+        int start, end;
+        outputsOfItem(job, item, &start, &end);
+        for (int p = start; p < end; p++)
+            job->y[p] = 0.0;
+
+        int first, last;
+        tapsReachingInput(start, end - start, job->N, job->M, &first, &last);
+        for (int k = first; k < last; k += job->tap_tile_size) {
+            int taps = (last - k < job->tap_tile_size) ? last - k : job->tap_tile_size;
+            job->kernel(job->xp + start + k, job->hr + k, taps, job->y + start, end - start);
+        }
+        advanceProgress(&job->progress, 1);
+    }
+}
+
+
+// Lowers isa to what the CPU supports and returns the direct-form kernel for it, for taps taps at a time
+DirectKernel chooseDirectKernel(IsaLevel isa, int taps)
+{
+    IsaLevel supported = detectIsaLevel();
+    if (isa > supported)  isa = supported;
+    DirectKernel kernel = directKernelForLength(isa, taps);
+    if (SHOW_DEBUG_OUTPUT)
+        showMessage("\nDirect-form kernel:  %s%s\n", isaName(isa), (kernel != directKernelFor(isa)) ? ", for that length" : "");
+    return kernel;
+}
+
+
+// Returns a copy of x[] (of size N) with M-1 zeros on either side, so that every output of the output side
+// algorithm has all M of its inputs available
+float* createPaddedInput(float x[], int N, int M)
+{
+    float* xp = (float*)calloc(N + 2 * (M - 1), sizeof(float));
+    memcpy(xp + M - 1, x, N * sizeof(float));
+    return xp;
+}
+
+
+/*
+    For the outputs y[start .. start+count) of the output side algorithm, finds the range [first, last) of
+    (reversed) taps that line up with actual x[] samples (of size N) rather than the zero padding around it,
+    so the kernels can skip the rest. Matters a lot when M is long compared to N.
+*/
+void tapsReachingInput(int start, int count, int N, int M, int* first, int* last)
+{
+    *first = (M - 1) - (start + count - 1);
+    if (*first < 0)  *first = 0;
+    *last = (M - 1 + N) - start;
+    if (*last > M)  *last = M;
+}
+
+
+// Returns a reversed copy of h[] (of size M)
+float* createReversedImpulse(float h[], int M)
+{
+    float* hr = (float*)malloc(M * sizeof(float));
+    for (int m = 0; m < M; m++)
+        hr[m] = h[M - 1 - m];
+    return hr;
+}
+
+
+// Runs the convolution engine selected on the command line (or by planConvolution()). y[] is left unscaled.
+void runConvolutionEngine(Options* options, float x[], int N, float h[], int M, float y[], int P)
+{
+    int threads = options->threads;
+
+    switch (options->engine) {
+        case ENGINE_SIMD:    convolveDirectSIMD(x, N, h, M, y, P, options->isa, threads);  break;
+        case ENGINE_BLOCKED: convolveOutputSideBlocked(x, N, h, M, y, P, options->isa, threads);  break;
+        case ENGINE_FFT:     convolveFFT(x, N, h, M, y, P, options->fft_size, threads);  break;
+        case ENGINE_UPOLS:   convolveUniformPartitioned(x, N, h, M, y, P, options->block_size, options->partitions, threads);  break;
+        case ENGINE_NONUNIFORM:  convolveNonUniformPartitioned(x, N, h, M, y, P, options->block_size, threads);  break;
+        case ENGINE_HYBRID:  convolveHybrid(x, N, h, M, y, P, options->crossover, threads);  break;
+        case ENGINE_DIRECT:
+        default:
+            convolveDirectTyped(options->precision, x, N, h, M, y, P, threads);
+            break;
+    }
+}
+
+
+// ----- PROGRESS DISPLAY -----------------------------------------------------
+// Shows progress in 10% increments if SHOW_PROGRESS is set (see top of program)
+void startProgress(Progress* progress, int total)
+{
+    progress->total = total;
+    atomic_init(&progress->done, 0);
+    atomic_init(&progress->multiple, 1);
+    pthread_mutex_init(&progress->lock, NULL);
+    if (SHOW_PROGRESS) {
+        showMessage("\nStarting convolution. Please wait...\n");
+    }
+}
+
+
+// Records that another numItems of the total work items are done. Safe to call from several threads at once.
+void advanceProgress(Progress* progress, int numItems)
+{
+    int done = atomic_fetch_add(&progress->done, numItems) + numItems;
+
+    if (SHOW_PROGRESS && atomic_load(&progress->multiple) < 10 
+        && done >= progress->total * (atomic_load(&progress->multiple) / 10.0)) {
+        pthread_mutex_lock(&progress->lock);
+        int multiple = atomic_load(&progress->multiple);
+        while (multiple < 10 && done >= progress->total * (multiple / 10.0)) {
+            showMessage("%d0%%  ", multiple++);
+        }
+        atomic_store(&progress->multiple, multiple);
+        pthread_mutex_unlock(&progress->lock);
+    }
+}
+
+
+void finishProgress(Progress* progress)
+{
+    if (SHOW_PROGRESS) showMessage("100%%");
+    pthread_mutex_destroy(&progress->lock);
+}
+
+
+// Writes a message (printf-style) to messageOutput, if the program using the library has set one
+void showMessage(const char* format, ...)
+{
+    if (!messageOutput)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(messageOutput, format, args);
+    va_end(args);
+    fflush(messageOutput);
+}
+
+
+// ----- THREADS --------------------------------------------------------------
+/*
+    Splits the job's outputs into work items of job->item_size and has numThreads threads each do an
+    (almost) equal, contiguous run of them with worker(). Returns once they're all done. Progress is
+    reported as work items get finished.
+
+    The calling thread does the first run itself, and the others go to threads of the worker pool, which
+    wait for more work once they're done rather than exiting, so a run doesn't pay for creating and joining
+    its threads. The pool only grows: a new thread is started when none is idle (several runs can go at
+    once, from different threads of the program, or from inside another run's worker). Once the pool has
+    been stopped (see stopWorkerPool()), the calling thread does every run itself.
+*/
+void runInParallel(ConvolutionJob* job, RangeWorker worker, int numThreads)
+{
+    int numItems = (job->P + job->item_size - 1) / job->item_size;
+    if (numThreads > numItems)  numThreads = numItems;
+    if (numThreads < 1)  numThreads = 1;
+
+    startProgress(&job->progress, numItems);
+
+    if (numThreads == 1)
+        worker(job, 0, numItems);
+    else {
+        RangeWorkerArgs* args = (RangeWorkerArgs*)malloc(numThreads * sizeof(RangeWorkerArgs));
+        int unfinished = 0;
+        pthread_cond_t finished;
+        pthread_cond_init(&finished, NULL);
+        pthread_mutex_lock(&workerPoolLock);
+        bool pooled = !workerPoolStopping;
+        for (int t = 0; t < numThreads; t++) {
+            args[t].job = job;  args[t].worker = worker;
+            args[t].first_item = (int)((long)numItems * t / numThreads);
+            args[t].last_item  = (int)((long)numItems * (t + 1) / numThreads);
+            args[t].unfinished = &unfinished;  args[t].finished = &finished;
+            if (t == 0 || !pooled)
+                continue;
+            PoolThread* thread = idlePoolThreads;
+            if (thread)
+                idlePoolThreads = thread->next_idle;
+            else {
+                thread = (PoolThread*)calloc(1, sizeof(PoolThread));
+                pthread_cond_init(&thread->wake, NULL);
+                pthread_create(&thread->id, NULL, poolThread, thread);
+                thread->next = poolThreads;
+                poolThreads = thread;
+            }
+            thread->work = &args[t];
+            unfinished++;
+            pthread_cond_signal(&thread->wake);
+        }
+        pthread_mutex_unlock(&workerPoolLock);
+
+        for (int t = 0; t < (pooled ? 1 : numThreads); t++)
+            worker(job, args[t].first_item, args[t].last_item);
+
+        pthread_mutex_lock(&workerPoolLock);
+        while (unfinished > 0)
+            pthread_cond_wait(&finished, &workerPoolLock);
+        pthread_mutex_unlock(&workerPoolLock);
+        pthread_cond_destroy(&finished);
+        free(args);
+    }
+    finishProgress(&job->progress);
+}
+
+
+// A thread of the worker pool: does each range of work items it's given, then goes back on the idle list, until the pool is stopped
+void* poolThread(void* arg)
+{
+    PoolThread* self = (PoolThread*)arg;
+    pthread_mutex_lock(&workerPoolLock);
+    for (;;) {
+        while (!self->work && !workerPoolStopping)
+            pthread_cond_wait(&self->wake, &workerPoolLock);
+        if (!self->work)
+            break;
+        RangeWorkerArgs* a = self->work;
+        pthread_mutex_unlock(&workerPoolLock);
+        a->worker(a->job, a->first_item, a->last_item);
+
+        pthread_mutex_lock(&workerPoolLock);
+        self->work = NULL;
+        if (!workerPoolStopping) {
+            self->next_idle = idlePoolThreads;
+            idlePoolThreads = self;
+        }
+        if (--*a->unfinished == 0)
+            pthread_cond_signal(a->finished);
+    }
+    bool freeSelf = self->left_busy;
+    pthread_mutex_unlock(&workerPoolLock);
+    if (freeSelf) {
+        pthread_cond_destroy(&self->wake);
+        free(self);
+    }
+    return NULL;
+}
+
+
+/*
+    Stops the worker pool's threads, when the library is unloaded (dlclose()) or the program exits. The
+    idle ones are woken, joined and freed. Any still doing a run (which can only be if the program exits
+    in the middle of one) are detached rather than waited for, and free themselves once they're done.
+*/
+__attribute__((destructor))
+void stopWorkerPool(void)
+{
+    pthread_mutex_lock(&workerPoolLock);
+    workerPoolStopping = true;
+    PoolThread* idle = NULL;  // (listed now: a busy one may be gone by the time the lock's released)
+    for (PoolThread* thread = poolThreads; thread; thread = thread->next) {
+        if (thread->work) {
+            thread->left_busy = true;
+            pthread_detach(thread->id);
+        }
+        else {
+            thread->next_idle = idle;
+            idle = thread;
+        }
+        pthread_cond_signal(&thread->wake);
+    }
+    poolThreads = NULL;
+    idlePoolThreads = NULL;
+    pthread_mutex_unlock(&workerPoolLock);
+
+    while (idle) {
+        PoolThread* thread = idle;
+        idle = thread->next_idle;
+        pthread_join(thread->id, NULL);
+        pthread_cond_destroy(&thread->wake);
+        free(thread);
+    }
+}
+
+
+// Gets the range of outputs [start, end) that make up the given work item of the job
+void outputsOfItem(ConvolutionJob* job, int item, int* start, int* end)
+{
+    *start = item * job->item_size;
+    *end = (*start + job->item_size < job->P) ? *start + job->item_size : job->P;
+}
+
+
+int numberOfCPUs(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+}
+
+
+// ----- FFT ------------------------------------------------------------------
+// Returns the smallest power of 2 that is >= n, or 0 if n is more than 2^30 (the largest power of 2 an int can hold)
+int nextPowerOf2(int n)
+{
+    if (n > (1 << 30))
+        return 0;
+    int power = 1;
+    while (power < n)
+        power *= 2;
+    return power;
+}
+
+
+/*
+    Returns the tables needed for a real-input FFT of the given size (a power of 2, at least 4): straight from
+    the on-disk plan cache if they're in it, otherwise built from scratch (and then added to the cache, so
+    the next run doesn't have to). Either way, they're kept for as long as the process runs, so every later
+    plan of the same size shares them, without looking in the file again or building them again (even with
+    no cache file at all).
+
+    A real FFT of size n is done as a complex FFT of size n/2 (even samples as the real parts, odd samples as
+    the imaginary parts) followed by a "split" step that separates the two interleaved spectra. That's about
+    twice as fast as feeding the real samples to an n-point complex FFT.
+*/
+FftPlan* createFftPlan(int size)
+{
+    FftPlan* plan = findCachedFftPlan(size);
+    if (plan)
+        return plan;
+
+    plan = buildFftPlan(size);
+    addToFftPlanCache(plan);
+    return keepFftPlan(plan);
+}
+
+
+// Keeps a plan just built in fftPlansKept[] (unless another thread got there first, in which case it's
+// destroyed and theirs is used), and returns a plan sharing its tables
+FftPlan* keepFftPlan(FftPlan* plan)
+{
+    int log2Size = 0;
+    while ((1 << log2Size) < plan->size)
+        log2Size++;
+    pthread_mutex_lock(&fftPlanCacheLock);
+    if (fftPlansKept[log2Size])
+        destroyFftPlan(plan);
+    else
+        fftPlansKept[log2Size] = plan;
+    FftPlan* shared = sharedFftPlan(fftPlansKept[log2Size]);
+    pthread_mutex_unlock(&fftPlanCacheLock);
+    return shared;
+}
+
+
+// Returns a plan that uses the same tables as the given one (which must outlive it), and doesn't free them
+FftPlan* sharedFftPlan(FftPlan* plan)
+{
+    FftPlan* shared = (FftPlan*)malloc(sizeof(FftPlan));
+    *shared = *plan;
+    shared->owns_tables = false;
+    return shared;
+}
+
+
+FftPlan* buildFftPlan(int size)
+{
+    FftPlan* plan = (FftPlan*)malloc(sizeof(FftPlan));
+    plan->size = size;
+    plan->half = size / 2;
+    plan->owns_tables = true;
+    int half = plan->half;
+
+    plan->bit_reversed = (int*)malloc(half * sizeof(int));
+    int numBits = 0;
+    while ((1 << numBits) < half)
+        numBits++;
+    for (int i = 0; i < half; i++) {
+        int reversed = 0;
+        for (int bit = 0; bit < numBits; bit++)
+            if (i & (1 << bit))
+                reversed |= 1 << (numBits - 1 - bit);
+        plan->bit_reversed[i] = reversed;
+    }
+
+    // computed in double precision to keep the tables as accurate as a float can hold
+    plan->twiddles = (Complex*)malloc((half > 1 ? half - 1 : 1) * sizeof(Complex));
+    for (int span = 1; span < half; span *= 2) {
+        for (int j = 0; j < span; j++) {
+            plan->twiddles[span - 1 + j].re = (float)cos(-M_PI * j / span);
+            plan->twiddles[span - 1 + j].im = (float)sin(-M_PI * j / span);
+        }
+    }
+    plan->split_twiddles = (Complex*)malloc((half / 2 + 1) * sizeof(Complex));
+    for (int k = 0; k <= half / 2; k++) {
+        plan->split_twiddles[k].re = (float)cos(-2.0 * M_PI * k / size);
+        plan->split_twiddles[k].im = (float)sin(-2.0 * M_PI * k / size);
+    }
+    return plan;
+}
+
+
+void destroyFftPlan(FftPlan* plan)
+{
+    if (plan->owns_tables) {
+        free(plan->bit_reversed); free(plan->twiddles); free(plan->split_twiddles);
+    }
+    free(plan);
+}
+
+
+// ----- FFT PLAN CACHE -------------------------------------------------------
+/*
+    FFT tables (twiddle factors and the bit-reversal permutation) only depend on the FFT size, but take a
+    while to build for big sizes, so they are kept in a cache file (fftPlanCacheFile, set by --plan-cache)
+    that every run shares. The first lookup maps the whole file into memory, read-only; after that, a plan
+    found in the cache is just pointers into the mapping, with nothing to compute or copy. A file of another
+    version is ignored (and replaced on the next add).
+
+    Plans this process has already found or built are looked for first, in fftPlansKept[]: the mapping is
+    only of the file as it was at the first lookup, so without them, a size added to the file since then
+    (by this process or another) would be built again each time it was needed.
+
+    Returns NULL if the size isn't in either.
+*/
+FftPlan* findCachedFftPlan(int size)
+{
+    FftPlan* plan = NULL;
+    int log2Size = 0;
+    while ((1 << log2Size) < size)
+        log2Size++;
+    pthread_mutex_lock(&fftPlanCacheLock);
+    if (fftPlansKept[log2Size]) {
+        plan = sharedFftPlan(fftPlansKept[log2Size]);
+        pthread_mutex_unlock(&fftPlanCacheLock);
+        return plan;
+    }
+
+    if (!fftPlanCacheOpened && fftPlanCacheFile) {
+        fftPlanCacheOpened = true;
+        int fd = open(fftPlanCacheFile, O_RDONLY);
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(FftPlanCacheHeader)) {
+            void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            FftPlanCacheHeader* header = (FftPlanCacheHeader*)map;
+            if (map != MAP_FAILED && memcmp(header->magic, "CNVFFTPC", 8) == 0 && header->version == FFT_PLAN_CACHE_VERSION) {
+                fftPlanCacheMap = map;
+                fftPlanCacheMapLength = info.st_size;
+            }
+            else if (map != MAP_FAILED)
+                munmap(map, info.st_size);
+        }
+        if (fd >= 0)  close(fd);
+    }
+
+    if (fftPlanCacheMap) {
+        FftPlanCacheHeader* header = (FftPlanCacheHeader*)fftPlanCacheMap;
+        size_t twiddleOffset, splitOffset, totalBytes;
+        fftPlanTableLayout(size, &twiddleOffset, &splitOffset, &totalBytes);
+
+        for (uint32_t i = 0; i < header->num_plans && i < MAX_CACHED_FFT_PLANS; i++) {
+            if (header->plans[i].size != (uint32_t)size || header->plans[i].offset + totalBytes > fftPlanCacheMapLength)
+                continue;
+            char* tables = (char*)fftPlanCacheMap + header->plans[i].offset;
+            FftPlan* cached = (FftPlan*)malloc(sizeof(FftPlan));
+            cached->size = size;
+            cached->half = size / 2;
+            cached->bit_reversed = (int*)tables;
+            cached->twiddles = (Complex*)(tables + twiddleOffset);
+            cached->split_twiddles = (Complex*)(tables + splitOffset);
+            cached->owns_tables = false;
+            fftPlansKept[log2Size] = cached;
+            plan = sharedFftPlan(cached);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fftPlanCacheLock);
+    return plan;
+}
+
+
+/*
+    Appends the plan's tables to the cache file, if there is one and it doesn't already have them. Holds an
+    exclusive lock on the file while doing so, so that runs happening at the same time don't clash. The
+    tables are written before the header entry that points to them, and readers check that an entry's
+    tables lie within what they've mapped, so a reader never sees half-written tables.
+
+    Other runs may have the file mapped, so nothing that is already in it is ever changed, and it is never
+    truncated: a file that isn't a cache of this version is replaced by a new one (see startFftPlanCache()),
+    leaving whoever has the old one mapped with the old one.
+*/
+void addToFftPlanCache(FftPlan* plan)
+{
+    if (!fftPlanCacheFile)
+        return;
+    int fd = openLockedFftPlanCache();
+    if (fd < 0)
+        return;
+
+    FftPlanCacheHeader header;
+    struct stat info;
+    bool valid = fstat(fd, &info) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                 && memcmp(header.magic, "CNVFFTPC", 8) == 0 && header.version == FFT_PLAN_CACHE_VERSION;
+    if (!valid) {  // new (or unusable) file: start it over
+        startFftPlanCache(plan);
+        flock(fd, LOCK_UN);  close(fd);
+        return;
+    }
+
+    bool present = false;
+    for (uint32_t i = 0; i < header.num_plans && i < MAX_CACHED_FFT_PLANS; i++)
+        if (header.plans[i].size == (uint32_t)plan->size)
+            present = true;
+
+    if (!present && header.num_plans < MAX_CACHED_FFT_PLANS) {
+        uint64_t offset = ((uint64_t)info.st_size + 63) / 64 * 64;
+        if (writeFftPlanTables(fd, plan, offset)) {
+            header.plans[header.num_plans].size = plan->size;
+            header.plans[header.num_plans].reserved = 0;
+            header.plans[header.num_plans].offset = offset;
+            header.num_plans++;
+            pwrite(fd, &header, sizeof(header), 0);  // (if that fails, the tables are just never found)
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+
+/*
+    Opens the cache file (creating it if need be) and locks it. If another run replaced it while this one
+    was waiting for the lock, it's the new file that is opened and locked. Returns -1 if it can't be opened.
+*/
+int openLockedFftPlanCache(void)
+{
+    for (int attempt = 0; attempt < 8; attempt++) {
+        int fd = open(fftPlanCacheFile, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return -1;
+        flock(fd, LOCK_EX);
+
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && stat(fftPlanCacheFile, &current) == 0
+            && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino)
+            return fd;
+        flock(fd, LOCK_UN);  close(fd);
+    }
+    return -1;
+}
+
+
+// Writes a new cache file holding just the plan's tables, and renames it over the old one. (Called with
+// the old one locked, so that no other run adds to it meanwhile.)
+void startFftPlanCache(FftPlan* plan)
+{
+    char* temporaryName = (char*)malloc(strlen(fftPlanCacheFile) + 8);
+    if (!temporaryName)
+        return;
+    sprintf(temporaryName, "%s.XXXXXX", fftPlanCacheFile);
+    int fd = mkstemp(temporaryName);
+    if (fd < 0) {
+        free(temporaryName);
+        return;
+    }
+
+    FftPlanCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CNVFFTPC", 8);
+    header.version = FFT_PLAN_CACHE_VERSION;
+    header.num_plans = 1;
+    header.plans[0].size = plan->size;
+    header.plans[0].offset = (sizeof(header) + 63) / 64 * 64;
+
+    bool written = fchmod(fd, 0644) == 0 && writeFftPlanTables(fd, plan, header.plans[0].offset)
+                   && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    close(fd);
+    if (!written || rename(temporaryName, fftPlanCacheFile) != 0)
+        unlink(temporaryName);
+    free(temporaryName);
+}
+
+
+// Writes the plan's tables to the cache file at offset, laid out as fftPlanTableLayout() says
+bool writeFftPlanTables(int fd, FftPlan* plan, uint64_t offset)
+{
+    size_t twiddleOffset, splitOffset, totalBytes;
+    fftPlanTableLayout(plan->size, &twiddleOffset, &splitOffset, &totalBytes);
+
+    char* tables = (char*)calloc(totalBytes, 1);
+    int half = plan->half;
+    memcpy(tables, plan->bit_reversed, half * sizeof(int));
+    memcpy(tables + twiddleOffset, plan->twiddles, (half > 1 ? half - 1 : 1) * sizeof(Complex));
+    memcpy(tables + splitOffset, plan->split_twiddles, (half / 2 + 1) * sizeof(Complex));
+
+    bool written = pwrite(fd, tables, totalBytes, offset) == (ssize_t)totalBytes;
+    free(tables);
+    return written;
+}
+
+
+// Works out where each of an FFT plan's tables go in the cache (relative to the plan's offset)
+void fftPlanTableLayout(int size, size_t* twiddleOffset, size_t* splitOffset, size_t* totalBytes)
+{
+    int half = size / 2;
+    size_t bitReversedBytes = half * sizeof(int);
+    size_t twiddleBytes = (half > 1 ? half - 1 : 1) * sizeof(Complex);
+    size_t splitBytes = (half / 2 + 1) * sizeof(Complex);
+
+    *twiddleOffset = (bitReversedBytes + 63) / 64 * 64;
+    *splitOffset = (*twiddleOffset + twiddleBytes + 63) / 64 * 64;
+    *totalBytes = (*splitOffset + splitBytes + 63) / 64 * 64;
+}
+
+
+// In-place radix-2 butterflies over data[] (already in bit-reversed order) of size plan->half.
+// The inverse transform uses the conjugate twiddles and is not scaled.
+void complexFFTButterflies(FftPlan* plan, Complex data[], bool inverse)
+{
+    int half = plan->half;
+    float sign = inverse ? -1.0f : 1.0f;
+
+    for (int span = 1; span < half; span *= 2) {
+        Complex* w = plan->twiddles + span - 1;
+        for (int start = 0; start < half; start += 2 * span) {
+            for (int j = 0; j < span; j++) {
+                Complex* a = &data[start + j];
+                Complex* b = &data[start + j + span];
+                float wIm = sign * w[j].im;
+                float tRe = w[j].re * b->re - wIm * b->im;
+                float tIm = w[j].re * b->im + wIm * b->re;
+                b->re = a->re - tRe;  b->im = a->im - tIm;
+                a->re += tRe;         a->im += tIm;
+            }
+        }
+    }
+}
+
+
+/*
+    Transforms the plan->size real samples in[] into the plan->half + 1 complex bins of out[]
+    (bins 0 through n/2; the rest of the spectrum is the mirror image of those, so isn't stored).
+*/
+void forwardRealFFT(FftPlan* plan, float in[], Complex out[])
+{
+    int half = plan->half;
+
+    // pack pairs of real samples into complex ones, placing them in bit-reversed order as we go
+    for (int k = 0; k < half; k++) {
+        out[plan->bit_reversed[k]].re = in[2*k];
+        out[plan->bit_reversed[k]].im = in[2*k + 1];
+    }
+    complexFFTButterflies(plan, out, false);
+
+    // split the spectrum of the packed signal into the spectrum of the real one
+    Complex z0 = out[0];
+    out[0].re    = z0.re + z0.im;  out[0].im    = 0.0f;
+    out[half].re = z0.re - z0.im;  out[half].im = 0.0f;
+
+    for (int k = 1; k <= half / 2; k++) {
+        Complex a = out[k], b = out[half - k];
+        Complex w = plan->split_twiddles[k];
+
+        float eRe = 0.5f * (a.re + b.re),  eIm = 0.5f * (a.im - b.im);   // even samples' spectrum
+        float oRe = 0.5f * (a.im + b.im),  oIm = -0.5f * (a.re - b.re);  // odd samples' spectrum
+        float tRe = w.re * oRe - w.im * oIm;
+        float tIm = w.re * oIm + w.im * oRe;
+
+        out[k].re = eRe + tRe;            out[k].im = eIm + tIm;
+        out[half - k].re = eRe - tRe;     out[half - k].im = tIm - eIm;
+    }
+}
+
+
+/*
+    The reverse of forwardRealFFT(): turns the plan->half + 1 bins of spectrum[] into plan->size real samples
+    in out[], scaled so that a forward transform followed by an inverse one gives back the original samples.
+
+    Note: spectrum[] is used as scratch space, so its contents are destroyed.
+*/
+void inverseRealFFT(FftPlan* plan, Complex spectrum[], float out[])
+{
+    int half = plan->half;
+
+    // merge the real spectrum back into the spectrum of the packed (even + i*odd) signal
+    float x0 = spectrum[0].re, xHalf = spectrum[half].re;
+    spectrum[0].re = 0.5f * (x0 + xHalf);
+    spectrum[0].im = 0.5f * (x0 - xHalf);
+
+    for (int k = 1; k <= half / 2; k++) {
+        Complex a = spectrum[k], b = spectrum[half - k];
+        Complex w = plan->split_twiddles[k];
+
+        float eRe = 0.5f * (a.re + b.re),  eIm = 0.5f * (a.im - b.im);
+        float dRe = 0.5f * (a.re - b.re),  dIm = 0.5f * (a.im + b.im);
+        float oRe = dRe * w.re + dIm * w.im;  // (a - conj(b))/2 * conj(w)
+        float oIm = dIm * w.re - dRe * w.im;
+
+        spectrum[k].re = eRe - oIm;           spectrum[k].im = eIm + oRe;
+        spectrum[half - k].re = eRe + oIm;    spectrum[half - k].im = oRe - eIm;
+    }
+
+    for (int k = 0; k < half; k++) {
+        int r = plan->bit_reversed[k];
+        if (k < r) {
+            Complex temp = spectrum[k];  spectrum[k] = spectrum[r];  spectrum[r] = temp;
+        }
+    }
+    complexFFTButterflies(plan, spectrum, true);
+
+    float scale = 1.0f / half;
+    for (int k = 0; k < half; k++) {
+        out[2*k]     = spectrum[k].re * scale;
+        out[2*k + 1] = spectrum[k].im * scale;
+    }
+}
+
+
+// accumulator[k] += a[k] * b[k] for each of the n bins
+void multiplyAccumulateSpectra(Complex a[], Complex b[], Complex accumulator[], int n)
+{
+    for (int k = 0; k < n; k++) {
+        accumulator[k].re += a[k].re * b[k].re - a[k].im * b[k].im;
+        accumulator[k].im += a[k].re * b[k].im + a[k].im * b[k].re;
+    }
+}
+
+
+// result[k] = a[k] * b[k] for each of the n bins (result may be the same array as a or b)
+void multiplySpectra(Complex a[], Complex b[], Complex result[], int n)
+{
+    for (int k = 0; k < n; k++) {
+        float re = a[k].re * b[k].re - a[k].im * b[k].im;
+        float im = a[k].re * b[k].im + a[k].im * b[k].re;
+        result[k].re = re;  result[k].im = im;
+    }
+}
+
+
+// ----- UNIFORMLY PARTITIONED CONVOLUTION ------------------------------------
+/*
+    Splits h[] (of size M) into K = ceil(M / blockSize) partitions of blockSize samples and precomputes the
+    spectrum of each one (zero-padded to 2 * blockSize). Each call to processUniformBlock() then costs one
+    forward FFT, K complex multiply-accumulates and one inverse FFT, all of size 2 * blockSize.
+*/
+UniformConvolver* createUniformConvolver(float h[], int M, int blockSize)
+{
+    UniformConvolver* c = (UniformConvolver*)malloc(sizeof(UniformConvolver));
+    c->block_size = blockSize;
+    c->num_partitions = (M + blockSize - 1) / blockSize;
+    if (c->num_partitions < 1)  c->num_partitions = 1;
+    c->num_bins = blockSize + 1;
+    c->plan = createFftPlan(2 * blockSize);
+
+    c->partitions   = createPartitionSpectra(h, M, blockSize, c->plan);
+    c->owns_partitions = true;
+    c->delay_line   = (Complex*)malloc(c->num_partitions * c->num_bins * sizeof(Complex));
+    c->input_window = (float*)malloc(2 * blockSize * sizeof(float));
+    c->time_scratch = (float*)malloc(2 * blockSize * sizeof(float));
+    c->accumulator  = (Complex*)malloc(c->num_bins * sizeof(Complex));
+
+    resetUniformConvolver(c);
+    return c;
+}
+
+
+// Returns the spectra of h[]'s partitions of blockSize samples, each zero-padded to 2 * blockSize (plan's size),
+// one after another, as UniformConvolver.partitions holds them
+Complex* createPartitionSpectra(float h[], int M, int blockSize, FftPlan* plan)
+{
+    int numPartitions = (M + blockSize - 1) / blockSize;
+    if (numPartitions < 1)  numPartitions = 1;
+    int bins = blockSize + 1;
+    Complex* partitions = (Complex*)malloc(numPartitions * bins * sizeof(Complex));
+    float* padded = (float*)malloc(2 * blockSize * sizeof(float));
+
+    for (int k = 0; k < numPartitions; k++) {
+        int len = (M - k * blockSize < blockSize) ? M - k * blockSize : blockSize;
+        if (len < 0)  len = 0;
+        memset(padded, 0, 2 * blockSize * sizeof(float));
+        memcpy(padded, h + k * blockSize, len * sizeof(float));
+        forwardRealFFT(plan, padded, partitions + k * bins);
+    }
+    free(padded);
+    return partitions;
+}
+
+
+/*
+    Returns the partition spectra (see createPartitionSpectra()) of each of the numChannels channels of h[],
+    each channel's after the one before, as createChannelConvolver() takes them
+*/
+Complex* createChannelPartitionSpectra(float* h[], int numChannels, int M, int blockSize)
+{
+    int numPartitions = (M + blockSize - 1) / blockSize;
+    if (numPartitions < 1)  numPartitions = 1;
+    size_t channelSize = (size_t)numPartitions * (blockSize + 1);
+    Complex* partitions = (Complex*)malloc(channelSize * numChannels * sizeof(Complex));
+    FftPlan* plan = createFftPlan(2 * blockSize);
+    for (int c = 0; c < numChannels; c++) {
+        Complex* spectra = createPartitionSpectra(h[c], M, blockSize, plan);
+        memcpy(partitions + c * channelSize, spectra, channelSize * sizeof(Complex));
+        free(spectra);
+    }
+    destroyFftPlan(plan);
+    return partitions;
+}
+
+
+/*
+    Creates a UniformConvolver from partition spectra that have already been computed (e.g. by an earlier
+    createUniformConvolver() for the same h[] and blockSize, saved in a spectrum file). The spectra aren't
+    copied, and must outlive the convolver.
+*/
+UniformConvolver* createUniformConvolverFromSpectra(Complex partitions[], int numPartitions, int blockSize)
+{
+    UniformConvolver* c = (UniformConvolver*)malloc(sizeof(UniformConvolver));
+    c->block_size = blockSize;
+    c->num_partitions = (numPartitions < 1) ? 1 : numPartitions;
+    c->num_bins = blockSize + 1;
+    c->plan = createFftPlan(2 * blockSize);
+
+    c->partitions   = partitions;
+    c->owns_partitions = false;
+    c->delay_line   = (Complex*)malloc(c->num_partitions * c->num_bins * sizeof(Complex));
+    c->input_window = (float*)malloc(2 * blockSize * sizeof(float));
+    c->time_scratch = (float*)malloc(2 * blockSize * sizeof(float));
+    c->accumulator  = (Complex*)malloc(c->num_bins * sizeof(Complex));
+
+    resetUniformConvolver(c);
+    return c;
+}
+
+
+void destroyUniformConvolver(UniformConvolver* c)
+{
+    destroyFftPlan(c->plan);
+    if (c->owns_partitions)  free(c->partitions);
+    free(c->delay_line); free(c->input_window); free(c->time_scratch); free(c->accumulator);
+    free(c);
+}
+
+
+// Clears all input history, as if the convolver had only ever been fed silence
+void resetUniformConvolver(UniformConvolver* c)
+{
+    memset(c->delay_line, 0, c->num_partitions * c->num_bins * sizeof(Complex));
+    memset(c->input_window, 0, 2 * c->block_size * sizeof(float));
+    c->newest = 0;
+}
+
+
+/*
+    Consumes the next block_size input samples from in[] and writes the next block_size output samples to out[].
+    
+    The newest input block's spectrum goes into the frequency-domain delay line, replacing the oldest. Output
+    block = inverse FFT of the sum over k of (input spectrum from k blocks ago) * (spectrum of partition k);
+    only the last block_size samples of that are kept (overlap-save), the rest being circular wrap-around.
+*/
+void processUniformBlock(UniformConvolver* c, float in[], float out[])
+{
+    int B = c->block_size;
+
+    addUniformInput(c, in);
+    memset(c->accumulator, 0, c->num_bins * sizeof(Complex));
+    accumulateUniformOutput(c, c->partitions, c->accumulator);
+    inverseRealFFT(c->plan, c->accumulator, c->time_scratch);
+    memcpy(out, c->time_scratch + B, B * sizeof(float));
+}
+
+
+// The first half of processUniformBlock(): puts the spectrum of the next block_size input samples into the delay line
+void addUniformInput(UniformConvolver* c, float in[])
+{
+    int B = c->block_size, K = c->num_partitions;
+
+    memmove(c->input_window, c->input_window + B, B * sizeof(float));  // slide the window along by one block
+    memcpy(c->input_window + B, in, B * sizeof(float));
+
+    c->newest = (c->newest + K - 1) % K;  // move back one slot, so older spectra are at increasing indexes
+    forwardRealFFT(c->plan, c->input_window, c->delay_line + c->newest * c->num_bins);
+}
+
+
+/*
+    The second half: adds the delay line's spectra, each times its partition's spectrum, into accumulator[].
+    The partitions can be another impulse response's, as long as they're the same size and number (see
+    processChannelBlock(), where several impulse responses share one input's delay line).
+*/
+void accumulateUniformOutput(UniformConvolver* c, Complex partitions[], Complex accumulator[])
+{
+    int K = c->num_partitions, bins = c->num_bins;
+
+    for (int k = 0; k < K; k++) {
+        int slot = (c->newest + k) % K;
+        multiplyAccumulateSpectra(c->delay_line + slot * bins, partitions + k * bins, accumulator, bins);
+    }
+}
+
+
+// ----- NON-UNIFORMLY PARTITIONED CONVOLUTION --------------------------------
+/*
+    Splits h[] (of size M) into partitions that start small and double in size towards the tail
+    (Gardner-style), so that a block of blockSize samples can be processed with blockSize latency while the
+    per-block cost stays low even for very long impulse responses:
+
+        segment 0:   4 partitions of B            (h[0 .. 4B),     done in the caller's thread)
+        segment 1:   2 partitions of 2B           (h[4B .. 8B),    background thread)
+        segment 2:   2 partitions of 4B           (h[8B .. 16B),   background thread)
+        ...
+        last:        as many partitions of MAX_NONUNIFORM_PARTITION_SIZE as it takes to cover the rest
+
+    Every tail segment with partition size S starts at offset >= 2S in h[]. Its input block covering
+    x[iS .. (i+1)S) is complete at time (i+1)S, but its result isn't needed until time iS + offset >= (i+2)S,
+    so the worker has a whole S samples' worth of time to compute it and the big FFTs never hold up a block.
+*/
+NonUniformConvolver* createNonUniformConvolver(float h[], int M, int blockSize)
+{
+    NonUniformConvolver* c = (NonUniformConvolver*)malloc(sizeof(NonUniformConvolver));
+    c->block_size = blockSize;
+    c->time = 0;
+    c->num_segments = 0;
+
+    int headLength = (M < 4 * blockSize) ? M : 4 * blockSize;
+    c->head = createUniformConvolver(h, headLength, blockSize);
+
+    SegmentLayout layout[MAX_NONUNIFORM_SEGMENTS];
+    int numSegments = planNonUniformSegments(M, blockSize, layout);
+
+    for (int j = 0; j < numSegments; j++) {
+        int offset = layout[j].offset, size = layout[j].size;
+
+        NonUniformSegment* seg = &c->segments[c->num_segments++];
+        seg->convolver  = createUniformConvolver(h + offset, layout[j].length, size);
+        seg->offset     = offset;
+        seg->block_size = size;
+        seg->num_slots  = offset / size + 1;
+        seg->inputs[0]  = (float*)malloc(size * sizeof(float));
+        seg->inputs[1]  = (float*)malloc(size * sizeof(float));
+        seg->results    = (float*)malloc(seg->num_slots * size * sizeof(float));
+        seg->input_fill = 0;
+        seg->submitted  = 0;
+        seg->completed  = 0;
+        seg->quit       = false;
+        pthread_mutex_init(&seg->lock, NULL);
+        pthread_cond_init(&seg->changed, NULL);
+        pthread_create(&seg->worker, NULL, nonUniformSegmentWorker, seg);
+    }
+    return c;
+}
+
+
+// Works out the tail segments of the layout described above for an h[] of size M.
+// Fills in segments[] (room for MAX_NONUNIFORM_SEGMENTS) and returns how many there are.
+int planNonUniformSegments(int M, int blockSize, SegmentLayout segments[])
+{
+    int numSegments = 0;
+    int offset = 4 * blockSize;
+    int size = 2 * blockSize;
+    while (offset < M && numSegments < MAX_NONUNIFORM_SEGMENTS) {
+        bool isLast = (size >= MAX_NONUNIFORM_PARTITION_SIZE || numSegments == MAX_NONUNIFORM_SEGMENTS - 1);
+        int length = isLast ? M - offset : 2 * size;
+        if (length > M - offset)  length = M - offset;
+
+        segments[numSegments].offset = offset;
+        segments[numSegments].size   = size;
+        segments[numSegments].length = length;
+        numSegments++;
+
+        offset += length;
+        size *= 2;
+    }
+    return numSegments;
+}
+
+
+void destroyNonUniformConvolver(NonUniformConvolver* c)
+{
+    for (int j = 0; j < c->num_segments; j++) {
+        NonUniformSegment* seg = &c->segments[j];
+        pthread_mutex_lock(&seg->lock);
+        seg->quit = true;
+        pthread_cond_broadcast(&seg->changed);
+        pthread_mutex_unlock(&seg->lock);
+        pthread_join(seg->worker, NULL);
+
+        pthread_mutex_destroy(&seg->lock);
+        pthread_cond_destroy(&seg->changed);
+        destroyUniformConvolver(seg->convolver);
+        free(seg->inputs[0]); free(seg->inputs[1]); free(seg->results);
+    }
+    destroyUniformConvolver(c->head);
+    free(c);
+}
+
+
+// Background thread for one tail segment: convolves each input block handed to it, in order
+void* nonUniformSegmentWorker(void* arg)
+{
+    NonUniformSegment* seg = (NonUniformSegment*)arg;
+
+    pthread_mutex_lock(&seg->lock);
+    while (true) {
+        while (!seg->quit && seg->completed == seg->submitted)
+            pthread_cond_wait(&seg->changed, &seg->lock);
+        if (seg->quit)
+            break;
+        long job = seg->completed;
+        pthread_mutex_unlock(&seg->lock);
+
+        processUniformBlock(seg->convolver, seg->inputs[job % 2], seg->results + (job % seg->num_slots) * seg->block_size);
+
+        pthread_mutex_lock(&seg->lock);
+        seg->completed++;
+        pthread_cond_broadcast(&seg->changed);
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return NULL;
+}
+
+
+/*
+    Consumes the next block_size input samples from in[] and writes the next block_size output samples to out[].
+    Only waits for a tail segment's worker if it hasn't finished a result by the time it's due, which doesn't
+    happen unless the machine can't keep up.
+*/
+void processNonUniformBlock(NonUniformConvolver* c, float in[], float out[])
+{
+    int B = c->block_size;
+
+    processUniformBlock(c->head, in, out);
+
+    // add in each tail segment's share of this output block
+    for (int j = 0; j < c->num_segments; j++) {
+        NonUniformSegment* seg = &c->segments[j];
+        long delayed = c->time - seg->offset;  // position within this segment's own output
+        if (delayed < 0)
+            continue;
+
+        long job = delayed / seg->block_size;
+        pthread_mutex_lock(&seg->lock);
+        while (seg->completed <= job)
+            pthread_cond_wait(&seg->changed, &seg->lock);
+        pthread_mutex_unlock(&seg->lock);
+
+        float* result = seg->results + (job % seg->num_slots) * seg->block_size + delayed % seg->block_size;
+        for (int i = 0; i < B; i++)
+            out[i] += result[i];
+    }
+
+    // feed this input block to each tail segment, handing it a job whenever it has a full block
+    for (int j = 0; j < c->num_segments; j++) {
+        NonUniformSegment* seg = &c->segments[j];
+        if (seg->input_fill == 0) {  // about to reuse the input buffer of the job before last: make sure it's done
+            pthread_mutex_lock(&seg->lock);
+            while (seg->completed < seg->submitted - 1)
+                pthread_cond_wait(&seg->changed, &seg->lock);
+            pthread_mutex_unlock(&seg->lock);
+        }
+        memcpy(seg->inputs[seg->submitted % 2] + seg->input_fill, in, B * sizeof(float));
+        seg->input_fill += B;
+
+        if (seg->input_fill == seg->block_size) {
+            seg->input_fill = 0;
+            pthread_mutex_lock(&seg->lock);
+            seg->submitted++;
+            pthread_cond_broadcast(&seg->changed);
+            pthread_mutex_unlock(&seg->lock);
+        }
+    }
+    c->time += B;
+}
+
+
+// ----- ZERO-LATENCY HYBRID CONVOLUTION --------------------------------------
+/*
+    Sets up zero-latency convolution with h[] (of size M): the first crossover taps are convolved in direct
+    form (with the vector kernels of convolveDirectSIMD()) as samples arrive, and the remaining taps by a
+    NonUniformConvolver with a block size of crossover.
+
+    The tail convolver only delivers a block's output once the whole block of input has arrived, i.e.
+    crossover samples late. But since it convolves with h[crossover ..], its output is due crossover samples
+    late anyway, so adding the two together gives every output sample as soon as its input sample arrives.
+*/
+HybridConvolver* createHybridConvolver(float h[], int M, int crossover)
+{
+    HybridConvolver* c = (HybridConvolver*)malloc(sizeof(HybridConvolver));
+    int K = crossover;
+    c->crossover = K;
+    c->head_reversed = (float*)calloc(K, sizeof(float));
+    for (int m = 0; m < K && m < M; m++)
+        c->head_reversed[K - 1 - m] = h[m];
+    c->kernel = directKernelForLength(detectIsaLevel(), K);
+    c->history = (float*)calloc(2 * K, sizeof(float));
+    c->tail = (M > K) ? createNonUniformConvolver(h + K, M - K, K) : NULL;
+    c->tail_in = (float*)calloc(K, sizeof(float));
+    c->tail_out = (float*)calloc(K, sizeof(float));
+    c->fill = 0;
+    return c;
+}
+
+
+void destroyHybridConvolver(HybridConvolver* c)
+{
+    if (c->tail)  destroyNonUniformConvolver(c->tail);
+    free(c->head_reversed); free(c->history); free(c->tail_in); free(c->tail_out);
+    free(c);
+}
+
+
+/*
+    Consumes numFrames input samples from in[] and writes the corresponding numFrames output samples to out[]:
+    out[i] includes in[i] * h[0], so there is no latency. numFrames can be anything, including 1.
+*/
+void processHybrid(HybridConvolver* c, float in[], float out[], int numFrames)
+{
+    int K = c->crossover;
+
+    while (numFrames > 0) {
+        int n = K - c->fill;  // work up to the end of the current tail block
+        if (n > numFrames)  n = numFrames;
+
+        // direct-form head: the output side vector kernel, over the new samples and the K-1 before them
+        memcpy(c->history + K - 1, in, n * sizeof(float));
+        for (int i = 0; i < n; i++)
+            out[i] = c->tail_out[c->fill + i];
+        c->kernel(c->history, c->head_reversed, K, out, n);
+        memmove(c->history, c->history + n, (K - 1) * sizeof(float));
+
+        memcpy(c->tail_in + c->fill, in, n * sizeof(float));
+        c->fill += n;
+        if (c->fill == K) {
+            if (c->tail)
+                processNonUniformBlock(c->tail, c->tail_in, c->tail_out);
+            c->fill = 0;
+        }
+        in += n;  out += n;  numFrames -= n;
+    }
+}
+
+
+/*
+    Picks the number of direct-form taps that makes the hybrid engine fastest on this machine, by timing (for
+    each power of 2 from MIN_HYBRID_CROSSOVER to MAX_HYBRID_CROSSOVER) the work done in the caller's thread per
+    sample: the direct-form head plus the tail's first partitions (the rest are on background threads).
+    Direct form costs O(K) per sample, and the tail's FFTs get cheaper per sample as K grows, so the sum
+    bottoms out somewhere in the middle. Takes a few milliseconds.
+*/
+int chooseHybridCrossover(float h[], int M)
+{
+    int best = MIN_HYBRID_CROSSOVER;
+    double bestCost = 1e30;
+    int maxK = nextPowerOf2(M) < MAX_HYBRID_CROSSOVER ? nextPowerOf2(M) : MAX_HYBRID_CROSSOVER;
+    if (maxK < MIN_HYBRID_CROSSOVER)  maxK = MIN_HYBRID_CROSSOVER;
+
+    for (int K = MIN_HYBRID_CROSSOVER; K <= maxK; K *= 2) {
+        int numSamples = 4 * MAX_HYBRID_CROSSOVER;
+        float* in = (float*)calloc(numSamples + K, sizeof(float));
+        float* accumulator = (float*)calloc(numSamples, sizeof(float));
+        float* head = (float*)calloc(K, sizeof(float));
+        memcpy(head, h, (M < K ? M : K) * sizeof(float));
+        DirectKernel kernel = directKernelForLength(detectIsaLevel(), K);
+
+        double start = secondsNow();
+        for (int n = 0; n < numSamples; n += K)
+            kernel(in + n, head, K, accumulator + n, K);
+        double cost = (secondsNow() - start) / numSamples;
+
+        if (M > K) {
+            int tailLength = (M - K < 4 * K) ? M - K : 4 * K;
+            UniformConvolver* tail = createUniformConvolver(h + K, tailLength, K);
+            start = secondsNow();
+            for (int n = 0; n < numSamples; n += K)
+                processUniformBlock(tail, in + n, accumulator + n);
+            cost += (secondsNow() - start) / numSamples;
+            destroyUniformConvolver(tail);
+        }
+        if (cost < bestCost) {
+            bestCost = cost;  best = K;
+        }
+        free(in); free(accumulator); free(head);
+    }
+    return best;
+}
+
+
+// Returns a monotonic time in seconds, for timing things
+double secondsNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+// ----- MULTICHANNEL CONVOLUTION ---------------------------------------------
+/*
+    Works out which channels get convolved with which, given how many the input and the impulse response have:
+        mono impulse response:       each input channel is convolved with it (e.g. a mono room on a stereo mix)
+        the same number of channels: each input channel with its own impulse response channel
+        mono input:                  the input with each impulse response channel, one output channel each
+        stereo input, 4-channel impulse response:
+                                     true stereo: the impulse response's channels are the L->L, L->R, R->L and
+                                     R->R paths, so each output channel is the sum of both input channels,
+                                     each convolved with its own path into that output
+    Fills in *routing and returns true, or returns false for anything else (see channelsCanBeRouted()).
+*/
+bool planChannelRouting(int numInputs, int numImpulses, ChannelRouting* routing)
+{
+    ChannelRouting r = { .num_inputs = numInputs, .num_impulses = numImpulses, .num_paths = 0 };
+
+    if (!channelsCanBeRouted(numInputs, numImpulses))
+        return false;
+    if (numImpulses == 1 || numImpulses == numInputs) {
+        r.num_outputs = numInputs;
+        for (int c = 0; c < numInputs; c++)
+            r.paths[r.num_paths++] = (ChannelPath){ .input = c, .impulse = (numImpulses == 1) ? 0 : c, .output = c };
+    }
+    else if (numInputs == 1) {
+        r.num_outputs = numImpulses;
+        for (int c = 0; c < numImpulses; c++)
+            r.paths[r.num_paths++] = (ChannelPath){ .input = 0, .impulse = c, .output = c };
+    }
+    else {  // true stereo
+        r.num_outputs = 2;
+        for (int i = 0; i < 2; i++)
+            for (int o = 0; o < 2; o++)
+                r.paths[r.num_paths++] = (ChannelPath){ .input = i, .impulse = 2 * i + o, .output = o };
+    }
+    if (SHOW_DEBUG_OUTPUT && r.num_outputs > 1)
+        showMessage("\n%d-channel input, %d-channel impulse response: %d paths into %d output channels\n",
+                    numInputs, numImpulses, r.num_paths, r.num_outputs);
+    *routing = r;
+    return true;
+}
+
+
+// Whether planChannelRouting() has a way to convolve numInputs input channels with numImpulses impulse response channels
+bool channelsCanBeRouted(int numInputs, int numImpulses)
+{
+    if (numInputs < 1 || numInputs > MAX_CHANNELS || numImpulses < 1 || numImpulses > MAX_CHANNELS)
+        return false;
+    return numImpulses == 1 || numImpulses == numInputs || numInputs == 1 || (numInputs == 2 && numImpulses == 4);
+}
+
+
+// Puts n samples of each of the C channels[] together, one sample of each channel after another, in out[]
+void interleaveChannels(float* channels[], int C, int n, float out[])
+{
+    if (C == 1) {
+        memcpy(out, channels[0], n * sizeof(float));
+        return;
+    }
+    for (int i = 0; i < n; i += CHANNEL_CHUNK_SIZE) {  // a chunk at a time, so reads of each channel stay in cache
+        int end = (n - i < CHANNEL_CHUNK_SIZE) ? n : i + CHANNEL_CHUNK_SIZE;
+        for (int c = 0; c < C; c++)
+            for (int k = i; k < end; k++)
+                out[(size_t)k * C + c] = channels[c][k];
+    }
+}
+
+
+/*
+    Convolves the input channels x[] with the impulse response channels h[] along each of the routing's
+    paths (see planChannelRouting()), into the output channels y[] (P samples each).
+
+    With one of the block-streaming engines (upols, nonuniform, hybrid), all the channels are done together,
+    a block at a time (see createChannelConvolver()), so with upols each input channel's spectra are computed
+    once however many paths use them, and each output channel needs just one inverse FFT per block. The
+    threads split up the output's length between them, and each does every channel over its stretch: that
+    keeps the sharing, which giving each channel a thread of its own would lose. The other engines convolve
+    one path at a time (each one split across all the threads) and add it into its output channel.
+
+    With just the one path (mono), it's the same as runConvolutionEngine().
+*/
+void convolveChannels(Options* plan, float* x[], int N, float* h[], int M, ChannelRouting* routing, float* y[], int P)
+{
+    if (routing->num_paths == 1) {
+        runConvolutionEngine(plan, x[0], N, h[0], M, y[0], P);
+        return;
+    }
+    if (isStreamingEngine(plan->engine)) {
+        int blockSize = plan->block_size;
+        if (plan->engine == ENGINE_HYBRID) {
+            blockSize = plan->crossover ? plan->crossover : chooseHybridCrossover(h[0], M);
+            if (SHOW_DEBUG_OUTPUT && !plan->crossover)  showMessage("\nHybrid engine crossover (direct-form taps):  %d\n", blockSize);
+        }
+        ConvolutionJob job = { .N = N, .M = M, .P = P, .item_size = blockSize,
+                               .H = plan->partitions, .streaming_engine = plan->engine,
+                               .routing = routing, .x_channels = x, .h_channels = h, .y_channels = y };
+        runInParallel(&job, channelStreamingWorker, plan->threads);
+        return;
+    }
+    float* scratch = NULL;
+    bool started[MAX_CHANNELS] = { false };
+    for (int p = 0; p < routing->num_paths; p++) {
+        ChannelPath* path = &routing->paths[p];
+        float* out = y[path->output];
+        if (started[path->output]) {
+            if (!scratch)  scratch = (float*)malloc(P * sizeof(float));
+            out = scratch;
+        }
+        runConvolutionEngine(plan, x[path->input], N, h[path->impulse], M, out, P);
+        if (out == scratch)
+            for (int i = 0; i < P; i++)
+                y[path->output][i] += scratch[i];
+        started[path->output] = true;
+    }
+    free(scratch);
+}
+
+
+// Like streamingWorker(), but for all the channels of a convolveChannels() job at once
+void channelStreamingWorker(ConvolutionJob* job, int firstItem, int lastItem)
+{
+    int B = job->item_size;
+    ChannelRouting* routing = job->routing;
+    ChannelConvolver* convolver = createChannelConvolver(job->streaming_engine, job->h_channels, job->M, routing, B, job->H);
+    float* in[MAX_CHANNELS];
+    float* out[MAX_CHANNELS];
+    for (int c = 0; c < routing->num_inputs; c++)
+        in[c] = (float*)malloc(B * sizeof(float));
+    for (int c = 0; c < routing->num_outputs; c++)
+        out[c] = (float*)malloc(B * sizeof(float));
+
+    int warmUpStart = firstItem * B - (job->M - 1);
+    int firstBlock = (warmUpStart > 0) ? warmUpStart / B : 0;
+
+    for (int b = firstBlock; b < lastItem; b++) {
+        int start = b * B;
+        int inLen = (job->N - start < B) ? job->N - start : B;  // x[] runs out before y[] does
+        if (inLen < 0)  inLen = 0;
+        for (int c = 0; c < routing->num_inputs; c++) {
+            memcpy(in[c], job->x_channels[c] + start, inLen * sizeof(float));
+            memset(in[c] + inLen, 0, (B - inLen) * sizeof(float));
+        }
+        processChannelBlock(convolver, in, out);
+
+        if (b >= firstItem) {
+            int outLen = (job->P - start < B) ? job->P - start : B;
+            for (int c = 0; c < routing->num_outputs; c++)
+                memcpy(job->y_channels[c] + start, out[c], outLen * sizeof(float));
+            advanceProgress(&job->progress, 1);
+        }
+    }
+    for (int c = 0; c < routing->num_inputs; c++)  free(in[c]);
+    for (int c = 0; c < routing->num_outputs; c++)  free(out[c]);
+    destroyChannelConvolver(convolver);
+}
+
+
+/*
+    Creates a convolver that takes blockSize samples of each input channel at a time and gives back
+    blockSize samples of each output channel, convolved along the routing's paths with the impulse response
+    channels h[] (M samples each) by one of the block-streaming engines.
+
+    With upols, there's one UniformConvolver per input channel, used only for its delay line of input
+    spectra, and the partition spectra of each impulse response channel are computed once, however many
+    paths use them (or partitions can be ones already computed, each channel's after the one before, as
+    from a spectrum file or by runBatch()). Each block then costs one forward FFT per input channel, one spectral multiply-accumulate per path
+    and one inverse FFT per output channel: true stereo takes 2 + 2 FFTs a block instead of 4 + 4.
+*/
+ChannelConvolver* createChannelConvolver(EngineType engine, float* h[], int M, ChannelRouting* routing, int blockSize, Complex partitions[])
+{
+    ChannelConvolver* c = (ChannelConvolver*)calloc(1, sizeof(ChannelConvolver));
+    c->routing = *routing;
+    c->engine = engine;
+    c->block_size = blockSize;
+
+    if (engine == ENGINE_UPOLS) {
+        int numPartitions = (M + blockSize - 1) / blockSize;
+        if (numPartitions < 1)  numPartitions = 1;
+        c->owns_impulses = (partitions == NULL);
+        FftPlan* plan = createFftPlan(2 * blockSize);
+        for (int j = 0; j < routing->num_impulses; j++)
+            c->impulses[j] = partitions ? partitions + (size_t)j * numPartitions * (blockSize + 1)
+                                        : createPartitionSpectra(h[j], M, blockSize, plan);
+        destroyFftPlan(plan);
+        for (int i = 0; i < routing->num_inputs; i++)
+            c->inputs[i] = createUniformConvolverFromSpectra(c->impulses[0], numPartitions, blockSize);
+        c->accumulator = (Complex*)malloc((blockSize + 1) * sizeof(Complex));
+        c->time_scratch = (float*)malloc(2 * blockSize * sizeof(float));
+    }
+    else {
+        for (int p = 0; p < routing->num_paths; p++)
+            c->paths[p] = createStreamingConvolver(engine, h[routing->paths[p].impulse], M, blockSize, NULL);
+        c->path_out = (float*)malloc(blockSize * sizeof(float));
+    }
+    return c;
+}
+
+
+void destroyChannelConvolver(ChannelConvolver* c)
+{
+    if (c->engine == ENGINE_UPOLS) {
+        for (int i = 0; i < c->routing.num_inputs; i++)
+            destroyUniformConvolver(c->inputs[i]);
+        if (c->owns_impulses)
+            for (int j = 0; j < c->routing.num_impulses; j++)
+                free(c->impulses[j]);
+        free(c->accumulator); free(c->time_scratch);
+    }
+    else {
+        for (int p = 0; p < c->routing.num_paths; p++)
+            destroyStreamingConvolver(c->engine, c->paths[p]);
+        free(c->path_out);
+    }
+    free(c);
+}
+
+
+// Consumes the next block_size samples of each input channel from in[] and writes the next block_size
+// samples of each output channel to out[]
+void processChannelBlock(ChannelConvolver* c, float* in[], float* out[])
+{
+    ChannelRouting* routing = &c->routing;
+    int B = c->block_size;
+
+    if (c->engine == ENGINE_UPOLS) {
+        for (int i = 0; i < routing->num_inputs; i++)
+            addUniformInput(c->inputs[i], in[i]);
+        for (int o = 0; o < routing->num_outputs; o++) {
+            memset(c->accumulator, 0, (B + 1) * sizeof(Complex));
+            for (int p = 0; p < routing->num_paths; p++)
+                if (routing->paths[p].output == o)
+                    accumulateUniformOutput(c->inputs[routing->paths[p].input], c->impulses[routing->paths[p].impulse], c->accumulator);
+            inverseRealFFT(c->inputs[0]->plan, c->accumulator, c->time_scratch);
+            memcpy(out[o], c->time_scratch + B, B * sizeof(float));
+        }
+        return;
+    }
+    bool started[MAX_CHANNELS] = { false };
+    for (int p = 0; p < routing->num_paths; p++) {
+        ChannelPath* path = &routing->paths[p];
+        if (!started[path->output]) {
+            processStreamingBlock(c->engine, c->paths[p], in[path->input], out[path->output], B);
+            started[path->output] = true;
+        }
+        else {
+            processStreamingBlock(c->engine, c->paths[p], in[path->input], c->path_out, B);
+            for (int i = 0; i < B; i++)
+                out[path->output][i] += c->path_out[i];
+        }
+    }
+}
+
+
+// ----- REAL-TIME BLOCK PROCESSING -------------------------------------------
+/*
+    Creates a convolver for h[] (M samples) that can be used from an audio callback: processRealtime() takes
+    and returns any multiple of blockSize samples at a time, with no latency (a block's output is ready as
+    soon as its input is), and doesn't allocate, lock, wait or do I/O. blockSize has to be a power of 2 (a
+    callback of 480 frames can use 32, say), and neither size can be more than MAX_BLOCK_SIZE; returns NULL
+    if they aren't.
+
+    The first 2S taps of h[] (S = tailBlockSize rounded up to a power of 2, and no smaller than blockSize)
+    are done in the callback by a UniformConvolver with blockSize partitions. The rest, in S-sample
+    partitions, is done by a background thread: the callback passes it input samples through a lock-free
+    ring and wakes it with a semaphore while it has a whole block of S, and it passes its output back
+    through another ring. Since input block i (samples iS .. iS+S) is complete at time iS+S, and the tail's
+    output for it isn't needed until time iS+2S (as the tail starts 2S samples into h[]), the thread has S
+    samples' time to do each block (less a callback's worth, in practice, so S should be a few times the
+    callback size). The output ring starts with 2S samples of silence, for the times before any of the
+    tail's output is due, so it stays in step with the callback by itself.
+
+    If the thread falls behind anyway (an overloaded machine), the callback goes without the tail output it
+    doesn't have, counts the samples in late_samples, and skips them when they come. And if the input ring
+    fills up, the input that doesn't fit is counted in dropped_samples and given to the tail as silence
+    once there's room, so the tail still lines up with the head afterwards.
+
+    Everything is allocated here, and the tail thread started. See resetRealtimeConvolver() and
+    destroyRealtimeConvolver(), neither of which can be called while processRealtime() is running.
+*/
+RealtimeConvolver* createRealtimeConvolver(float h[], int M, int blockSize, int tailBlockSize)
+{
+    if (blockSize < 1 || blockSize > MAX_BLOCK_SIZE || tailBlockSize > MAX_BLOCK_SIZE || nextPowerOf2(blockSize) != blockSize)
+        return NULL;
+    RealtimeConvolver* rt = (RealtimeConvolver*)calloc(1, sizeof(RealtimeConvolver));
+    int S = (tailBlockSize > blockSize) ? nextPowerOf2(tailBlockSize) : blockSize;
+    rt->block_size = blockSize;
+    rt->tail_block_size = S;
+    rt->head = createUniformConvolver(h, (M < 2 * S) ? M : 2 * S, blockSize);
+    rt->head_in = (float*)malloc(blockSize * sizeof(float));
+    rt->tail_block = (float*)malloc(blockSize * sizeof(float));
+    rt->silence = (float*)calloc(blockSize, sizeof(float));
+    if (M > 2 * S) {
+        rt->tail = createUniformConvolver(h + 2 * S, M - 2 * S, S);
+        rt->tail_in = (float*)malloc(S * sizeof(float));
+        rt->tail_out = (float*)malloc(S * sizeof(float));
+        initSampleRing(&rt->to_tail, 8 * S);
+        initSampleRing(&rt->from_tail, 8 * S);
+        sem_init(&rt->tail_wake, 0, 0);
+    }
+    clearRealtimeState(rt);
+    if (rt->tail)
+        startRealtimeTail(rt);
+    return rt;
+}
+
+
+/*
+    Convolves the next frames samples of in[] into out[] (which can be the same array). frames must be a
+    multiple of the block size; if it isn't, nothing is done and false is returned. Real-time safe.
+*/
+bool processRealtime(RealtimeConvolver* rt, const float in[], float out[], int frames)
+{
+    int B = rt->block_size, S = rt->tail_block_size;
+    if (frames % B != 0)
+        return false;
+
+    for (int i = 0; i < frames; i += B) {
+        if (rt->tail) {  // hand the input to the tail thread first, so it can start on a finished block right away
+            while (rt->input_owed > 0 && sampleRingSpace(&rt->to_tail) > 0) {  // (silence in place of input it missed)
+                long space = sampleRingSpace(&rt->to_tail);
+                int n = (rt->input_owed < B) ? rt->input_owed : B;
+                if (n > space)  n = space;
+                writeSampleRing(&rt->to_tail, rt->silence, n);
+                rt->input_owed -= n;
+            }
+            if (rt->input_owed == 0 && sampleRingSpace(&rt->to_tail) >= B)
+                writeSampleRing(&rt->to_tail, in + i, B);
+            else {
+                rt->input_owed += B;
+                atomic_fetch_add(&rt->dropped_samples, B);
+            }
+            int pending;  // (woken whenever there's a block for it, not just when one is finished: it may have
+                          // gone back to sleep with blocks left over, for want of room for their output)
+            if (sampleRingAvailable(&rt->to_tail) >= S && sem_getvalue(&rt->tail_wake, &pending) == 0 && pending == 0)
+                sem_post(&rt->tail_wake);
+        }
+        memcpy(rt->head_in, in + i, B * sizeof(float));  // (in[] and out[] can be the same array)
+        processUniformBlock(rt->head, rt->head_in, out + i);
+
+        if (rt->tail) {
+            long available = sampleRingAvailable(&rt->from_tail);
+            while (rt->tail_owed > 0 && available > 0) {  // (late output from earlier calls, whose time has gone)
+                int skip = (rt->tail_owed < B) ? rt->tail_owed : B;
+                if (skip > available)  skip = available;
+                readSampleRing(&rt->from_tail, rt->tail_block, skip);
+                rt->tail_owed -= skip;  available -= skip;
+            }
+            int ready = (available < B) ? available : B;
+            readSampleRing(&rt->from_tail, rt->tail_block, ready);
+            for (int k = 0; k < ready; k++)
+                out[i + k] += rt->tail_block[k];
+            if (ready < B) {
+                rt->tail_owed += B - ready;
+                atomic_fetch_add(&rt->late_samples, B - ready);
+            }
+        }
+    }
+    return true;
+}
+
+
+// Clears all input history, as if the convolver had only ever been fed silence. Not real-time safe (it restarts the tail thread).
+void resetRealtimeConvolver(RealtimeConvolver* rt)
+{
+    if (rt->tail)
+        stopRealtimeTail(rt);
+    clearRealtimeState(rt);
+    if (rt->tail)
+        startRealtimeTail(rt);
+}
+
+
+// Puts the convolver (with its tail thread stopped) back in its starting state
+void clearRealtimeState(RealtimeConvolver* rt)
+{
+    resetUniformConvolver(rt->head);
+    atomic_store(&rt->late_samples, 0);
+    atomic_store(&rt->dropped_samples, 0);
+    if (rt->tail) {
+        resetUniformConvolver(rt->tail);
+        clearSampleRing(&rt->to_tail);
+        clearSampleRing(&rt->from_tail);
+        float silence[1024] = { 0.0f };
+        for (int n = 0; n < 2 * rt->tail_block_size; n += 1024)  // (the tail's output is 2S behind: see above)
+            writeSampleRing(&rt->from_tail, silence, (2 * rt->tail_block_size - n < 1024) ? 2 * rt->tail_block_size - n : 1024);
+        rt->tail_owed = 0;
+        rt->input_owed = 0;
+        while (sem_trywait(&rt->tail_wake) == 0)
+            ;
+    }
+}
+
+
+void destroyRealtimeConvolver(RealtimeConvolver* rt)
+{
+    if (rt->tail) {
+        stopRealtimeTail(rt);
+        destroyUniformConvolver(rt->tail);
+        sem_destroy(&rt->tail_wake);
+        free(rt->to_tail.samples); free(rt->from_tail.samples); free(rt->tail_in); free(rt->tail_out);
+    }
+    destroyUniformConvolver(rt->head);
+    free(rt->head_in); free(rt->tail_block); free(rt->silence);
+    free(rt);
+}
+
+
+void startRealtimeTail(RealtimeConvolver* rt)
+{
+    atomic_store(&rt->quit, false);
+    pthread_create(&rt->tail_thread, NULL, realtimeTailThread, rt);
+}
+
+
+void stopRealtimeTail(RealtimeConvolver* rt)
+{
+    atomic_store(&rt->quit, true);
+    sem_post(&rt->tail_wake);
+    pthread_join(rt->tail_thread, NULL);
+}
+
+
+// The tail thread: convolves each block of S input samples from the callback with the tail of h[], and passes the result back
+void* realtimeTailThread(void* arg)
+{
+    RealtimeConvolver* rt = (RealtimeConvolver*)arg;
+    int S = rt->tail_block_size;
+
+    for (;;) {
+        sem_wait(&rt->tail_wake);
+        if (atomic_load(&rt->quit))
+            break;
+        while (sampleRingAvailable(&rt->to_tail) >= S && sampleRingSpace(&rt->from_tail) >= S) {
+            readSampleRing(&rt->to_tail, rt->tail_in, S);
+            processUniformBlock(rt->tail, rt->tail_in, rt->tail_out);
+            writeSampleRing(&rt->from_tail, rt->tail_out, S);
+        }
+    }
+    return NULL;
+}
+
+
+// Allocates an empty ring with room for at least capacity samples (rounded up to a power of 2, for the indexing)
+void initSampleRing(SampleRing* ring, int capacity)
+{
+    capacity = nextPowerOf2(capacity);
+    ring->samples = (float*)malloc(capacity * sizeof(float));
+    ring->capacity = capacity;
+    clearSampleRing(ring);
+}
+
+
+// Empties the ring. Neither of its threads can be using it.
+void clearSampleRing(SampleRing* ring)
+{
+    atomic_store(&ring->written, 0);
+    atomic_store(&ring->read, 0);
+}
+
+
+// Number of samples the consumer can read
+long sampleRingAvailable(SampleRing* ring)
+{
+    return atomic_load_explicit(&ring->written, memory_order_acquire) - atomic_load_explicit(&ring->read, memory_order_relaxed);
+}
+
+
+// Number of samples the producer can write
+long sampleRingSpace(SampleRing* ring)
+{
+    return ring->capacity - (atomic_load_explicit(&ring->written, memory_order_relaxed) - atomic_load_explicit(&ring->read, memory_order_acquire));
+}
+
+
+/*
+    Producer: adds n samples (no more than sampleRingSpace()) to the ring. The samples are copied in before
+    the count is published (release), so the consumer never sees a count that includes samples not yet there.
+*/
+void writeSampleRing(SampleRing* ring, const float samples[], int n)
+{
+    long written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    int start = written & (ring->capacity - 1);
+    int first = (n < ring->capacity - start) ? n : ring->capacity - start;
+    memcpy(ring->samples + start, samples, first * sizeof(float));
+    memcpy(ring->samples, samples + first, (n - first) * sizeof(float));
+    atomic_store_explicit(&ring->written, written + n, memory_order_release);
+}
+
+
+// Consumer: takes n samples (no more than sampleRingAvailable()) from the ring, then hands their space back (release)
+void readSampleRing(SampleRing* ring, float samples[], int n)
+{
+    long read = atomic_load_explicit(&ring->read, memory_order_relaxed);
+    int start = read & (ring->capacity - 1);
+    int first = (n < ring->capacity - start) ? n : ring->capacity - start;
+    memcpy(samples, ring->samples + start, first * sizeof(float));
+    memcpy(samples + first, ring->samples, (n - first) * sizeof(float));
+    atomic_store_explicit(&ring->read, read + n, memory_order_release);
+}
+
+
+/*
+    Creates a convolver like createRealtimeConvolver() (which see), whose impulse response can be changed with
+    swapImpulseResponse() while processHotSwap() is being called, without stopping it and without a glitch.
+    The new impulse response is copied, and its convolver created and its partitions transformed, on a swap
+    thread; the callback picks it up at the start of its next block, and for the next crossfade samples feeds
+    the input to both convolvers, fading the old one's output out and the new one's in. The gains are
+    equal-power (sine and cosine), as the two rooms' reverb is uncorrelated; they're worked out here, so the
+    callback doesn't have to. The new convolver starts with no input history, so its reverb builds up from
+    the swap on, while the old one's dies away under the crossfade.
+
+    The callback doesn't allocate, free, lock or wait: convolvers are passed between it and the swap thread
+    by atomic pointer exchanges, and the old convolver is handed back to the swap thread to be destroyed.
+    Returns NULL if the block sizes aren't allowed (see createRealtimeConvolver()).
+*/
+HotSwapConvolver* createHotSwapConvolver(float h[], int M, int blockSize, int tailBlockSize, int crossfade)
+{
+    RealtimeConvolver* first = createRealtimeConvolver(h, M, blockSize, tailBlockSize);
+    if (!first)
+        return NULL;
+    HotSwapConvolver* hs = (HotSwapConvolver*)calloc(1, sizeof(HotSwapConvolver));
+    hs->current = first;
+    hs->block_size = blockSize;
+    hs->tail_block_size = hs->current->tail_block_size;
+    hs->crossfade = crossfade;
+    hs->fade_gains = (float*)malloc((crossfade + 1) * sizeof(float));
+    for (int t = 0; t < crossfade; t++)
+        hs->fade_gains[t] = sin(M_PI / 2 * (t + 0.5) / crossfade);
+    hs->block_in = (float*)malloc(blockSize * sizeof(float));
+    hs->fade_out = (float*)malloc(blockSize * sizeof(float));
+    atomic_init(&hs->incoming, NULL);
+    atomic_init(&hs->retired, NULL);
+    atomic_init(&hs->swaps, 0);
+    pthread_mutex_init(&hs->lock, NULL);
+    pthread_condattr_t monotonic;  // (for the swap thread's timed waits, which go by secondsNow())
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&hs->changed, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+    pthread_create(&hs->swap_thread, NULL, hotSwapThread, hs);
+    return hs;
+}
+
+
+/*
+    Convolves the next frames samples of in[] into out[] (which can be the same array), as processRealtime()
+    does, starting a swap to a newly loaded impulse response if there is one (and no crossfade is already
+    going on). Real-time safe.
+*/
+bool processHotSwap(HotSwapConvolver* hs, const float in[], float out[], int frames)
+{
+    int B = hs->block_size, F = hs->crossfade;
+    if (frames % B != 0)
+        return false;
+
+    for (int i = 0; i < frames; i += B) {
+        if (hs->fading && hs->faded >= F) {  // done with the old one: hand it back (or try again next block)
+            RealtimeConvolver* none = NULL;
+            if (atomic_compare_exchange_strong(&hs->retired, &none, hs->fading))
+                hs->fading = NULL;
+        }
+        if (!hs->fading && atomic_load_explicit(&hs->incoming, memory_order_relaxed)) {
+            hs->fading = hs->current;
+            hs->current = atomic_exchange(&hs->incoming, NULL);
+            hs->faded = 0;
+            atomic_fetch_add(&hs->swaps, 1);
+        }
+        if (!hs->fading || hs->faded >= F) {
+            processRealtime(hs->current, in + i, out + i, B);
+            continue;
+        }
+        memcpy(hs->block_in, in + i, B * sizeof(float));  // (in[] and out[] can be the same array)
+        processRealtime(hs->fading, hs->block_in, hs->fade_out, B);
+        processRealtime(hs->current, hs->block_in, out + i, B);
+        for (int k = 0; k < B && hs->faded + k < F; k++) {
+            int t = hs->faded + k;
+            out[i + k] = out[i + k] * hs->fade_gains[t] + hs->fade_out[k] * hs->fade_gains[F - 1 - t];
+        }
+        hs->faded += B;
+    }
+    return true;
+}
+
+
+/*
+    Has the swap thread load h[] (M samples, copied, so it can be freed as soon as this returns) and hand it
+    to the callback. Not real-time safe, but quick: it doesn't wait for the load. If another swap is asked for
+    before the callback has picked this one up, the newer one replaces it.
+*/
+void swapImpulseResponse(HotSwapConvolver* hs, float h[], int M)
+{
+    float* copy = (float*)malloc(M * sizeof(float));
+    memcpy(copy, h, M * sizeof(float));
+    pthread_mutex_lock(&hs->lock);
+    free(hs->request);
+    hs->request = copy;
+    hs->request_length = M;
+    pthread_cond_signal(&hs->changed);
+    pthread_mutex_unlock(&hs->lock);
+}
+
+
+void destroyHotSwapConvolver(HotSwapConvolver* hs)
+{
+    pthread_mutex_lock(&hs->lock);
+    hs->quit = true;
+    pthread_cond_signal(&hs->changed);
+    pthread_mutex_unlock(&hs->lock);
+    pthread_join(hs->swap_thread, NULL);
+
+    RealtimeConvolver* left[4] = { hs->current, hs->fading, atomic_load(&hs->incoming), atomic_load(&hs->retired) };
+    for (int i = 0; i < 4; i++)
+        if (left[i])  destroyRealtimeConvolver(left[i]);
+    free(hs->request); free(hs->fade_gains); free(hs->block_in); free(hs->fade_out);
+    pthread_mutex_destroy(&hs->lock);
+    pthread_cond_destroy(&hs->changed);
+    free(hs);
+}
+
+
+/*
+    The swap thread: loads each impulse response asked for into a new RealtimeConvolver and puts it where the
+    callback will pick it up, and destroys the convolvers the callback has finished with. Checks for those
+    every 10 ms, as the callback can't signal it.
+*/
+void* hotSwapThread(void* arg)
+{
+    HotSwapConvolver* hs = (HotSwapConvolver*)arg;
+
+    pthread_mutex_lock(&hs->lock);
+    while (!hs->quit) {
+        RealtimeConvolver* old = atomic_exchange(&hs->retired, NULL);
+        float* h = hs->request;
+        int M = hs->request_length;
+        hs->request = NULL;
+        pthread_mutex_unlock(&hs->lock);
+
+        if (old)
+            destroyRealtimeConvolver(old);
+        if (h) {
+            RealtimeConvolver* loaded = createRealtimeConvolver(h, M, hs->block_size, hs->tail_block_size);
+            free(h);
+            RealtimeConvolver* displaced = atomic_exchange(&hs->incoming, loaded);
+            if (displaced)  // (a newer one came along before the callback picked that one up)
+                destroyRealtimeConvolver(displaced);
+        }
+
+        pthread_mutex_lock(&hs->lock);
+        if (!hs->request && !hs->quit) {
+            double due = secondsNow() + 0.01;
+            struct timespec wait = { .tv_sec = (time_t)due, .tv_nsec = (long)((due - (time_t)due) * 1e9) };
+            pthread_cond_timedwait(&hs->changed, &hs->lock, &wait);
+        }
+    }
+    pthread_mutex_unlock(&hs->lock);
+    return NULL;
+}
+
+
+// ----- VECTOR DIRECT-FORM KERNELS -------------------------------------------
+// Returns the most capable instruction set level (that there are kernels for) supported by this CPU
+IsaLevel detectIsaLevel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))  return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))  return ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))  return ISA_SSE;
+#endif
+    return ISA_SCALAR;
+}
+
+
+const char* isaName(IsaLevel isa)
+{
+    switch (isa) {
+        case ISA_SCALAR:  return "scalar";
+        case ISA_SSE:     return "sse";
+        case ISA_AVX2:    return "avx2";
+        case ISA_AVX512:  return "avx512";
+        default:          return "auto";
+    }
+}
+
+
+// Note: only pass an isa the CPU supports (see detectIsaLevel())
+DirectKernel directKernelFor(IsaLevel isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (isa == ISA_AVX512)  return directKernelAVX512;
+    if (isa == ISA_AVX2)    return directKernelAVX2;
+    if (isa == ISA_SSE)     return directKernelSSE;
+#endif
+    return directKernelScalar;
+}
+
+
+/*
+    The kernels all compute y[p] += sum over k of hr[k] * xp[p + k] for p = 0..count-1, where hr[] is h[]
+    reversed (of size M) and xp[] has count + M - 1 samples. (They add to y[] rather than overwriting it so
+    that a long h[] can be done a piece at a time: see convolveOutputSideBlocked().) They differ only in how many outputs they keep
+    in registers at once; whatever doesn't fill a whole vector block is handed down to the scalar kernel.
+*/
+void directKernelScalar(const float* xp, const float* hr, int M, float* y, int count)
+{
+    int p = 0;
+    for (; p + 4 <= count; p += 4) {
+        float s0 = y[p], s1 = y[p+1], s2 = y[p+2], s3 = y[p+3];
+        for (int k = 0; k < M; k++) {
+            const float* xk = xp + p + k;
+            s0 += hr[k] * xk[0];  s1 += hr[k] * xk[1];  s2 += hr[k] * xk[2];  s3 += hr[k] * xk[3];
+        }
+        y[p] = s0;  y[p+1] = s1;  y[p+2] = s2;  y[p+3] = s3;
+    }
+    for (; p < count; p++) {
+        float sum = y[p];
+        for (int k = 0; k < M; k++)
+            sum += hr[k] * xp[p + k];
+        y[p] = sum;
+    }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void directKernelSSE(const float* xp, const float* hr, int M, float* y, int count)
+{
+    int p = 0;
+    for (; p + 16 <= count; p += 16) {
+        __m128 a0 = _mm_loadu_ps(y + p), a1 = _mm_loadu_ps(y + p + 4), a2 = _mm_loadu_ps(y + p + 8), a3 = _mm_loadu_ps(y + p + 12);
+        for (int k = 0; k < M; k++) {
+            __m128 hk = _mm_set1_ps(hr[k]);
+            const float* xk = xp + p + k;
+            a0 = _mm_add_ps(a0, _mm_mul_ps(hk, _mm_loadu_ps(xk)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(hk, _mm_loadu_ps(xk + 4)));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(hk, _mm_loadu_ps(xk + 8)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(hk, _mm_loadu_ps(xk + 12)));
+        }
+        _mm_storeu_ps(y + p, a0);  _mm_storeu_ps(y + p + 4, a1);
+        _mm_storeu_ps(y + p + 8, a2);  _mm_storeu_ps(y + p + 12, a3);
+    }
+    directKernelScalar(xp + p, hr, M, y + p, count - p);
+}
+
+
+__attribute__((target("avx2,fma")))
+void directKernelAVX2(const float* xp, const float* hr, int M, float* y, int count)
+{
+    int p = 0;
+    for (; p + 32 <= count; p += 32) {
+        __m256 a0 = _mm256_loadu_ps(y + p),      a1 = _mm256_loadu_ps(y + p + 8);
+        __m256 a2 = _mm256_loadu_ps(y + p + 16), a3 = _mm256_loadu_ps(y + p + 24);
+        for (int k = 0; k < M; k++) {
+            __m256 hk = _mm256_broadcast_ss(hr + k);
+            const float* xk = xp + p + k;
+            a0 = _mm256_fmadd_ps(hk, _mm256_loadu_ps(xk), a0);
+            a1 = _mm256_fmadd_ps(hk, _mm256_loadu_ps(xk + 8), a1);
+            a2 = _mm256_fmadd_ps(hk, _mm256_loadu_ps(xk + 16), a2);
+            a3 = _mm256_fmadd_ps(hk, _mm256_loadu_ps(xk + 24), a3);
+        }
+        _mm256_storeu_ps(y + p, a0);  _mm256_storeu_ps(y + p + 8, a1);
+        _mm256_storeu_ps(y + p + 16, a2);  _mm256_storeu_ps(y + p + 24, a3);
+    }
+    for (; p + 8 <= count; p += 8) {
+        __m256 a0 = _mm256_loadu_ps(y + p);
+        for (int k = 0; k < M; k++)
+            a0 = _mm256_fmadd_ps(_mm256_broadcast_ss(hr + k), _mm256_loadu_ps(xp + p + k), a0);
+        _mm256_storeu_ps(y + p, a0);
+    }
+    directKernelScalar(xp + p, hr, M, y + p, count - p);
+}
+
+
+__attribute__((target("avx512f")))
+void directKernelAVX512(const float* xp, const float* hr, int M, float* y, int count)
+{
+    int p = 0;
+    for (; p + 64 <= count; p += 64) {
+        __m512 a0 = _mm512_loadu_ps(y + p),      a1 = _mm512_loadu_ps(y + p + 16);
+        __m512 a2 = _mm512_loadu_ps(y + p + 32), a3 = _mm512_loadu_ps(y + p + 48);
+        for (int k = 0; k < M; k++) {
+            __m512 hk = _mm512_set1_ps(hr[k]);
+            const float* xk = xp + p + k;
+            a0 = _mm512_fmadd_ps(hk, _mm512_loadu_ps(xk), a0);
+            a1 = _mm512_fmadd_ps(hk, _mm512_loadu_ps(xk + 16), a1);
+            a2 = _mm512_fmadd_ps(hk, _mm512_loadu_ps(xk + 32), a2);
+            a3 = _mm512_fmadd_ps(hk, _mm512_loadu_ps(xk + 48), a3);
+        }
+        _mm512_storeu_ps(y + p, a0);  _mm512_storeu_ps(y + p + 16, a1);
+        _mm512_storeu_ps(y + p + 32, a2);  _mm512_storeu_ps(y + p + 48, a3);
+    }
+    for (; p + 16 <= count; p += 16) {
+        __m512 a0 = _mm512_loadu_ps(y + p);
+        for (int k = 0; k < M; k++)
+            a0 = _mm512_fmadd_ps(_mm512_set1_ps(hr[k]), _mm512_loadu_ps(xp + p + k), a0);
+        _mm512_storeu_ps(y + p, a0);
+    }
+    directKernelScalar(xp + p, hr, M, y + p, count - p);
+}
+
+
+/*
+    AVX-512 kernels for h[] of a fixed length (the common cabinet sim lengths: see FIXED_LENGTH_KERNELS),
+    which give the same y[] as directKernelAVX512() but don't load the x[] samples for each tap over again:
+    x[] is loaded 16 samples at a time, once per 16 taps, and the 16 shifted copies of it the taps need
+    are made in registers (valignd). The shift counts have to be compile-time constants, so the taps are
+    written out 16 at a time, and knowing the length at compile time means every 16 of them is a whole
+    group. About 10% faster. Called with any other number of taps (as at the ends of x[]), or for the
+    last few outputs, they hand down to directKernelAVX512().
+*/
+#define SHIFTED_DOWN(hi, lo, j)  _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(hi), _mm512_castps_si512(lo), j))
+
+#define FIXED_LENGTH_TAP(j)                                                                                 \
+    {                                                                                                       \
+        __m512 hk = _mm512_set1_ps(hr[k + j]);                                                              \
+        a0 = _mm512_fmadd_ps(hk, SHIFTED_DOWN(x1, x0, j), a0);                                              \
+        a1 = _mm512_fmadd_ps(hk, SHIFTED_DOWN(x2, x1, j), a1);                                              \
+        a2 = _mm512_fmadd_ps(hk, SHIFTED_DOWN(x3, x2, j), a2);                                              \
+        a3 = _mm512_fmadd_ps(hk, SHIFTED_DOWN(x4, x3, j), a3);                                              \
+    }
+
+#define DEFINE_FIXED_LENGTH_KERNEL(LENGTH)                                                                  \
+__attribute__((target("avx512f")))                                                                         \
+void directKernelAVX512Taps##LENGTH(const float* xp, const float* hr, int M, float* y, int count)           \
+{                                                                                                           \
+    if (M != LENGTH) {                                                                                      \
+        directKernelAVX512(xp, hr, M, y, count);                                                            \
+        return;                                                                                             \
+    }                                                                                                       \
+    int p = 0;                                                                                              \
+    for (; p + 64 <= count; p += 64) {                                                                      \
+        __m512 a0 = _mm512_loadu_ps(y + p),      a1 = _mm512_loadu_ps(y + p + 16);                          \
+        __m512 a2 = _mm512_loadu_ps(y + p + 32), a3 = _mm512_loadu_ps(y + p + 48);                          \
+        for (int k = 0; k < LENGTH; k += 16) {                                                              \
+            const float* xk = xp + p + k;                                                                   \
+            __m512 x0 = _mm512_loadu_ps(xk),      x1 = _mm512_loadu_ps(xk + 16);                            \
+            __m512 x2 = _mm512_loadu_ps(xk + 32), x3 = _mm512_loadu_ps(xk + 48);                            \
+            __m512 x4 = _mm512_maskz_loadu_ps(0x7FFF, xk + 64);  /* (its last sample is past the end of xp[]) */ \
+            FIXED_LENGTH_TAP(0)   FIXED_LENGTH_TAP(1)   FIXED_LENGTH_TAP(2)   FIXED_LENGTH_TAP(3)           \
+            FIXED_LENGTH_TAP(4)   FIXED_LENGTH_TAP(5)   FIXED_LENGTH_TAP(6)   FIXED_LENGTH_TAP(7)           \
+            FIXED_LENGTH_TAP(8)   FIXED_LENGTH_TAP(9)   FIXED_LENGTH_TAP(10)  FIXED_LENGTH_TAP(11)          \
+            FIXED_LENGTH_TAP(12)  FIXED_LENGTH_TAP(13)  FIXED_LENGTH_TAP(14)  FIXED_LENGTH_TAP(15)          \
+        }                                                                                                   \
+        _mm512_storeu_ps(y + p, a0);  _mm512_storeu_ps(y + p + 16, a1);                                     \
+        _mm512_storeu_ps(y + p + 32, a2);  _mm512_storeu_ps(y + p + 48, a3);                                \
+    }                                                                                                       \
+    directKernelAVX512(xp + p, hr, M, y + p, count - p);                                                    \
+}
+
+DEFINE_FIXED_LENGTH_KERNEL(64)
+DEFINE_FIXED_LENGTH_KERNEL(128)
+DEFINE_FIXED_LENGTH_KERNEL(256)
+DEFINE_FIXED_LENGTH_KERNEL(512)
+
+
+// the kernels for fixed lengths of h[], looked up by directKernelForLength()
+const FixedLengthKernel FIXED_LENGTH_KERNELS[] = {
+    { ISA_AVX512,   64, directKernelAVX512Taps64 },
+    { ISA_AVX512,  128, directKernelAVX512Taps128 },
+    { ISA_AVX512,  256, directKernelAVX512Taps256 },
+    { ISA_AVX512,  512, directKernelAVX512Taps512 }
+};
+#endif
+
+
+/*
+    Returns the kernel to use for an h[] of M taps: one written for that length if there is one for isa
+    (see FIXED_LENGTH_KERNELS), or the general one otherwise. Only pass an isa the CPU supports.
+*/
+DirectKernel directKernelForLength(IsaLevel isa, int M)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    for (size_t i = 0; i < sizeof(FIXED_LENGTH_KERNELS) / sizeof(FIXED_LENGTH_KERNELS[0]); i++)
+        if (FIXED_LENGTH_KERNELS[i].isa == isa && FIXED_LENGTH_KERNELS[i].length == M)
+            return FIXED_LENGTH_KERNELS[i].kernel;
+#endif
+    return directKernelFor(isa);
+}
+
+
+// ----- TYPED DIRECT-FORM CONVOLUTION ----------------------------------------
+// turns a sum back into a sample: as it is, or rounded and saturated from Q30 (the product of two Q15s) to Q15
+#define STORE_FLOAT(sum)   ((float)(sum))
+#define STORE_DOUBLE(sum)  (sum)
+#define STORE_Q15(sum)     saturateToInt16(((sum) + (1 << 14)) >> 15)
+
+DEFINE_TYPED_CONVOLUTION(convolveTypedFloat, float, float, STORE_FLOAT)
+DEFINE_TYPED_CONVOLUTION(convolveTypedFloatDouble, float, double, STORE_FLOAT)
+DEFINE_TYPED_CONVOLUTION(convolveTypedDouble, double, double, STORE_DOUBLE)
+DEFINE_TYPED_CONVOLUTION(convolveTypedInt16, int16_t, int32_t, STORE_Q15)
+
+
+/*
+    Runs the direct engine with the sample and accumulator types precision asks for (see Precision), on
+    float x[] and h[], giving float y[]: the float/float instance by default, which gives exactly the same
+    y[] as convolve(), only faster. For double or 16-bit storage, x[] and h[] are converted on the way in,
+    and y[] on the way out.
+
+    16-bit: the samples are Q15 fixed point, with 32-bit accumulators. x[] is scaled to full scale first,
+    and h[] so that the sum of its magnitudes is 1 (its taps being truncated, rather than rounded, so that
+    they can't add up to more): then no sum of products can overflow an accumulator, and every output fits
+    in 16 bits. y[] is scaled back afterwards. That is only any good for short impulse responses: the SNR
+    against the float result is about 75 dB for 16 taps, and falls by about 6 dB each time h[] doubles in
+    length (57 dB for 128 taps, 46 dB for 512), as its taps and the output get less of the 16 bits.
+*/
+void convolveDirectTyped(Precision precision, float x[], int N, float h[], int M, float y[], int P, int numThreads)
+{
+    switch (precision) {
+        case PRECISION_FLOAT_DOUBLE:
+            convolveTypedFloatDouble(x, N, h, M, y, P, numThreads);
+            break;
+        case PRECISION_DOUBLE: {
+            double* xd = (double*)malloc(N * sizeof(double));
+            double* hd = (double*)malloc(M * sizeof(double));
+            double* yd = (double*)malloc(P * sizeof(double));
+            for (int n = 0; n < N; n++)  xd[n] = x[n];
+            for (int m = 0; m < M; m++)  hd[m] = h[m];
+            convolveTypedDouble(xd, N, hd, M, yd, P, numThreads);
+            for (int p = 0; p < P; p++)  y[p] = (float)yd[p];
+            free(xd); free(hd); free(yd);
+            break;
+        }
+        case PRECISION_INT16: {
+            double largestInput = 0.0, sumOfMagnitudes = 0.0;
+            for (int n = 0; n < N; n++)
+                largestInput = fmax(largestInput, fabs(x[n]));
+            for (int m = 0; m < M; m++)
+                sumOfMagnitudes += fabs(h[m]);
+            double xScale = (largestInput > 0.0) ? 1.0 / largestInput : 1.0;
+            double hScale = (sumOfMagnitudes > 0.0) ? 1.0 / sumOfMagnitudes : 1.0;
+            int16_t* xq = (int16_t*)malloc(N * sizeof(int16_t));
+            int16_t* hq = (int16_t*)malloc(M * sizeof(int16_t));
+            int16_t* yq = (int16_t*)malloc(P * sizeof(int16_t));
+            for (int n = 0; n < N; n++)
+                xq[n] = saturateToInt16(lrint(x[n] * xScale * 32768.0));
+            for (int m = 0; m < M; m++)
+                hq[m] = saturateToInt16((long)(h[m] * hScale * 32768.0));
+            convolveTypedInt16(xq, N, hq, M, yq, P, numThreads);
+            for (int p = 0; p < P; p++)
+                y[p] = (float)(yq[p] / (32768.0 * xScale * hScale));
+            free(xq); free(hq); free(yq);
+            break;
+        }
+        case PRECISION_FLOAT:
+        default:
+            convolveTypedFloat(x, N, h, M, y, P, numThreads);
+            break;
+    }
+}
+
+
+// Clamps a sum to the range of a 16-bit sample
+int16_t saturateToInt16(long sum)
+{
+    return (int16_t)((sum > 32767) ? 32767 : (sum < -32768) ? -32768 : sum);
+}
+
+
+// ----- ENGINE PLANNER -------------------------------------------------------
+// Returns the name used on the command line for the given engine
+const char* engineName(EngineType engine)
+{
+    switch (engine) {
+        case ENGINE_DIRECT:      return "direct";
+        case ENGINE_SIMD:        return "simd";
+        case ENGINE_BLOCKED:     return "blocked";
+        case ENGINE_FFT:         return "fft";
+        case ENGINE_UPOLS:       return "upols";
+        case ENGINE_NONUNIFORM:  return "nonuniform";
+        case ENGINE_HYBRID:      return "hybrid";
+        default:                 return "auto";
+    }
+}
+
+
+/*
+    Picks the engine (and its settings) that should convolve an N-sample input with an M-sample impulse
+    response fastest with the requested number of threads, and returns options with those filled in. If an
+    engine was asked for on the command line, the options are returned as they are.
+
+    Each engine's run time is estimated from a simple model of the work it does, in terms of the operations
+    in MachineCosts: direct form is N*M multiply-adds; FFT engines are FFTs plus spectral multiply-accumulates
+    per block, for each candidate FFT/block size. The machine costs come from the wisdom file if there is one
+    for this CPU's instruction set (run once with --calibrate to make it), or built-in defaults otherwise.
+    Candidates with more latency than --max-latency allows are skipped.
+*/
+Options planConvolution(Options* requested, int N, int M)
+{
+    Options best = *requested;
+    if (requested->engine != ENGINE_AUTO)
+        return best;
+
+    // built-in defaults: measured on a ~3 GHz AVX-512 server core
+    MachineCosts costs = { 3.8e-11, 6.5e-10, 2.5e-9, 1.0e-7 };
+    if (requested->calibrate) {
+        measureMachineCosts(&costs);
+        saveWisdom(requested->wisdom_file, &costs);
+    }
+    else if (!loadWisdom(requested->wisdom_file, &costs) && SHOW_DEBUG_OUTPUT)
+        showMessage("\nPlanner: no wisdom file for this machine (make one with --calibrate), using default costs\n");
+
+    int P = N + M - 1, T = requested->stream ? 1 : requested->threads;  // streaming is one block after another
+    Options candidates[ENGINE_AUTO];  // best setup found for each engine, and its estimated time
+    double times[ENGINE_AUTO];
+    for (int e = 0; e < ENGINE_AUTO; e++)
+        times[e] = -1.0;
+
+    // direct form, with the vector kernels (blocked once h[] is longer than one tap tile)
+    EngineType directEngine = (M > TAP_TILE_SIZE) ? ENGINE_BLOCKED : ENGINE_SIMD;
+    considerEngine(candidates, times, requested, directEngine, (double)N * M * costs.direct_mac / T, 0, 0, 0, 0);
+
+    // single FFT: one transform covering the whole output
+    int singleSize = nextPowerOf2(P + 1);
+    double singleTime = 3 * fftCost(&costs, singleSize) + (singleSize / 2) * costs.spectral_mac;
+    considerEngine(candidates, times, requested, ENGINE_FFT, singleTime, N, singleSize, 0, 0);
+
+    // overlap-add, for each FFT size that leaves room for a decent block of input
+    for (int size = nextPowerOf2(2 * M); size < singleSize && size <= (1 << 24); size *= 2) {
+        int L = size - M + 1;
+        int blocksPerThread = (P / L + T - 1) / T + (size + L - 1) / L;  // boundary blocks get done twice
+        double blockTime = 2 * fftCost(&costs, size) + (size / 2) * costs.spectral_mac + costs.block_overhead;
+        considerEngine(candidates, times, requested, ENGINE_FFT, fftCost(&costs, size) + blocksPerThread * blockTime, L, size, 0, 0);
+    }
+
+    // the block-streaming engines, for each block size. With several threads, each has M-1 samples to warm up.
+    double samplesPerThread = (double)P / T + (T > 1 ? M : 0);
+    for (int B = 32; B <= 65536 && B / 2 < P; B *= 2) {
+        considerEngine(candidates, times, requested, ENGINE_UPOLS, samplesPerThread / B * uniformBlockCost(&costs, B, M), B, 0, B, 0);
+        considerEngine(candidates, times, requested, ENGINE_NONUNIFORM, samplesPerThread * nonUniformCostPerSample(&costs, B, M), B, 0, B, 0);
+
+        if (B <= MAX_HYBRID_CROSSOVER) {  // crossover K = B taps in direct form, the rest as non-uniform
+            double perSample = B * costs.direct_mac + (M > B ? nonUniformCostPerSample(&costs, B, M - B) : 0);
+            considerEngine(candidates, times, requested, ENGINE_HYBRID, samplesPerThread * perSample, 0, 0, B, B);
+        }
+    }
+    if (SHOW_DEBUG_OUTPUT)  showMessage("\nPlanner estimates:\n");
+    double bestTime = 1e30;
+    for (int e = 0; e < ENGINE_AUTO; e++) {
+        if (times[e] < 0.0)
+            continue;
+        if (SHOW_DEBUG_OUTPUT)
+            showMessage("  %-10s  %.4lf s   (fft-size %d, block-size %d, crossover %d)\n", engineName(e), times[e],
+                   candidates[e].fft_size, candidates[e].block_size, candidates[e].crossover);
+        if (times[e] < bestTime) {
+            bestTime = times[e];  best = candidates[e];
+        }
+    }
+    if (SHOW_DEBUG_OUTPUT)  showMessage("Planner chose:  --engine=%s\n", engineName(best.engine));
+    return best;
+}
+
+
+/*
+    Records the given engine setup as that engine's candidate if it's faster than the one found so far
+    (candidates[] and times[] are indexed by engine; a time < 0 means no candidate yet), as long as its
+    latency is allowed (and, with --stream, it can stream). Zero settings are left as requested.
+*/
+void considerEngine(Options candidates[], double times[], Options* requested, EngineType engine, double time,
+                    int latency, int fftSize, int blockSize, int crossover)
+{
+    if (requested->max_latency >= 0 && latency > requested->max_latency)
+        return;
+    if (requested->stream && !isStreamingEngine(engine))
+        return;
+    if (times[engine] >= 0.0 && time >= times[engine])
+        return;
+
+    times[engine] = time;
+    candidates[engine] = *requested;
+    candidates[engine].engine = engine;
+    if (fftSize)  candidates[engine].fft_size = fftSize;
+    if (blockSize)  candidates[engine].block_size = blockSize;
+    if (crossover)  candidates[engine].crossover = crossover;
+}
+
+
+// Estimated time for one real FFT of the given size
+double fftCost(MachineCosts* costs, int size)
+{
+    return costs->fft_unit * size * log2((double)size);
+}
+
+
+// Estimated time for one block of a UniformConvolver with block size B and an h[] of size M
+double uniformBlockCost(MachineCosts* costs, int B, int M)
+{
+    int K = (M + B - 1) / B;
+    return 2 * fftCost(costs, 2 * B) + (double)K * (B + 1) * costs->spectral_mac + costs->block_overhead;
+}
+
+
+// Estimated time per sample for a NonUniformConvolver with first block size B and an h[] of size M
+double nonUniformCostPerSample(MachineCosts* costs, int B, int M)
+{
+    int headLength = (M < 4 * B) ? M : 4 * B;
+    double cost = uniformBlockCost(costs, B, headLength) / B;
+
+    SegmentLayout layout[MAX_NONUNIFORM_SEGMENTS];
+    int numSegments = planNonUniformSegments(M, B, layout);
+    for (int j = 0; j < numSegments; j++)
+        cost += uniformBlockCost(costs, layout[j].size, layout[j].length) / layout[j].size;
+    return cost;
+}
+
+
+// Times each of the operations in MachineCosts on this machine. Takes about a second.
+void measureMachineCosts(MachineCosts* costs)
+{
+    showMessage("\nCalibrating the planner for this machine...\n");
+
+    // direct-form kernel: 256 taps over 64k outputs
+    int taps = 256, outputs = 65536, repeats = 20;
+    float* xp = (float*)calloc(outputs + taps, sizeof(float));
+    float* hr = (float*)calloc(taps, sizeof(float));
+    float* y = (float*)calloc(outputs, sizeof(float));
+    DirectKernel kernel = directKernelFor(detectIsaLevel());
+    double start = secondsNow();
+    for (int r = 0; r < repeats; r++)
+        kernel(xp, hr, taps, y, outputs);
+    costs->direct_mac = (secondsNow() - start) / ((double)repeats * taps * outputs);
+    free(xp); free(hr); free(y);
+
+    // FFTs and spectral multiply-accumulates at a typical size
+    int size = 8192, numBins = size / 2 + 1;
+    repeats = 2000;
+    FftPlan* plan = createFftPlan(size);
+    float* block = (float*)calloc(size, sizeof(float));
+    Complex* spectrum = (Complex*)calloc(numBins, sizeof(Complex));
+    Complex* accumulator = (Complex*)calloc(numBins, sizeof(Complex));
+    start = secondsNow();
+    for (int r = 0; r < repeats; r++) {
+        forwardRealFFT(plan, block, spectrum);
+        inverseRealFFT(plan, spectrum, block);
+    }
+    costs->fft_unit = (secondsNow() - start) / (2.0 * repeats * size * log2((double)size));
+
+    start = secondsNow();
+    for (int r = 0; r < repeats; r++)
+        multiplyAccumulateSpectra(spectrum, spectrum, accumulator, numBins);
+    costs->spectral_mac = (secondsNow() - start) / ((double)repeats * numBins);
+
+    // per-block overhead: the cost of a tiny UniformConvolver block beyond its FFTs and multiply-accumulates
+    float in[32], out[32];
+    memset(in, 0, sizeof(in));
+    UniformConvolver* tiny = createUniformConvolver(in, 32, 32);
+    repeats = 100000;
+    start = secondsNow();
+    for (int r = 0; r < repeats; r++)
+        processUniformBlock(tiny, in, out);
+    double tinyBlock = (secondsNow() - start) / repeats;
+    costs->block_overhead = tinyBlock - 2 * fftCost(costs, 64) - 33 * costs->spectral_mac;
+    if (costs->block_overhead < 0)  costs->block_overhead = 0;
+    destroyUniformConvolver(tiny);
+
+    free(block); free(spectrum); free(accumulator);
+    destroyFftPlan(plan);
+    showMessage("direct_mac %.3e s, fft_unit %.3e s, spectral_mac %.3e s, block_overhead %.3e s\n",
+           costs->direct_mac, costs->fft_unit, costs->spectral_mac, costs->block_overhead);
+}
+
+
+/*
+    Wisdom file format (text):
+
+        convolve-wisdom 1
+        isa avx512
+        direct_mac 4.1e-11
+        fft_unit 6.9e-10
+        spectral_mac 1.2e-09
+        block_overhead 2.1e-07
+
+    Returns false (leaving costs alone) if the file doesn't exist, is unreadable, or was measured with a
+    different instruction set than this CPU's.
+*/
+bool loadWisdom(char* fileName, MachineCosts* costs)
+{
+    FILE* file = fileName ? fopen(fileName, "r") : NULL;
+    if (!file)
+        return false;
+
+    int version = 0;
+    char isa[32] = "";
+    MachineCosts loaded;
+    int numRead = fscanf(file, "convolve-wisdom %d isa %31s direct_mac %lf fft_unit %lf spectral_mac %lf block_overhead %lf",
+                         &version, isa, &loaded.direct_mac, &loaded.fft_unit, &loaded.spectral_mac, &loaded.block_overhead);
+    fclose(file);
+
+    if (numRead != 6 || version != 1 || strcmp(isa, isaName(detectIsaLevel())) != 0)
+        return false;
+    *costs = loaded;
+    return true;
+}
+
+
+void saveWisdom(char* fileName, MachineCosts* costs)
+{
+    FILE* file = fileName ? fopen(fileName, "w") : NULL;
+    if (!file) {
+        showMessage("Couldn't write the wisdom file %s\n", fileName ? fileName : "(none)");
+        return;
+    }
+    fprintf(file, "convolve-wisdom 1\nisa %s\n", isaName(detectIsaLevel()));
+    fprintf(file, "direct_mac %.6e\nfft_unit %.6e\nspectral_mac %.6e\nblock_overhead %.6e\n",
+            costs->direct_mac, costs->fft_unit, costs->spectral_mac, costs->block_overhead);
+    fclose(file);
+}
+
+
+// Returns the path of the named file in the user's home directory, or NULL if there's no home directory
+char* homeDirectoryFile(const char* name)
+{
+    char* home = getenv("HOME");
+    if (!home)
+        return NULL;
+    char* path = (char*)malloc(strlen(home) + strlen(name) + 2);
+    sprintf(path, "%s/%s", home, name);
+    return path;
+}
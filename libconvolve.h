@@ -0,0 +1,195 @@
+/*
+    libconvolve: the convolution engines of convolve, for use from other programs (render services, plug-ins
+    and the like) without going through files or starting a process per job.
+
+    A program creates an engine handle, gives it an impulse response, and then either convolves whole
+    buffers with it (convolve_process_buffer()) or feeds it a stream of audio in blocks of any size
+    (convolve_process_stream()). The handle keeps whatever it has worked out from the impulse response (the
+    planner's choice, partition spectra, the hybrid engine's crossover) from one call to the next, so only
+    the first call after convolve_set_ir() pays for it.
+
+    Audio is float, one array per channel, in the range -1.0 to +1.0. The output is left unscaled: the
+    convolution of full-scale audio with an impulse response can go well beyond full scale, and it's up to
+    the caller what to do about that (the command line program's --normalize options are one way).
+
+    For audio callbacks there are real-time convolvers (convolve_realtime_create()), which have no latency
+    and whose impulse response can be changed on the fly.
+
+    Channels: a mono impulse response is applied to every input channel; one with as many channels as the
+    input, channel by channel; a mono input with an N-channel impulse response gives N output channels; and
+    a 4-channel impulse response on a stereo input is true stereo (L->L, L->R, R->L, R->R). Anything else is
+    CONVOLVE_ERROR_CHANNELS. convolve_output_channels() says how many output channels there will be.
+
+    Functions that can fail return one of the CONVOLVE_ERROR codes (all negative), or CONVOLVE_OK.
+    A handle must only be used by one thread at a time; separate handles can be used at the same time.
+    Build and link: see the Makefile (make gives libconvolve.a and libconvolve.so), then -lconvolve -lm -pthread.
+*/
+#ifndef LIBCONVOLVE_H
+#define LIBCONVOLVE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONVOLVE_API_VERSION  1   // changes only when the interface below changes incompatibly
+
+#if defined(__GNUC__)
+#define CONVOLVE_API  __attribute__((visibility("default")))
+#else
+#define CONVOLVE_API
+#endif
+
+
+// an engine handle (see convolve_create())
+typedef struct convolve_engine convolve_engine;
+
+
+// what the CONVOLVE_OPTION_ENGINE option can be set to (see --engine in convolve.c)
+enum {
+    CONVOLVE_ENGINE_AUTO       = 0,  // let the planner pick whichever it estimates is fastest (the default)
+    CONVOLVE_ENGINE_DIRECT     = 1,
+    CONVOLVE_ENGINE_SIMD       = 2,
+    CONVOLVE_ENGINE_BLOCKED    = 3,
+    CONVOLVE_ENGINE_FFT        = 4,
+    CONVOLVE_ENGINE_UPOLS      = 5,
+    CONVOLVE_ENGINE_NONUNIFORM = 6,
+    CONVOLVE_ENGINE_HYBRID     = 7
+};
+
+
+// what the CONVOLVE_OPTION_ISA option can be set to (see --isa)
+enum {
+    CONVOLVE_ISA_AUTO   = 0,         // the best one the CPU supports (the default)
+    CONVOLVE_ISA_SCALAR = 1,
+    CONVOLVE_ISA_SSE    = 2,
+    CONVOLVE_ISA_AVX2   = 3,
+    CONVOLVE_ISA_AVX512 = 4
+};
+
+
+// the settings convolve_set_option() takes, each the same as the command line option of that name
+typedef enum {
+    CONVOLVE_OPTION_ENGINE      = 0, // one of the CONVOLVE_ENGINE values
+    CONVOLVE_OPTION_THREADS     = 1, // threads convolve_process_buffer() splits the work across, 0 = one per CPU (default 1)
+    CONVOLVE_OPTION_BLOCK_SIZE  = 2, // (first) partition size for the upols and nonuniform engines, a power of 2 (default 2048)
+    CONVOLVE_OPTION_FFT_SIZE    = 3, // FFT size for the fft engine, a power of 2, 0 = chosen from the impulse response (default)
+    CONVOLVE_OPTION_CROSSOVER   = 4, // direct-form taps for the hybrid engine, a power of 2, 0 = picked by benchmark (default)
+    CONVOLVE_OPTION_MAX_LATENCY = 5, // for the planner: most samples of latency allowed, -1 = no limit (default)
+    CONVOLVE_OPTION_ISA         = 6  // one of the CONVOLVE_ISA values
+} convolve_option;
+
+
+// results of the functions that can fail
+enum {
+    CONVOLVE_OK             =  0,
+    CONVOLVE_ERROR_ARGUMENT = -1,    // a NULL pointer, a count out of range, or an option value that isn't allowed
+    CONVOLVE_ERROR_NO_IR    = -2,    // no impulse response has been set
+    CONVOLVE_ERROR_CHANNELS = -3,    // that many input channels can't be convolved with the impulse response's channels
+    CONVOLVE_ERROR_ENGINE   = -4     // the engine asked for can't do that (only upols, nonuniform and hybrid can stream)
+};
+
+
+// Creates an engine handle with the default settings and no impulse response. Returns NULL if out of memory.
+CONVOLVE_API convolve_engine* convolve_create(void);
+
+// Frees the handle and everything it holds. NULL is allowed.
+CONVOLVE_API void convolve_free(convolve_engine* engine);
+
+/*
+    Changes one of the settings. Ends the stream being convolved, if there is one, as if convolve_reset()
+    had been called. The block, FFT and crossover sizes can be at most 2^24; CONVOLVE_ERROR_ARGUMENT is
+    returned for a value out of range.
+*/
+CONVOLVE_API int convolve_set_option(convolve_engine* engine, convolve_option option, int value);
+
+/*
+    The wisdom file the planner reads this machine's measured speeds from (made with convolve --calibrate),
+    or NULL to use its built-in estimates. The default is ~/.convolve_wisdom, as for the command line program.
+*/
+CONVOLVE_API int convolve_set_wisdom_file(convolve_engine* engine, const char* path);
+
+/*
+    Has the FFT engines keep their precomputed tables in the cache file at path (see --plan-cache), shared
+    with the command line program and other processes, or not (NULL, the default). This is for the whole
+    process, and has to be called before any engine does any convolving.
+*/
+CONVOLVE_API int convolve_set_plan_cache(const char* path);
+
+/*
+    Sets the impulse response: h[] is channels arrays (1 to 8) of length samples each. They are copied, so
+    the caller can free them afterwards. Ends the stream being convolved, if there is one.
+*/
+CONVOLVE_API int convolve_set_ir(convolve_engine* engine, const float* const h[], int channels, int length);
+
+// Number of output channels an input of inputChannels channels gives with the impulse response set, or an error
+CONVOLVE_API int convolve_output_channels(convolve_engine* engine, int inputChannels);
+
+/*
+    Convolves a whole buffer: x[] is channels arrays of length samples each, and y[] must be
+    convolve_output_channels(channels) arrays of length + (impulse response length) - 1 samples each, which
+    the complete convolution is written to. Uses CONVOLVE_OPTION_THREADS threads.
+*/
+CONVOLVE_API int convolve_process_buffer(convolve_engine* engine, const float* const x[], int channels, int length,
+                                         float* const y[]);
+
+/*
+    Convolves a stream of audio, any number of frames at a time: x[] is channels arrays of frames samples
+    each, and y[] gets frames samples of each output channel. The output lags the input by
+    convolve_stream_latency() samples; to get the end of the convolution out, carry on feeding it zeros.
+    Only the upols, nonuniform and hybrid engines can stream (CONVOLVE_ENGINE_AUTO picks among them).
+    The number of channels has to stay the same until the stream is ended by convolve_reset().
+*/
+CONVOLVE_API int convolve_process_stream(convolve_engine* engine, const float* const x[], int channels,
+                                         float* const y[], int frames);
+
+// Samples by which convolve_process_stream()'s output lags its input with the impulse response set, or an error
+CONVOLVE_API int convolve_stream_latency(convolve_engine* engine);
+
+// Ends the stream being convolved: the next convolve_process_stream() call starts a new one, from silence
+CONVOLVE_API int convolve_reset(convolve_engine* engine);
+
+
+/*
+    Real-time convolution, for audio callbacks: one channel per handle, with no latency, and
+    convolve_realtime_process() never allocates, locks, waits or does I/O. The head of the impulse response
+    is convolved in the call itself, and the rest on a background thread of the handle's own. The impulse
+    response can be changed while the callback is running (convolve_realtime_swap_ir()), crossfading from
+    the old one to the new one. For several channels, use a handle for each.
+*/
+typedef struct convolve_realtime convolve_realtime;
+
+/*
+    Creates a real-time convolver for h[] (length samples, copied). block_size is the partition size done in
+    the callback, a power of 2: every call has to convolve a multiple of it (so a callback of 480 frames can
+    use 32, or 16...). tail_block_size is the background thread's partition size (rounded up to a power of
+    2); a few times the callback size leaves the thread room for scheduling jitter. Both can be at most 2^24.
+    crossfade is how many samples a swap's crossfade takes. Returns NULL if any of them isn't allowed.
+*/
+CONVOLVE_API convolve_realtime* convolve_realtime_create(const float* h, int length, int block_size, int tail_block_size,
+                                                         int crossfade);
+
+// Convolves the next frames samples of in[] into out[] (which can be the same array). For the audio callback.
+CONVOLVE_API int convolve_realtime_process(convolve_realtime* rt, const float* in, float* out, int frames);
+
+/*
+    Changes the impulse response to h[] (length samples, copied) without stopping the callback: it is
+    transformed on the background thread, and crossfaded in at the start of a later call. Call it from some
+    other thread than the callback's; it doesn't wait for the new impulse response to be ready.
+*/
+CONVOLVE_API int convolve_realtime_swap_ir(convolve_realtime* rt, const float* h, int length);
+
+// Stops the handle's threads and frees it. NULL is allowed. Not while convolve_realtime_process() is running.
+CONVOLVE_API void convolve_realtime_free(convolve_realtime* rt);
+
+
+// A description of one of the CONVOLVE_ERROR codes
+CONVOLVE_API const char* convolve_error_string(int error);
+
+// CONVOLVE_API_VERSION as it was when the library was built, for checking it against the header's
+CONVOLVE_API int convolve_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif